@@ -8,235 +8,3664 @@
 //   Last Modified : 4/30/20
 //
 
-// Includes 
+// Includes
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libgen.h>
 #include <cmpsc311_log.h>
 #include <lcloud_cache.h>
 
 typedef struct {
-    int cache_line;
-    LcDeviceId device_id;
-    uint16_t sector;
-    uint16_t block;
-    int timestamp;
+    uint64_t key;  //key of the block plus one, 0 if the way is empty
+    uint64_t stamp;  //when the way was last filled, for LRU within the set
+    int dirty;
+} L2Way;
+
+typedef struct {
+    uint32_t magic;  //LC_CACHE_SHARED_MAGIC
+    uint32_t version;  //LC_CACHE_SHARED_VERSION
+    uint32_t ready;  //set last by the creating process, the others wait for it
+    int sets;  //the ways (L2Way) and then the block data follow this header
+    pthread_mutex_t attach_lock;  //robust and process-shared, guards pids and unlinked
+    pid_t pids[LC_CACHE_SHARED_MAXPROCS];  //processes attached, 0 if the slot is free
+    uint32_t unlinked;  //the name was removed, this segment must not be joined
+    uint64_t recovered;  //stripes emptied after their lock holder died
+    pthread_mutex_t locks[LC_CACHE_SHARED_LOCKS];  //robust and process-shared, stripe (set % LOCKS)
+    uint64_t clock[LC_CACHE_SHARED_LOCKS];  //one clock per stripe, for LRU within a set
+    uint64_t writes[LC_CACHE_SHARED_LOCKS];  //device writes made through each stripe
+} SharedHeader;
+
+typedef struct {
+    uint32_t magic;  //LC_CACHE_SNAPSHOT_MAGIC
+    uint32_t version;  //LC_CACHE_SNAPSHOT_VERSION
+    uint32_t entries;  //SnapshotEntry records that follow, most recently used first
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t key;  //the block
+    uint64_t stamp;  //hash of its contents when the snapshot was taken
+} SnapshotEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t last_miss;  //block address of the previous miss, -1 if none
+    int64_t stride;  //last difference between miss addresses
+    int confirmed;  //1 once the same stride was seen twice in a row
+    int64_t table_from[LC_CACHE_PREFETCH_TABLE];  //correlation table, miss address -> the miss that followed it
+    int64_t table_to[LC_CACHE_PREFETCH_TABLE];
+    int degree;  //blocks to prefetch per miss, 0 while backed off
+    int backoff;  //misses left to sit out
+    uint64_t useful;  //feedback, updated atomically from the shards
+    uint64_t useless;
+    uint64_t judged;  //useful + useless at the last accuracy check
+    uint64_t judged_useful;
+} Prefetcher;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int num_lines;  //line metadata is kept as parallel arrays, so index and LRU walks never touch block data
+    uint64_t *keys;  //key of the block in each line
+    int *prev;  //neighbouring line towards the most recently used end of the LRU list
+    int *next;  //neighbouring line towards the least recently used end (or the next free line)
+    int *hash_next;  //next line in the same hash bucket
+    uint8_t *dirty;  //written by the filesystem but not yet by the device (write-back only)
+    uint8_t *prefetched;  //brought in speculatively and not used yet
+    uint8_t *owner;  //partition the line is charged to
+    uint16_t *pins;  //references holding the line in the metadata area, 0 if it is on the LRU list
+    uint64_t *dirty_since;  //when a dirty line was first written (ms), for the flusher's age limit
+    char *data;  //this shard's slice of the arena, 256 bytes per line
+    int free_line;  //head of the list of unused lines
+    int *buckets;  //heads of the hash chains, -1 if empty
+    int num_buckets;
+    int most_recent;  //head and tail of the LRU list
+    int least_recent;
+    int pinned;  //head of the list of pinned lines, which eviction never walks
+
+    uint8_t sketch[LC_CACHE_SKETCH_DEPTH][LC_CACHE_SKETCH_WIDTH / 2];  //count-min sketch, two 4-bit counters per byte
+    unsigned long sketch_additions;  //accesses recorded since the sketch was last aged
+    unsigned long sketch_sample_size;
+
+    uint64_t *reuse_keys;  //recently accessed keys (plus one, 0 is empty) and when they were accessed
+    uint64_t *reuse_clock;
+    int reuse_slots;
+    uint64_t clock;  //accesses made to this shard
+    uint64_t *ghost_keys;  //ring of keys (plus one, 0 is empty) evicted for capacity, as many as there are lines
+    int *ghost_next;  //next ring slot in the same ghost hash bucket
+    int *ghost_buckets;  //heads of the ghost hash chains, -1 if empty
+    uint64_t ghost_head;  //capacity evictions recorded, the next one goes in slot (ghost_head % num_lines)
+    uint64_t writes;  //blocks written into this shard, a prefetch read that raced a write is dropped
+    int partition_min[LC_CACHE_MAXPARTITIONS];  //this shard's share of each partition's reservation and cap
+    int partition_max[LC_CACHE_MAXPARTITIONS];
+
+    LcCacheStats stats;  //statistics, only touched while holding the shard lock
+} __attribute__((aligned(64))) CacheShard;
+
+CacheShard *shards = NULL;
+int num_shards = LC_CACHE_SHARDS;
+char *arena = NULL;  //block data of every line, one 64-byte aligned slab
+size_t arena_size = 0;
+int arena_mapped = 0;  //1 if the arena came from mmap rather than the heap
+int huge_pages = 0;
+int partitions_enabled = 0;  //set once any partition has a reservation or cap
+int partition_min[LC_CACHE_MAXPARTITIONS];  //lines always left to the partition
+int partition_max[LC_CACHE_MAXPARTITIONS];  //most lines the partition may hold, 0 for no cap
+int device_partition[LC_CACHE_MAXDEVICES];  //partition of a device's blocks when the thread names none
+int metadata_limit = LC_CACHE_METADATA_BLOCKS;  //most lines that may be pinned at once
+int metadata_lines = 0;  //lines pinned now, over all shards
+int advisor_enabled = 0;  //keep the ghost lists and estimate the hits of a larger cache
+uint64_t advisor_lookups = 0;  //lookups seen by the advisor, updated atomically
+uint64_t advisor_hits[LC_CACHE_ADVISOR_SIZES];  //misses each larger size would have hit, updated atomically
+
+int flusher_enabled = 0;  //background write-behind, write-back mode only
+int dirty_background = LC_CACHE_DIRTY_BACKGROUND;  //% of lines dirty that wakes the flusher
+int dirty_hard = LC_CACHE_DIRTY_HARD;  //% of lines dirty that throttles writers
+int dirty_age = LC_CACHE_DIRTY_AGE;  //ms a line may stay dirty
+int total_lines = 0;
+int dirty_lines = 0;  //dirty L1 lines now, over all shards
+int peak_dirty_lines = 0;
+pthread_t flusher_thread;
+int flusher_running = 0;
+int flusher_stop = 0;
+int flusher_stalled = 0;  //the last round only had failed writes, so throttled writers stop waiting (under flusher_mutex)
+pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;  //guards flusher_stop and the waits on flusher_cond
+pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;  //wakes the flusher, and writers waiting out a throttle
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;  //orders device writes of dirty data, taken last
+uint64_t flusher_rounds = 0;  //flusher statistics, updated under writeback_lock
+uint64_t flusher_blocks = 0;
+uint64_t flusher_batches = 0;
+uint64_t flusher_failed = 0;  //blocks whose write failed, left dirty
+uint64_t flusher_busy_ms = 0;
+uint64_t l2_writebacks = 0;  //second-tier blocks written back by a flush, under writeback_lock
+uint64_t throttle_count = 0;  //updated atomically by the writers
+uint64_t throttle_ms = 0;
+char *snapshot_path = NULL;  //warm-cache snapshot, read at init and rewritten at close
+pthread_t warm_thread;
+int warm_running = 0;
+volatile int warm_stop = 0;  //tells the warming thread to give up early
+int admission_enabled = 0;
+char *stats_file = NULL;
+int write_back = 0;
+LcCacheBlockIo read_block_func = NULL;
+LcCacheBlockIo write_block_func = NULL;
+LcCacheRunIo write_run_func = NULL;  //writes a run of adjacent blocks in one transfer, if set
+
+char *l2_path = NULL;  //second tier: metadata in memory, block data in a memory mapped file
+int l2_maxblocks = 0;
+int l2_sets = 0;
+int l2_fd = -1;
+char *l2_data = NULL;
+L2Way *l2_ways = NULL;
+pthread_mutex_t l2_locks[LC_CACHE_L2_LOCKS];
+uint64_t l2_clock[LC_CACHE_L2_LOCKS];  //one clock per lock stripe, ways of a set share a stripe
+
+char *shared_name = NULL;  //cross-process cache: every block lives in one POSIX shared memory segment
+SharedHeader *shared = NULL;
+L2Way *shared_ways = NULL;
+char *shared_data = NULL;
+int shared_fd = -1;
+size_t shared_mapped = 0;
+
+int prefetch_enabled = 0;
+Prefetcher prefetchers[LC_CACHE_MAXDEVICES];
+int geometry_blocks[LC_CACHE_MAXDEVICES];  //blocks per sector, 0 if unknown
+int geometry_sectors[LC_CACHE_MAXDEVICES];
+
+__thread uint64_t last_miss_key = 0;  //key of this thread's most recent miss, already recorded in the sketch
+__thread int last_miss_valid = 0;
+__thread LcCacheCaller cache_caller = LC_CACHE_CALLER_OTHER;
+__thread int cache_partition = -1;  //partition this thread's blocks go to, -1 to go by device
+__thread uint64_t prefetch_pending[LC_CACHE_PREFETCH_MAXDEGREE];  //prefetches to issue once the miss is filled
+__thread int prefetch_pending_count = 0;
+__thread uint64_t shared_miss_writes = 0;  //stripe write count when this thread's last shared miss was seen
+__thread char shared_block[256];  //lcloud_getcache's copy of a shared block, or of one left in the second tier
+__thread uint64_t prefetch_pending_key = 0;
+
+const char *LC_CACHE_EVENT_LABELS[LC_CACHE_MAXEVENT] = { "hits", "misses", "inserts", "updates", "evictions" };
+const char *LC_CACHE_CALLER_LABELS[LC_CACHE_MAXCALLER] = { "other", "read", "write" };
+const char *LC_CACHE_EVICT_LABELS[LC_CACHE_MAXEVICT] = { "capacity", "close" };
+const char *LC_CACHE_ADVISOR_LABELS[LC_CACHE_ADVISOR_SIZES] = { "+10%", "+50%", "2x" };
+const int LC_CACHE_ADVISOR_TENTHS[LC_CACHE_ADVISOR_SIZES] = { 1, 5, 10 };  //extra lines of each size, in tenths of the cache
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_key
+// Description  : packs a device/sector/block location into a single key
+//
+// Inputs       : did - device number of the block
+//                sec - sector number of the block
+//                blk - block number of the block
+// Outputs      : the 64-bit key for the location
+uint64_t cache_key(LcDeviceId did, uint16_t sec, uint16_t blk) {
+
+    return(((uint64_t)did << 32) | ((uint64_t)sec << 16) | (uint64_t)blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_hash
+// Description  : scrambles a key so that neighbouring blocks spread evenly over
+//                the shards, hash buckets and sketch rows (splitmix64 finalizer)
+//
+// Inputs       : key - the key to hash
+// Outputs      : the 64-bit hash of the key
+uint64_t cache_hash(uint64_t key) {
+
+    uint64_t hash = key + 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return(hash ^ (hash >> 31));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard
+// Description  : selects the shard that owns a key
+//
+// Inputs       : hash - the hash of the key
+// Outputs      : pointer to the owning shard
+CacheShard * cache_shard(uint64_t hash) {
+
+    return(&shards[(hash >> 40) % num_shards]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_counter
+// Description  : finds the sketch counter for a key in one row of the sketch
+//
+// Inputs       : shard - the shard whose sketch is used
+//                hash - the hash of the key being counted
+//                row - the sketch row (hash function) to use
+//                shift - set to the bit offset of the 4-bit counter within its byte
+// Outputs      : pointer to the byte holding the counter
+uint8_t * sketch_counter(CacheShard *shard, uint64_t hash, int row, int *shift) {
+
+    uint32_t index = ((uint32_t)hash + (uint32_t)row * ((uint32_t)(hash >> 32) | 1)) & (LC_CACHE_SKETCH_WIDTH - 1);
+    *shift = (index & 1) * 4;
+    return(&shard->sketch[row][index / 2]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_count
+// Description  : reads the 4-bit counter for a key in one row of the sketch,
+//                the shift being set by sketch_counter before it is used
+//
+// Inputs       : shard - the shard whose sketch is used
+//                hash - the hash of the key being counted
+//                row - the sketch row (hash function) to use
+// Outputs      : the counter value
+int sketch_count(CacheShard *shard, uint64_t hash, int row) {
+
+    int shift;
+    uint8_t *counter = sketch_counter(shard, hash, row, &shift);
+    return((*counter >> shift) & 0x0f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_estimate
+// Description  : estimates how often a key has been accessed recently
+//
+// Inputs       : shard - the shard whose sketch is used
+//                hash - the hash of the key to estimate
+// Outputs      : the smallest counter value for the key across all rows
+int sketch_estimate(CacheShard *shard, uint64_t hash) {
+
+    int estimate = LC_CACHE_SKETCH_MAXCOUNT;
+    for (int row = 0; row < LC_CACHE_SKETCH_DEPTH; row++) {
+
+        int count = sketch_count(shard, hash, row);
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return(estimate);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_increment
+// Description  : records an access to a key, halving every counter once the
+//                sample period is reached so that old popularity fades out
+//
+// Inputs       : shard - the shard whose sketch is used
+//                hash - the hash of the key that was accessed
+// Outputs      : nothing
+void sketch_increment(CacheShard *shard, uint64_t hash) {
+
+    int estimate = sketch_estimate(shard, hash);
+    if (estimate < LC_CACHE_SKETCH_MAXCOUNT) {
+
+        for (int row = 0; row < LC_CACHE_SKETCH_DEPTH; row++) {  //conservative update, only raise the counters at the minimum
+
+            if (sketch_count(shard, hash, row) == estimate) {
+                int shift;
+                uint8_t *counter = sketch_counter(shard, hash, row, &shift);
+                *counter += (1 << shift);
+            }
+        }
+    }
+
+    shard->sketch_additions += 1;
+    if (shard->sketch_additions >= shard->sketch_sample_size) {  //age the sketch, halving both counters in every byte
+
+        for (int row = 0; row < LC_CACHE_SKETCH_DEPTH; row++) {
+            for (int index = 0; index < LC_CACHE_SKETCH_WIDTH / 2; index++) {
+                shard->sketch[row][index] = (shard->sketch[row][index] >> 1) & 0x77;
+            }
+        }
+        shard->sketch_additions /= 2;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_event
+// Description  : counts a cache event against the block's device, the
+//                calling path and the partition (the shard lock must be held)
+//
+// Inputs       : shard - the shard the event happened in
+//                did - device number of the block involved
+//                partition - partition the block is charged to
+//                event - the event to count
+// Outputs      : nothing
+void count_event(CacheShard *shard, LcDeviceId did, int partition, LcCacheEvent event) {
+
+    shard->stats.total[event] += 1;
+    shard->stats.caller[cache_caller][event] += 1;
+    shard->stats.partition[partition][event] += 1;
+    if (did < LC_CACHE_MAXDEVICES) {
+        shard->stats.device[did][event] += 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_partition
+// Description  : finds the partition a block is charged to, the one the
+//                thread selected, or else the one of the block's device
+//
+// Inputs       : did - device number of the block
+// Outputs      : the partition
+int block_partition(LcDeviceId did) {
+
+    if (cache_partition != -1) {
+        return(cache_partition);
+    }
+    return((did < LC_CACHE_MAXDEVICES) ? device_partition[did] : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_access
+// Description  : feeds an access into the admission sketch and the reuse
+//                distance histogram (the shard lock must be held).  The reuse
+//                distance is the number of accesses since the key was last
+//                seen, scaled up by the shard count to approximate the
+//                distance across the whole cache.
+//
+// Inputs       : shard - the shard that owns the key
+//                hash - the hash of the key
+//                key - the key that was accessed
+// Outputs      : nothing
+void record_access(CacheShard *shard, uint64_t hash, uint64_t key) {
+
+    if (admission_enabled == 1) {  //every access counts towards the block's popularity
+        sketch_increment(shard, hash);
+    }
+
+    shard->clock += 1;
+    int slot = (hash >> 16) % shard->reuse_slots;
+    int bucket = 0;  //first time seen (or forgotten)
+    if (shard->reuse_keys[slot] == key + 1) {
+
+        uint64_t distance = (shard->clock - shard->reuse_clock[slot]) * num_shards;
+        bucket = 1;
+        while ((distance >>= 1) != 0 && bucket < LC_CACHE_REUSE_BUCKETS - 1) {
+            bucket += 1;
+        }
+    }
+    shard->stats.reuse[bucket] += 1;
+    shard->reuse_keys[slot] = key + 1;
+    shard->reuse_clock[slot] = shard->clock;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_unlink
+// Description  : removes a line from its shard's LRU list
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line to remove
+// Outputs      : nothing
+void lru_unlink(CacheShard *shard, int line) {
+
+    int prev = shard->prev[line], next = shard->next[line];
+    if (prev != -1) {
+        shard->next[prev] = next;
+    }
+    else {
+        shard->most_recent = next;
+    }
+
+    if (next != -1) {
+        shard->prev[next] = prev;
+    }
+    else {
+        shard->least_recent = prev;
+    }
+    shard->prev[line] = -1;
+    shard->next[line] = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_push
+// Description  : makes a line the most recently used line of its shard
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line to insert
+// Outputs      : nothing
+void lru_push(CacheShard *shard, int line) {
+
+    shard->prev[line] = -1;
+    shard->next[line] = shard->most_recent;
+    if (shard->most_recent != -1) {
+        shard->prev[shard->most_recent] = line;
+    }
+    shard->most_recent = line;
+    if (shard->least_recent == -1) {
+        shard->least_recent = line;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : touch_line
+// Description  : makes a line the most recently used, pinned lines stay put
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line that was used
+// Outputs      : nothing
+void touch_line(CacheShard *shard, int line) {
+
+    if (shard->pins[line] == 0) {
+        lru_unlink(shard, line);
+        lru_push(shard, line);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : first_cached
+// Description  : starts a walk over every cached line of a shard, the pinned
+//                lines first and then the LRU list, most recent first
+//
+// Inputs       : shard - the shard to walk
+// Outputs      : index of the first line, -1 if nothing is cached
+int first_cached(CacheShard *shard) {
+
+    return((shard->pinned != -1) ? shard->pinned : shard->most_recent);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_cached
+// Description  : continues a walk started by first_cached
+//
+// Inputs       : shard - the shard being walked
+//                line - the line visited last
+// Outputs      : index of the next line, -1 at the end
+int next_cached(CacheShard *shard, int line) {
+
+    if ((shard->next[line] == -1) && (shard->pins[line] > 0)) {  //end of the pinned lines
+        return(shard->most_recent);
+    }
+    return(shard->next[line]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_line
+// Description  : looks a block up in its shard's hash index
+//
+// Inputs       : shard - the shard that owns the block
+//                hash - the hash of the block's key
+//                did, sec, blk - the location of the block
+// Outputs      : index of the line holding the block, -1 if not cached
+int find_line(CacheShard *shard, uint64_t hash, LcDeviceId did, uint16_t sec, uint16_t blk) {
+
+    uint64_t key = cache_key(did, sec, blk);
+    int line = shard->buckets[hash & (shard->num_buckets - 1)];
+    while ((line != -1) && (shard->keys[line] != key)) {
+        line = shard->hash_next[line];
+    }
+    return(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : line_data
+// Description  : finds the block data of a line in the arena
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line
+// Outputs      : pointer to the 256 bytes of the line
+char * line_data(CacheShard *shard, int line) {
+
+    return(&shard->data[(size_t)line * 256]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unhash_line
+// Description  : removes a line from its shard's hash index
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line to remove
+// Outputs      : nothing
+void unhash_line(CacheShard *shard, int line) {
+
+    uint64_t hash = cache_hash(shard->keys[line]);
+    int *link = &shard->buckets[hash & (shard->num_buckets - 1)];
+    while (*link != -1) {
+
+        if (*link == line) {
+            *link = shard->hash_next[line];
+            break;
+        }
+        link = &shard->hash_next[*link];
+    }
+    shard->hash_next[line] = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : now_ms
+// Description  : reads the monotonic clock
+//
+// Inputs       : none
+// Outputs      : milliseconds since some fixed point
+uint64_t now_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_dirty
+// Description  : marks a line dirty or clean, keeping the dirty count and the
+//                time the line first became dirty (shard lock held)
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line
+//                dirty - 1 if the line now differs from the device, 0 if not
+// Outputs      : nothing
+void set_dirty(CacheShard *shard, int line, int dirty) {
+
+    if (shard->dirty[line] == dirty) {  //a rewrite keeps the age of the first write
+        return;
+    }
+
+    shard->dirty[line] = dirty;
+    if (dirty == 1) {
+
+        shard->dirty_since[line] = now_ms();
+        int count = __atomic_add_fetch(&dirty_lines, 1, __ATOMIC_RELAXED);
+        if (count > __atomic_load_n(&peak_dirty_lines, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&peak_dirty_lines, count, __ATOMIC_RELAXED);
+        }
+        if ((flusher_running == 1) && ((count - 1) * 100 < dirty_background * total_lines) && (count * 100 >= dirty_background * total_lines)) {  //crossing the background ratio
+            pthread_cond_broadcast(&flusher_cond);
+        }
+    }
+    else {
+        __atomic_sub_fetch(&dirty_lines, 1, __ATOMIC_RELAXED);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_back_block
+// Description  : writes a dirty block to its device
+//
+// Inputs       : shard - the shard whose statistics are charged, NULL for a
+//                        second-tier block written back by a flush
+//                key - the key of the block
+//                data - the 256 bytes of the block
+// Outputs      : 0 if successful, -1 if failure
+int write_back_block(CacheShard *shard, uint64_t key, char *data) {
+
+    int did = (key >> 32) & 0xff, sec = (key >> 16) & 0xffff, blk = key & 0xffff;
+    pthread_mutex_lock(&writeback_lock);  //lands after any older copy the flusher is writing
+    int result = ((write_block_func == NULL) ? -1 : write_block_func(data, did, sec, blk));
+    if ((result == 0) && (shard == NULL)) {
+        l2_writebacks += 1;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    if (result == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed writing back dirty cache item [%d/%d/%d]", did, sec, blk);
+        return(-1);
+    }
+
+    if (shard != NULL) {
+        shard->stats.writebacks += 1;
+    }
+    logMessage(LOG_INFO_LEVEL, "Wrote back dirty cache item [%d/%d/%d]", did, sec, blk);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_set
+// Description  : finds the second-tier set a key maps to and locks its stripe
+//
+// Inputs       : key - the key of the block
+// Outputs      : index of the set
+int l2_set(uint64_t key) {
+
+    int set = (cache_hash(key) >> 24) % l2_sets;
+    pthread_mutex_lock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    return(set);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_pick
+// Description  : chooses the way of a set a new block would replace, an
+//                empty way if there is one, then the least recently filled
+//                (stripe lock held)
+//
+// Inputs       : set - the set
+// Outputs      : index of the way within the set
+int l2_pick(int set) {
+
+    L2Way *ways = &l2_ways[set * LC_CACHE_L2_WAYS];
+    int way = 0;
+    for (int w = 0; w < LC_CACHE_L2_WAYS; w++) {
+
+        if (ways[w].key == 0) {
+            return(w);
+        }
+        if (ways[w].stamp < ways[way].stamp) {
+            way = w;
+        }
+    }
+    return(way);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_displaced
+// Description  : finds the block storing a key in the second tier would
+//                push out, if it is dirty and would need writing back first
+//
+// Inputs       : key - the key of the block to be stored
+//                victim - set to the key of the dirty block
+//                data - place to put its 256 bytes
+// Outputs      : 1 if a dirty block would be pushed out, 0 if not
+int l2_displaced(uint64_t key, uint64_t *victim, char *data) {
+
+    int set = l2_set(key);
+    L2Way *way = &l2_ways[set * LC_CACHE_L2_WAYS + l2_pick(set)];
+    int dirty = ((way->key != 0) && (way->dirty == 1) && (way->key != key + 1));
+    if (dirty == 1) {
+        *victim = way->key - 1;
+        memcpy(data, &l2_data[((size_t)(way - l2_ways)) * 256], 256);
+    }
+    pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    return(dirty);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_clean
+// Description  : marks a second-tier block clean after it was written back,
+//                unless it has been replaced or changed meanwhile
+//
+// Inputs       : key - the key of the block
+//                data - the 256 bytes that were written
+// Outputs      : nothing
+void l2_clean(uint64_t key, char *data) {
+
+    int set = l2_set(key);
+    for (int w = 0; w < LC_CACHE_L2_WAYS; w++) {
+
+        L2Way *way = &l2_ways[set * LC_CACHE_L2_WAYS + w];
+        if ((way->key == key + 1) && (memcmp(&l2_data[((size_t)set * LC_CACHE_L2_WAYS + w) * 256], data, 256) == 0)) {
+            way->dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_store
+// Description  : demotes a block evicted from memory into the second tier,
+//                replacing the least recently filled way of its set (and
+//                writing that way back first if it is dirty).  If that
+//                write fails nothing is stored, and the way keeps its block.
+//
+// Inputs       : shard - the shard whose statistics are charged
+//                key - the key of the block
+//                data - the 256 bytes of the block
+//                dirty - 1 if the block hasn't been written to the device
+// Outputs      : 0 if successful, -1 if the displaced block failed to write
+int l2_store(CacheShard *shard, uint64_t key, char *data, int dirty) {
+
+    int set = l2_set(key);
+    L2Way *ways = &l2_ways[set * LC_CACHE_L2_WAYS];
+    int way = l2_pick(set);
+
+    char *slot = &l2_data[((size_t)set * LC_CACHE_L2_WAYS + way) * 256];
+    if ((ways[way].key != 0) && (ways[way].dirty == 1) && (write_back_block(shard, ways[way].key - 1, slot) == -1)) {
+
+        pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+        return(-1);
+    }
+    if (ways[way].key != 0) {
+        shard->stats.l2_evictions += 1;
+    }
+
+    memcpy(slot, data, 256);
+    ways[way].key = key + 1;
+    ways[way].dirty = dirty;
+    ways[way].stamp = ++l2_clock[set % LC_CACHE_L2_LOCKS];
+    shard->stats.l2_stores += 1;
+    pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_take
+// Description  : removes a block from the second tier, so that it can move
+//                back into memory, or just drops it when data is NULL
+//
+// Inputs       : key - the key of the block
+//                data - place to put the 256 bytes of the block, or NULL
+//                dirty - set to the block's dirty flag (if data is given)
+// Outputs      : 0 if the block was in the second tier, -1 if not
+int l2_take(uint64_t key, char *data, int *dirty) {
+
+    int set = l2_set(key);
+    L2Way *ways = &l2_ways[set * LC_CACHE_L2_WAYS];
+    int found = -1;
+    for (int w = 0; w < LC_CACHE_L2_WAYS; w++) {
+
+        if (ways[w].key == key + 1) {
+
+            if (data != NULL) {
+                memcpy(data, &l2_data[((size_t)set * LC_CACHE_L2_WAYS + w) * 256], 256);
+                *dirty = ways[w].dirty;
+            }
+            ways[w].key = 0;
+            ways[w].dirty = 0;
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    return(found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_peek
+// Description  : copies a block out of the second tier, leaving it there
+//
+// Inputs       : key - the key of the block
+//                data - place to put the 256 bytes of the block
+//                dirty - set to the block's dirty flag
+// Outputs      : 0 if the block was in the second tier, -1 if not
+int l2_peek(uint64_t key, char *data, int *dirty) {
+
+    int set = l2_set(key);
+    int found = -1;
+    for (int w = 0; w < LC_CACHE_L2_WAYS; w++) {
+
+        if (l2_ways[set * LC_CACHE_L2_WAYS + w].key == key + 1) {
+
+            memcpy(data, &l2_data[((size_t)set * LC_CACHE_L2_WAYS + w) * 256], 256);
+            *dirty = l2_ways[set * LC_CACHE_L2_WAYS + w].dirty;
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    return(found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : l2_contains
+// Description  : checks whether the second tier holds a block
+//
+// Inputs       : key - the key of the block
+// Outputs      : 1 if it does, 0 if not
+int l2_contains(uint64_t key) {
+
+    int set = l2_set(key);
+    int found = 0;
+    for (int w = 0; w < LC_CACHE_L2_WAYS; w++) {
+        if (l2_ways[set * LC_CACHE_L2_WAYS + w].key == key + 1) {
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    return(found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_address
+// Description  : converts a block location into its position on the device,
+//                in the sector-major order the filesystem allocates blocks
+//
+// Inputs       : did, sec, blk - the location of the block
+// Outputs      : the linear block address
+int64_t block_address(LcDeviceId did, uint16_t sec, uint16_t blk) {
+
+    if (geometry_blocks[did] > 0) {
+        return((int64_t)sec * geometry_blocks[did] + blk);
+    }
+    return(((int64_t)sec << 16) | blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_feedback
+// Description  : tells a device's prefetcher whether a prefetched block was used
+//
+// Inputs       : did - the device of the block
+//                useful - 1 if it was hit, 0 if it was evicted unused
+// Outputs      : nothing
+void prefetch_feedback(LcDeviceId did, int useful) {
+
+    if (did < LC_CACHE_MAXDEVICES) {
+        __atomic_fetch_add((useful == 1) ? &prefetchers[did].useful : &prefetchers[did].useless, 1, __ATOMIC_RELAXED);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_train
+// Description  : feeds a device miss to the device's prefetcher and queues the
+//                blocks it predicts.  A stride seen twice in a row predicts
+//                the next blocks along it, otherwise the correlation table is
+//                followed from this miss to replay a sequence seen before.
+//                The degree adapts to how many prefetches turn out useful.
+//
+// Inputs       : did, sec, blk - the location of the missed block
+// Outputs      : nothing
+void prefetch_train(LcDeviceId did, uint16_t sec, uint16_t blk) {
+
+    prefetch_pending_count = 0;
+    if ((prefetch_enabled == 0) || (did >= LC_CACHE_MAXDEVICES)) {
+        return;
+    }
+
+    Prefetcher *pf = &prefetchers[did];
+    int64_t addr = block_address(did, sec, blk);
+    int64_t predicted[LC_CACHE_PREFETCH_MAXDEGREE];
+    int count = 0;
+
+    pthread_mutex_lock(&pf->lock);
+
+    uint64_t useful = __atomic_load_n(&pf->useful, __ATOMIC_RELAXED);  //adjust the degree once enough prefetches were judged
+    uint64_t judged = useful + __atomic_load_n(&pf->useless, __ATOMIC_RELAXED);
+    if (judged - pf->judged >= LC_CACHE_PREFETCH_WINDOW) {
+
+        int accuracy = (int)(((useful - pf->judged_useful) * 100) / (judged - pf->judged));
+        if ((accuracy < LC_CACHE_PREFETCH_LOW) && (pf->degree > 0)) {
+
+            pf->degree /= 2;
+            if (pf->degree == 0) {
+                pf->backoff = LC_CACHE_PREFETCH_BACKOFF;
+            }
+            logMessage(LOG_INFO_LEVEL, "Prefetch accuracy %d%% on device %d, degree now %d", accuracy, did, pf->degree);
+        }
+        else if ((accuracy > LC_CACHE_PREFETCH_HIGH) && (pf->degree < LC_CACHE_PREFETCH_MAXDEGREE)) {
+
+            pf->degree = (pf->degree * 2 > LC_CACHE_PREFETCH_MAXDEGREE) ? LC_CACHE_PREFETCH_MAXDEGREE : pf->degree * 2;
+            logMessage(LOG_INFO_LEVEL, "Prefetch accuracy %d%% on device %d, degree now %d", accuracy, did, pf->degree);
+        }
+        pf->judged = judged;
+        pf->judged_useful = useful;
+    }
+    if ((pf->degree == 0) && (--pf->backoff <= 0)) {  //probe again after sitting out
+        pf->degree = 1;
+    }
+
+    if (pf->last_miss != -1) {  //learn from this miss
+
+        int64_t stride = addr - pf->last_miss;
+        pf->confirmed = ((stride == pf->stride) && (stride != 0));
+        pf->stride = stride;
+
+        int slot = (uint64_t)pf->last_miss % LC_CACHE_PREFETCH_TABLE;
+        pf->table_from[slot] = pf->last_miss;
+        pf->table_to[slot] = addr;
+    }
+    pf->last_miss = addr;
+
+    if (pf->confirmed == 1) {  //constant stride
+        for (int step = 1; step <= pf->degree; step++) {
+            predicted[count++] = addr + pf->stride * step;
+        }
+    }
+    else {  //repeating sequence
+
+        int64_t next = addr;
+        for (int step = 1; step <= pf->degree; step++) {
+
+            int slot = (uint64_t)next % LC_CACHE_PREFETCH_TABLE;
+            if ((pf->table_from[slot] != next) || (pf->table_to[slot] == addr)) {
+                break;
+            }
+            next = pf->table_to[slot];
+            predicted[count++] = next;
+        }
+    }
+
+    pthread_mutex_unlock(&pf->lock);
+
+    for (int p = 0; p < count; p++) {  //turn the addresses back into blocks on the device
+
+        int64_t sector = predicted[p] >> 16, block = predicted[p] & 0xffff;
+        if (geometry_blocks[did] > 0) {
+            sector = predicted[p] / geometry_blocks[did];
+            block = predicted[p] % geometry_blocks[did];
+        }
+        if ((predicted[p] < 0) || ((geometry_sectors[did] > 0) && (sector >= geometry_sectors[did]))) {
+            continue;
+        }
+        prefetch_pending[prefetch_pending_count++] = cache_key(did, sector, block);
+    }
+    prefetch_pending_key = cache_key(did, sec, blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_record
+// Description  : remembers a key evicted for capacity in the shard's ghost
+//                list, forgetting the oldest one when the ring is full
+//
+// Inputs       : shard - the shard the key was evicted from
+//                key - the evicted key
+// Outputs      : nothing
+void ghost_record(CacheShard *shard, uint64_t key) {
+
+    int slot = shard->ghost_head % shard->num_lines;
+    if (shard->ghost_keys[slot] != 0) {  //unchain the key being forgotten
+
+        int *link = &shard->ghost_buckets[cache_hash(shard->ghost_keys[slot] - 1) & (shard->num_buckets - 1)];
+        while (*link != slot) {
+            link = &shard->ghost_next[*link];
+        }
+        *link = shard->ghost_next[slot];
+    }
+
+    int bucket = cache_hash(key) & (shard->num_buckets - 1);
+    shard->ghost_keys[slot] = key + 1;
+    shard->ghost_next[slot] = shard->ghost_buckets[bucket];
+    shard->ghost_buckets[bucket] = slot;
+    shard->ghost_head += 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_probe
+// Description  : checks a missed key against the shard's ghost list.  A key
+//                found d evictions back would still be cached if the shard
+//                had about d more lines, so the miss is counted as a hit for
+//                every larger size with at least that many extra lines.  The
+//                key leaves the ghost list, it is about to be cached again.
+//
+// Inputs       : shard - the shard that owns the key
+//                hash - the hash of the key
+//                key - the key that missed
+// Outputs      : nothing
+void ghost_probe(CacheShard *shard, uint64_t hash, uint64_t key) {
+
+    int *link = &shard->ghost_buckets[hash & (shard->num_buckets - 1)];
+    while ((*link != -1) && (shard->ghost_keys[*link] != key + 1)) {
+        link = &shard->ghost_next[*link];
+    }
+    if (*link == -1) {
+        return;
+    }
+
+    int slot = *link;
+    uint64_t distance = (((shard->ghost_head - 1) % shard->num_lines) + shard->num_lines - slot) % shard->num_lines + 1;  //evictions since, counting its own
+    *link = shard->ghost_next[slot];
+    shard->ghost_keys[slot] = 0;
+    for (int size = 0; size < LC_CACHE_ADVISOR_SIZES; size++) {
+
+        if (distance * 10 <= (uint64_t)shard->num_lines * LC_CACHE_ADVISOR_TENTHS[size]) {
+            __atomic_add_fetch(&advisor_hits[size], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : advisor_report
+// Description  : logs the advisor's estimates of the hits a larger cache
+//                would add, as a share of every lookup so far
+//
+// Inputs       : none
+// Outputs      : nothing
+void advisor_report(void) {
+
+    uint64_t lookups = __atomic_load_n(&advisor_lookups, __ATOMIC_RELAXED);
+    double gain[LC_CACHE_ADVISOR_SIZES];
+    for (int size = 0; size < LC_CACHE_ADVISOR_SIZES; size++) {
+        gain[size] = (lookups > 0) ? ((double)__atomic_load_n(&advisor_hits[size], __ATOMIC_RELAXED) * 100) / lookups : 0.0;
+    }
+    logMessage(LOG_INFO_LEVEL, "Cache size advisor, after [%lu] lookups: %s adds [%.2f%%] hits, %s adds [%.2f%%], %s adds [%.2f%%]",
+        (unsigned long)lookups, LC_CACHE_ADVISOR_LABELS[0], gain[0], LC_CACHE_ADVISOR_LABELS[1], gain[1], LC_CACHE_ADVISOR_LABELS[2], gain[2]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : evict_line
+// Description  : removes a line from its shard, demoting it to the second
+//                tier or writing it back if it is dirty (shard lock held).
+//                make_room normally does any write beforehand, with the
+//                shard unlocked.  If a write here fails the line stays.
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line to evict
+//                reason - why the line is leaving the cache
+// Outputs      : 0 if successful, -1 if the line could not be written back
+int evict_line(CacheShard *shard, int line, LcCacheEvictReason reason) {
+
+    uint64_t key = shard->keys[line];
+    LcDeviceId did = key >> 32;
+
+    if (l2_sets > 0) {
+        if (l2_store(shard, key, line_data(shard, line), shard->dirty[line]) == -1) {
+            return(-1);
+        }
+    }
+    else if ((shard->dirty[line] == 1) && (write_back_block(shard, key, line_data(shard, line)) == -1)) {
+        return(-1);
+    }
+
+    logMessage(LOG_INFO_LEVEL, "Ejecting cache item [%d/%d/%d]", did, (int)((key >> 16) & 0xffff), (int)(key & 0xffff));
+    count_event(shard, did, shard->owner[line], LC_CACHE_EVICT);
+    shard->stats.evict_reason[reason] += 1;
+    shard->stats.partition_used[shard->owner[line]] -= 1;
+    if (shard->prefetched[line] == 1) {  //speculation that never paid off
+        shard->stats.prefetch_useless += 1;
+        prefetch_feedback(did, 0);
+        shard->prefetched[line] = 0;
+    }
+
+    if ((advisor_enabled == 1) && (reason == LC_CACHE_EVICT_CAPACITY)) {
+        ghost_record(shard, key);
+    }
+
+    set_dirty(shard, line, 0);
+    unhash_line(shard, line);
+    lru_unlink(shard, line);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : partition_full
+// Description  : checks whether a partition holds all the lines its cap allows
+//
+// Inputs       : shard - the shard to check
+//                partition - the partition
+// Outputs      : 1 if it does, 0 if not
+int partition_full(CacheShard *shard, int partition) {
+
+    return((partitions_enabled == 1) && (shard->partition_max[partition] > 0) &&
+        (shard->stats.partition_used[partition] >= (uint64_t)shard->partition_max[partition]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : choose_victim
+// Description  : picks the line to replace for a block of a partition.  A
+//                partition at its cap replaces its own least recently used
+//                line.  Otherwise the least recently used line is taken,
+//                skipping lines of other partitions that are down to their
+//                reservation.
+//
+// Inputs       : shard - the shard that owns the block
+//                partition - the partition of the new block
+// Outputs      : index of the victim line
+int choose_victim(CacheShard *shard, int partition) {
+
+    if (partitions_enabled == 0) {
+        return(shard->least_recent);
+    }
+
+    int own = partition_full(shard, partition);
+    for (int line = shard->least_recent; line != -1; line = shard->prev[line]) {
+
+        int owner = shard->owner[line];
+        if ((owner == partition) || ((own == 0) && (shard->stats.partition_used[owner] > (uint64_t)shard->partition_min[owner]))) {
+            return(line);
+        }
+    }
+    return(shard->least_recent);  //only if the reservations overlap, plain LRU
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : make_room
+// Description  : before a block of a partition is inserted, writes back what
+//                its eviction would have to write, the dirty victim line or
+//                the dirty second-tier block the victim would push out.  The
+//                shard is unlocked for the write, so its readers aren't held
+//                up by the device, and the write lands in order with the
+//                flusher's.  The shard may have changed when this returns,
+//                so callers look the block up again.  (shard lock held)
+//
+// Inputs       : shard - the shard that owns the block
+//                partition - the partition of the block
+// Outputs      : 0 if the insert won't have to write, -1 if a write failed
+int make_room(CacheShard *shard, int partition) {
+
+    for (int tries = 0; tries < LC_CACHE_ROOM_TRIES; tries++) {
+
+        if ((shard->free_line != -1) && (partition_full(shard, partition) == 0)) {
+            return(0);
+        }
+
+        int line = choose_victim(shard, partition);
+        uint64_t key = shard->keys[line];
+        char data[256];
+        if (l2_sets > 0) {
+            if (l2_displaced(key, &key, data) == 0) {
+                return(0);
+            }
+        }
+        else if (shard->dirty[line] == 0) {
+            return(0);
+        }
+        else {
+            memcpy(data, line_data(shard, line), 256);
+        }
+
+        int did = (key >> 32) & 0xff, sec = (key >> 16) & 0xffff, blk = key & 0xffff;
+        pthread_mutex_lock(&writeback_lock);
+        pthread_mutex_unlock(&shard->lock);
+        int result = ((write_block_func == NULL) ? -1 : write_block_func(data, did, sec, blk));
+        pthread_mutex_unlock(&writeback_lock);
+        pthread_mutex_lock(&shard->lock);
+        if (result == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failed writing back dirty cache item [%d/%d/%d]", did, sec, blk);
+            return(-1);
+        }
+
+        shard->stats.writebacks += 1;
+        logMessage(LOG_INFO_LEVEL, "Wrote back dirty cache item [%d/%d/%d]", did, sec, blk);
+        if (l2_sets > 0) {
+            l2_clean(key, data);
+        }
+        else {  //clean unless rewritten meanwhile
+            line = find_line(shard, cache_hash(key), did, sec, blk);
+            if ((line != -1) && (shard->dirty[line] == 1) && (memcmp(line_data(shard, line), data, 256) == 0)) {
+                set_dirty(shard, line, 0);
+            }
+        }
+    }
+    return(0);  //the victims keep being dirtied, the eviction writes under the lock
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_line
+// Description  : places a block that isn't cached into a free line, or over
+//                the line chosen by choose_victim, dropping any older
+//                second-tier copy once it has the line (shard lock held)
+//
+// Inputs       : shard - the shard that owns the block
+//                hash - the hash of the block's key
+//                did, sec, blk - the location of the block
+//                data - the 256 bytes of the block
+//                dirty - 1 if the block hasn't been written to the device
+//                filter - 1 to let the admission filter reject the block
+// Outputs      : index of the line, -1 if the block was not admitted or the
+//                victim could not be written back
+int insert_line(CacheShard *shard, uint64_t hash, LcDeviceId did, uint16_t sec, uint16_t blk, char *data, int dirty, int filter) {
+
+    int line;
+    int partition = block_partition(did);
+
+    if ((shard->free_line != -1) && (partition_full(shard, partition) == 0)) {  //use an unused line if there is one
+
+        line = shard->free_line;
+        shard->free_line = shard->next[line];
+        shard->stats.used_lines += 1;
+        if (shard->stats.used_lines > shard->stats.peak_lines) {
+            shard->stats.peak_lines = shard->stats.used_lines;
+        }
+    }
+    else {  //all lines are used (or the partition is capped), so a victim must go
+
+        line = choose_victim(shard, partition);
+        if ((filter == 1) && (admission_enabled == 1) && (sketch_estimate(shard, hash) <= sketch_estimate(shard, cache_hash(shard->keys[line])))) {  //only displace the victim if the new block is more popular
+
+            shard->stats.rejected += 1;
+            logMessage(LOG_INFO_LEVEL, "Admission filter rejected cache item [%d/%d/%d]", did, sec, blk);
+            return(-1);
+        }
+        if (evict_line(shard, line, LC_CACHE_EVICT_CAPACITY) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Not caching item [%d/%d/%d], its victim failed to write back", did, sec, blk);
+            return(-1);
+        }
+    }
+
+    if (l2_sets > 0) {  //any second-tier copy is now stale, dropped only once the block has its line
+        l2_take(cache_key(did, sec, blk), NULL, NULL);
+    }
+    if ((filter == 1) && (admission_enabled == 1)) {
+        shard->stats.admitted += 1;
+    }
+    count_event(shard, did, partition, LC_CACHE_INSERT);
+
+    shard->keys[line] = cache_key(did, sec, blk);  //set the new values for this line of the cache
+    shard->owner[line] = partition;
+    shard->stats.partition_used[partition] += 1;
+    set_dirty(shard, line, dirty);
+    shard->prefetched[line] = 0;
+    memcpy(line_data(shard, line), data, 256);
+    shard->hash_next[line] = shard->buckets[hash & (shard->num_buckets - 1)];
+    shard->buckets[hash & (shard->num_buckets - 1)] = line;
+    lru_push(shard, line);
+
+    logMessage(LOG_INFO_LEVEL, "LionCloud Cache success inserting cache item [%d/%d/%d]", did, sec, blk);
+    return(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lookup_line
+// Description  : finds a block, updating the statistics, sketch and recency
+//                of its shard (the shard lock must be held)
+//
+// Inputs       : shard - the shard that owns the block
+//                hash - the hash of the block's key
+//                did, sec, blk - the location of the block
+//                copy - place to put the 256 bytes of a second-tier block
+//                       that couldn't be moved into memory
+// Outputs      : index of the line holding the block, -1 on a miss, or
+//                LC_CACHE_LINE_L2 if the block was copied out instead
+int lookup_line(CacheShard *shard, uint64_t hash, LcDeviceId did, uint16_t sec, uint16_t blk, char *copy) {
+
+    record_access(shard, hash, cache_key(did, sec, blk));
+    if ((advisor_enabled == 1) && (__atomic_add_fetch(&advisor_lookups, 1, __ATOMIC_RELAXED) % LC_CACHE_ADVISOR_INTERVAL == 0)) {
+        advisor_report();
+    }
+
+    int room = 0;
+    int line = find_line(shard, hash, did, sec, blk);
+    if ((line == -1) && (l2_sets > 0) && l2_contains(cache_key(did, sec, blk))) {  //coming back from the second tier evicts, write for it first
+
+        room = make_room(shard, block_partition(did));
+        line = find_line(shard, hash, did, sec, blk);
+    }
+    if (line == -1) {  //cache miss, try the second tier before giving up
+
+        count_event(shard, did, block_partition(did), LC_CACHE_MISS);
+        if (advisor_enabled == 1) {
+            ghost_probe(shard, hash, cache_key(did, sec, blk));
+        }
+        if (l2_sets > 0) {
+
+            int dirty;
+            if (l2_peek(cache_key(did, sec, blk), copy, &dirty) == 0) {  //it leaves its way only once it has a line
+
+                shard->stats.l2_hits += 1;
+                logMessage(LOG_INFO_LEVEL, "Found cache item [%d/%d/%d] in second tier", did, sec, blk);
+                line = (room == 0) ? insert_line(shard, hash, did, sec, blk, copy, dirty, 0) : -1;
+                return((line != -1) ? line : LC_CACHE_LINE_L2);  //no room, it stays (dirty or not) in its way and is read from there
+            }
+            shard->stats.l2_misses += 1;
+        }
+        prefetch_train(did, sec, blk);  //a real device miss
+
+        last_miss_key = cache_key(did, sec, blk);  //remember the miss so the insert that follows isn't counted twice
+        last_miss_valid = 1;
+        logMessage(LOG_INFO_LEVEL, "Cache item [%d/%d/%d] not found", did, sec, blk);
+        return(-1);
+    }
+
+    count_event(shard, did, block_partition(did), LC_CACHE_HIT);  //cache hit! make this the most recently used line
+    if (shard->prefetched[line] == 1) {
+        shard->stats.prefetch_useful += 1;
+        prefetch_feedback(did, 1);
+        shard->prefetched[line] = 0;
+    }
+    touch_line(shard, line);
+    logMessage(LOG_INFO_LEVEL, "Found cache item [%d/%d/%d]", did, sec, blk);
+    return(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_issue
+// Description  : fetches the blocks queued by the last miss and caches them as
+//                prefetched (no shard lock may be held)
+//
+// Inputs       : none
+// Outputs      : nothing
+void prefetch_issue(void) {
+
+    int count = prefetch_pending_count;
+    prefetch_pending_count = 0;
+    for (int p = 0; (p < count) && (read_block_func != NULL); p++) {
+
+        uint64_t key = prefetch_pending[p];
+        uint64_t hash = cache_hash(key);
+        CacheShard *shard = cache_shard(hash);
+        LcDeviceId did = key >> 32;
+        uint16_t sec = (key >> 16) & 0xffff, blk = key & 0xffff;
+        char data[256];
+
+        pthread_mutex_lock(&shard->lock);  //skip blocks that are already cached
+        int cached = (find_line(shard, hash, did, sec, blk) != -1) || ((l2_sets > 0) && l2_contains(key));
+        uint64_t writes = shard->writes;
+        pthread_mutex_unlock(&shard->lock);
+        if ((cached == 1) || (read_block_func(data, did, sec, blk) == -1)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        if ((make_room(shard, block_partition(did)) == 0) && (shard->writes == writes) && (find_line(shard, hash, did, sec, blk) == -1) && ((l2_sets == 0) || !l2_contains(key))) {
+
+            int line = insert_line(shard, hash, did, sec, blk, data, 0, 1);
+            if (line != -1) {
+                shard->prefetched[line] = 1;
+                shard->stats.prefetch_issued += 1;
+                logMessage(LOG_INFO_LEVEL, "Prefetched cache item [%d/%d/%d]", did, sec, blk);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_stamp
+// Description  : hashes the contents of a block (FNV-1a), so a snapshot entry
+//                can be checked against what the device holds now
+//
+// Inputs       : data - the 256 bytes of the block
+// Outputs      : the stamp
+uint64_t block_stamp(const char *data) {
+
+    uint64_t stamp = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 256; i++) {
+        stamp = (stamp ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+    }
+    return(stamp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_append
+// Description  : makes a line the least recently used line of its shard
+//
+// Inputs       : shard - the shard holding the line
+//                line - index of the line to insert
+// Outputs      : nothing
+void lru_append(CacheShard *shard, int line) {
+
+    shard->next[line] = -1;
+    shard->prev[line] = shard->least_recent;
+    if (shard->least_recent != -1) {
+        shard->next[shard->least_recent] = line;
+    }
+    shard->least_recent = line;
+    if (shard->most_recent == -1) {
+        shard->most_recent = line;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : save_snapshot
+// Description  : writes the keys of every cached block, with a stamp of their
+//                contents, to the snapshot file in recency order.  The shards
+//                are interleaved so their most recent blocks come first.
+//                The cache must be clean, so the stamps match the devices.
+//
+// Inputs       : path - the snapshot file
+// Outputs      : 0 if successful, -1 if failure
+int save_snapshot(const char *path) {
+
+    char temp_path[strlen(path) + 5];
+    sprintf(temp_path, "%s.tmp", path);
+    FILE *fh = fopen(temp_path, "w");
+    if (fh == NULL) {
+        return(-1);
+    }
+
+    SnapshotHeader header = { LC_CACHE_SNAPSHOT_MAGIC, LC_CACHE_SNAPSHOT_VERSION, 0, 0 };
+    int cursor[num_shards];
+    for (int s = 0; s < num_shards; s++) {
+
+        pthread_mutex_lock(&shards[s].lock);
+        header.entries += shards[s].stats.used_lines;
+        cursor[s] = first_cached(&shards[s]);
+    }
+
+    int result = (fwrite(&header, sizeof(header), 1, fh) == 1) ? 0 : -1;
+    for (int remaining = header.entries; (remaining > 0) && (result == 0); ) {
+
+        for (int s = 0; (s < num_shards) && (result == 0); s++) {
+
+            if (cursor[s] != -1) {
+
+                SnapshotEntry entry = { shards[s].keys[cursor[s]], block_stamp(line_data(&shards[s], cursor[s])) };
+                result = (fwrite(&entry, sizeof(entry), 1, fh) == 1) ? 0 : -1;
+                cursor[s] = next_cached(&shards[s], cursor[s]);
+                remaining -= 1;
+            }
+        }
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    if ((fclose(fh) != 0) || (result == -1) || (rename(temp_path, path) == -1)) {  //the old snapshot survives a failed save
+        unlink(temp_path);
+        return(-1);
+    }
+
+    logMessage(LOG_INFO_LEVEL, "Saved cache snapshot [%s], %u blocks", path, header.entries);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : warm_cache
+// Description  : the warming thread, reads the blocks named in the snapshot
+//                from the devices, hottest first, and caches those that
+//                haven't changed.  Warmed blocks only fill unused lines and
+//                go behind the blocks already cached, so they never push
+//                out a block the filesystem asked for.
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+void * warm_cache(void *arg) {
+
+    FILE *fh = fopen(snapshot_path, "r");
+    SnapshotHeader header;
+    if ((fh == NULL) || (fread(&header, sizeof(header), 1, fh) != 1) ||
+        (header.magic != LC_CACHE_SNAPSHOT_MAGIC) || (header.version != LC_CACHE_SNAPSHOT_VERSION)) {
+
+        logMessage(LOG_INFO_LEVEL, "No usable cache snapshot [%s], starting cold", snapshot_path);
+        if (fh != NULL) {
+            fclose(fh);
+        }
+        return(NULL);
+    }
+
+    SnapshotEntry entry;
+    for (uint32_t e = 0; (e < header.entries) && (warm_stop == 0) && (fread(&entry, sizeof(entry), 1, fh) == 1); e++) {
+
+        uint64_t hash = cache_hash(entry.key);
+        CacheShard *shard = cache_shard(hash);
+        LcDeviceId did = entry.key >> 32;
+        uint16_t sec = (entry.key >> 16) & 0xffff, blk = entry.key & 0xffff;
+        char data[256];
+
+        pthread_mutex_lock(&shard->lock);
+        int skip = (shard->free_line == -1) || partition_full(shard, block_partition(did)) || (find_line(shard, hash, did, sec, blk) != -1);
+        uint64_t writes = shard->writes;
+        pthread_mutex_unlock(&shard->lock);
+        if ((skip == 1) || (read_block_func(data, did, sec, blk) == -1)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        if (block_stamp(data) != entry.stamp) {  //the device has changed since the snapshot
+
+            shard->stats.warm_stale += 1;
+            logMessage(LOG_INFO_LEVEL, "Dropped stale snapshot item [%d/%d/%d]", did, sec, blk);
+        }
+        else if ((shard->writes == writes) && (shard->free_line != -1) && !partition_full(shard, block_partition(did)) && (find_line(shard, hash, did, sec, blk) == -1)) {
+
+            int line = insert_line(shard, hash, did, sec, blk, data, 0, 0);
+            lru_unlink(shard, line);
+            lru_append(shard, line);
+            shard->stats.warm_loaded += 1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    fclose(fh);
+    logMessage(LOG_INFO_LEVEL, "Cache warming from [%s] finished", snapshot_path);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_keys
+// Description  : qsort comparison of block keys, device then sector then block
+//
+// Inputs       : a, b - the keys
+// Outputs      : <0, 0 or >0 as a sorts before, with or after b
+int compare_keys(const void *a, const void *b) {
+
+    uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+    return((ka > kb) - (ka < kb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_shard
+// Description  : one flusher pass over a shard.  Dirty lines past the age
+//                limit, or the oldest dirty lines while too much of the cache
+//                is dirty, are copied out and written in device order so
+//                adjacent blocks go out back to back.  The lines stay dirty
+//                until the write lands (an eviction meanwhile writes them
+//                itself), and only the ones not rewritten since are marked
+//                clean.  Runs of adjacent blocks go out in one transfer when
+//                the filesystem set a run writer.  The writeback lock is
+//                taken before the shard is unlocked, so a newer copy written
+//                back by an eviction lands after ours.  A run that fails to
+//                write leaves its lines dirty for the next pass.
+//
+// Inputs       : shard - the shard to flush
+//                all - 1 to take any dirty line, 0 for only the aged ones
+// Outputs      : the number of blocks written
+int flush_shard(CacheShard *shard, int all) {
+
+    uint64_t keys[LC_CACHE_FLUSH_BATCH];
+    char data[LC_CACHE_FLUSH_BATCH][256];
+    int count = 0;
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&shard->lock);
+    for (int pass = 0; pass < 2; pass++) {  //least recently used lines first, then the pinned ones
+
+        int line = (pass == 0) ? shard->least_recent : shard->pinned;
+        for (; (line != -1) && (count < LC_CACHE_FLUSH_BATCH); line = (pass == 0) ? shard->prev[line] : shard->next[line]) {
+
+            if ((shard->dirty[line] == 1) && ((all == 1) || (now - shard->dirty_since[line] >= (uint64_t)dirty_age))) {
+
+                keys[count] = shard->keys[line];
+                memcpy(data[count], line_data(shard, line), 256);
+                count += 1;
+            }
+        }
+    }
+    if (count == 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return(0);
+    }
+    pthread_mutex_lock(&writeback_lock);
+    pthread_mutex_unlock(&shard->lock);
+
+    uint64_t order[LC_CACHE_FLUSH_BATCH];  //sort by key, carrying each block's slot in the low bits
+    for (int i = 0; i < count; i++) {
+        order[i] = (keys[i] << 8) | i;
+    }
+    qsort(order, count, sizeof(uint64_t), compare_keys);
+
+    char run[LC_CACHE_FLUSH_BATCH][256];
+    int landed[LC_CACHE_FLUSH_BATCH];  //by slot, 1 if the block was written
+    int written = 0;
+    for (int i = 0, length; i < count; i += length) {
+
+        uint64_t key = keys[order[i] & 0xff];
+        int did = (key >> 32) & 0xff, sec = (key >> 16) & 0xffff, blk = key & 0xffff;
+        for (length = 1; (i + length < count) && (keys[order[i + length] & 0xff] == key + length); length++);
+        flusher_batches += 1;
+
+        int result = 0;
+        if ((write_run_func != NULL) && (length > 1)) {
+
+            for (int k = 0; k < length; k++) {
+                memcpy(run[k], data[order[i + k] & 0xff], 256);
+            }
+            result = write_run_func(run[0], did, sec, blk, length);
+        }
+        else {
+            for (int k = 0; (k < length) && (result == 0); k++) {
+                result = write_block_func(data[order[i + k] & 0xff], did, sec, blk + k);
+            }
+        }
+        if (result == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Flusher failed writing cache items [%d/%d/%d] to [%d/%d/%d]", did, sec, blk, did, sec, blk + length - 1);
+        }
+        for (int k = 0; k < length; k++) {
+            landed[order[i + k] & 0xff] = (result == 0);
+        }
+        flusher_failed += (result == 0) ? 0 : length;
+        written += (result == 0) ? length : 0;
+    }
+    flusher_blocks += written;
+    pthread_mutex_unlock(&writeback_lock);
+
+    pthread_mutex_lock(&shard->lock);
+    for (int i = 0; i < count; i++) {
+
+        int did = (keys[i] >> 32) & 0xff, sec = (keys[i] >> 16) & 0xffff, blk = keys[i] & 0xffff;
+        int line = (landed[i] == 1) ? find_line(shard, cache_hash(keys[i]), did, sec, blk) : -1;
+        if ((line != -1) && (shard->dirty[line] == 1) && (memcmp(line_data(shard, line), data[i], 256) == 0)) {
+            set_dirty(shard, line, 0);
+        }
+    }
+    shard->stats.writebacks += written;  //counted with the other write-backs
+    pthread_mutex_unlock(&shard->lock);
+    return(written);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_dirty
+// Description  : the flusher thread, every interval it writes back the lines
+//                past the age limit, and while the dirty ratio is above the
+//                background threshold it keeps writing back the oldest lines
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+void * flush_dirty(void *arg) {
+
+    pthread_mutex_lock(&flusher_mutex);
+    while (flusher_stop == 0) {
+
+        pthread_mutex_unlock(&flusher_mutex);
+        uint64_t start = now_ms();
+        int written = 0;
+        pthread_mutex_lock(&writeback_lock);
+        uint64_t failed = flusher_failed;
+        pthread_mutex_unlock(&writeback_lock);
+        for (int s = 0; s < num_shards; s++) {
+
+            int all = (__atomic_load_n(&dirty_lines, __ATOMIC_RELAXED) * 100 >= dirty_background * total_lines);
+            written += flush_shard(&shards[s], all);
+        }
+        pthread_mutex_lock(&writeback_lock);
+        flusher_rounds += 1;
+        flusher_busy_ms += now_ms() - start;
+        failed = flusher_failed - failed;
+        pthread_mutex_unlock(&writeback_lock);
+
+        pthread_mutex_lock(&flusher_mutex);
+        flusher_stalled = ((written == 0) && (failed > 0));
+        pthread_cond_broadcast(&flusher_cond);  //throttled writers recheck the ratio
+        if ((written == 0) || (__atomic_load_n(&dirty_lines, __ATOMIC_RELAXED) * 100 < dirty_background * total_lines)) {  //caught up, sleep
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += (long)LC_CACHE_FLUSH_INTERVAL * 1000000;
+            until.tv_sec += until.tv_nsec / 1000000000;
+            until.tv_nsec %= 1000000000;
+            if (flusher_stop == 0) {
+                pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &until);
+            }
+        }
+    }
+    pthread_mutex_unlock(&flusher_mutex);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : throttle_writer
+// Description  : holds a writer back while the dirty ratio is above the hard
+//                limit, waking the flusher to make room, unless the flusher's
+//                writes are all failing and no room is coming
+//
+// Inputs       : none
+// Outputs      : nothing
+void throttle_writer(void) {
+
+    uint64_t start = now_ms();
+    pthread_mutex_lock(&flusher_mutex);
+    while ((flusher_stop == 0) && (flusher_stalled == 0) && (__atomic_load_n(&dirty_lines, __ATOMIC_RELAXED) * 100 > dirty_hard * total_lines)) {
+
+        pthread_cond_broadcast(&flusher_cond);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)LC_CACHE_FLUSH_INTERVAL * 1000000;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &until);
+    }
+    pthread_mutex_unlock(&flusher_mutex);
+    __atomic_add_fetch(&throttle_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&throttle_ms, now_ms() - start, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arena_alloc
+// Description  : allocates the slab holding the block data of every line.
+//                Large arenas can be backed by huge pages, explicitly
+//                reserved ones if the system has them, otherwise transparent
+//                huge pages, so a lookup doesn't also miss in the TLB.
+//
+// Inputs       : size - bytes of block data
+// Outputs      : 0 if successful, -1 if failure
+int arena_alloc(size_t size) {
+
+    arena_mapped = 0;
+    if ((huge_pages == 1) && (size >= LC_CACHE_HUGEPAGE_SIZE)) {
+
+        arena_size = (size + LC_CACHE_HUGEPAGE_SIZE - 1) & ~((size_t)LC_CACHE_HUGEPAGE_SIZE - 1);  //whole huge pages
+        arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena != MAP_FAILED) {
+
+            logMessage(LOG_INFO_LEVEL, "Cache arena of %lu bytes in reserved huge pages", (unsigned long)arena_size);
+            arena_mapped = 1;
+            return(0);
+        }
+
+        arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena != MAP_FAILED) {
+
+            int transparent = (madvise(arena, arena_size, MADV_HUGEPAGE) == 0);
+            logMessage(LOG_INFO_LEVEL, "Cache arena of %lu bytes in %s pages", (unsigned long)arena_size, transparent ? "transparent huge" : "normal");
+            arena_mapped = 1;
+            return(0);
+        }
+        arena = NULL;
+        return(-1);
+    }
+
+    arena_size = size;
+    if (posix_memalign((void **)&arena, 64, size) != 0) {
+        arena = NULL;
+        return(-1);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arena_free
+// Description  : releases the slab allocated by arena_alloc
+//
+// Inputs       : none
+// Outputs      : nothing
+void arena_free(void) {
+
+    if (arena_mapped == 1) {
+        munmap(arena, arena_size);
+    }
+    else {
+        free(arena);
+    }
+    arena = NULL;
+    arena_size = 0;
+    arena_mapped = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_data_offset
+// Description  : finds where the block data starts in a shared cache segment,
+//                after the header and the way metadata
+//
+// Inputs       : sets - the number of sets in the segment
+// Outputs      : offset of the block data (64-byte aligned)
+size_t shared_data_offset(int sets) {
+
+    size_t offset = sizeof(SharedHeader) + (size_t)sets * LC_CACHE_SHARED_WAYS * sizeof(L2Way);
+    return((offset + 63) & ~(size_t)63);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_size
+// Description  : works out the size of a shared cache segment
+//
+// Inputs       : sets - the number of sets in the segment
+// Outputs      : the size of the segment in bytes
+size_t shared_size(int sets) {
+
+    return(shared_data_offset(sets) + (size_t)sets * LC_CACHE_SHARED_WAYS * 256);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_lock
+// Description  : locks a stripe of the shared cache.  If the process holding
+//                the lock died, the sets of the stripe may be half written, so
+//                they are emptied before the lock is made consistent again.
+//
+// Inputs       : stripe - the lock stripe
+// Outputs      : nothing
+void shared_lock(int stripe) {
+
+    if (pthread_mutex_lock(&shared->locks[stripe]) == EOWNERDEAD) {
+
+        for (int set = stripe; set < shared->sets; set += LC_CACHE_SHARED_LOCKS) {
+            memset(&shared_ways[set * LC_CACHE_SHARED_WAYS], 0, LC_CACHE_SHARED_WAYS * sizeof(L2Way));
+        }
+        shared->writes[stripe] += 1;  //a fill that read the device before the crash is no longer trusted
+        __atomic_add_fetch(&shared->recovered, 1, __ATOMIC_RELAXED);
+        pthread_mutex_consistent(&shared->locks[stripe]);
+        logMessage(LOG_WARNING_LEVEL, "Shared cache lock [%d] held by a dead process, its sets were emptied", stripe);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_lock_attach
+// Description  : locks the process table of the shared cache, recovering it
+//                if its holder died (the table is rebuilt from live pids)
+//
+// Inputs       : none
+// Outputs      : nothing
+void shared_lock_attach(void) {
+
+    if (pthread_mutex_lock(&shared->attach_lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shared->attach_lock);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_live
+// Description  : drops the processes that have exited from the shared cache's
+//                process table (attach lock held)
+//
+// Inputs       : none
+// Outputs      : the number of processes still attached
+int shared_live(void) {
+
+    int live = 0;
+    for (int slot = 0; slot < LC_CACHE_SHARED_MAXPROCS; slot++) {
+
+        if ((shared->pids[slot] != 0) && (kill(shared->pids[slot], 0) == -1) && (errno == ESRCH)) {
+            shared->pids[slot] = 0;
+        }
+        live += (shared->pids[slot] != 0);
+    }
+    return(live);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_detach_map
+// Description  : unmaps the shared cache segment and closes it
+//
+// Inputs       : none
+// Outputs      : nothing
+void shared_detach_map(void) {
+
+    munmap(shared, shared_mapped);
+    close(shared_fd);
+    shared = NULL;
+    shared_ways = NULL;
+    shared_data = NULL;
+    shared_fd = -1;
+    shared_mapped = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_attach
+// Description  : maps the shared cache segment, creating it if no process has
+//                yet.  The creator sizes it for maxblocks and marks it ready
+//                last, later processes use the segment as they find it.  A
+//                segment left behind by processes that all died may be stale,
+//                so it is emptied, and one already unlinked by the last
+//                process to leave is given up for a fresh one.
+//
+// Inputs       : maxblocks - blocks to create the segment with
+// Outputs      : 0 if successful, -1 if failure
+int shared_attach(int maxblocks) {
+
+    for (int attempt = 0; attempt < LC_CACHE_SHARED_RETRIES; attempt++) {
+
+        int created = 1;
+        size_t size;
+        int fd = shm_open(shared_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if ((fd == -1) && (errno == EEXIST)) {
+            created = 0;
+            fd = shm_open(shared_name, O_RDWR, 0600);
+        }
+        if (fd == -1) {
+
+            if (errno == ENOENT) {  //unlinked between the two opens, try again
+                continue;
+            }
+            logMessage(LOG_ERROR_LEVEL, "Failed opening shared cache [%s]", shared_name);
+            return(-1);
+        }
+
+        if (created == 1) {
+
+            int sets = (maxblocks + LC_CACHE_SHARED_WAYS - 1) / LC_CACHE_SHARED_WAYS;
+            size = shared_size(sets);
+            if ((ftruncate(fd, size) == -1) || ((shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+
+                shared = NULL;
+                close(fd);
+                shm_unlink(shared_name);
+                logMessage(LOG_ERROR_LEVEL, "Failed creating shared cache [%s]", shared_name);
+                return(-1);
+            }
+
+            pthread_mutexattr_t attr;  //usable from every process, and recoverable if a holder dies
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&shared->attach_lock, &attr);
+            for (int stripe = 0; stripe < LC_CACHE_SHARED_LOCKS; stripe++) {
+                pthread_mutex_init(&shared->locks[stripe], &attr);
+            }
+            pthread_mutexattr_destroy(&attr);
+            shared->magic = LC_CACHE_SHARED_MAGIC;
+            shared->version = LC_CACHE_SHARED_VERSION;
+            shared->sets = sets;
+            __atomic_store_n(&shared->ready, 1, __ATOMIC_RELEASE);
+        }
+        else {
+
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            int waited = 0;
+            int stated;
+            while (((stated = fstat(fd, &st)) == 0) && ((size_t)st.st_size < sizeof(SharedHeader)) && (waited < LC_CACHE_SHARED_WAIT)) {  //the creator is still sizing it
+                usleep(1000);
+                waited += 1;
+            }
+            if (stated == -1) {
+
+                close(fd);
+                logMessage(LOG_ERROR_LEVEL, "Failed reading the size of shared cache [%s]", shared_name);
+                return(-1);
+            }
+            size = st.st_size;
+            if ((size < sizeof(SharedHeader)) || ((shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+
+                shared = NULL;
+                close(fd);
+                logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] was never set up, remove it from /dev/shm", shared_name);
+                return(-1);
+            }
+            while ((__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) == 0) && (waited < LC_CACHE_SHARED_WAIT)) {
+                usleep(1000);
+                waited += 1;
+            }
+            if ((shared->ready == 0) || (shared->magic != LC_CACHE_SHARED_MAGIC) || (shared->version != LC_CACHE_SHARED_VERSION) ||
+                (shared_size(shared->sets) != size)) {
+
+                munmap(shared, size);
+                shared = NULL;
+                close(fd);
+                logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] is not a usable cache segment, remove it from /dev/shm", shared_name);
+                return(-1);
+            }
+        }
+
+        shared_fd = fd;
+        shared_mapped = size;
+        shared_ways = (L2Way *)((char *)shared + sizeof(SharedHeader));
+        shared_data = (char *)shared + shared_data_offset(shared->sets);
+
+        shared_lock_attach();
+        if (shared->unlinked == 1) {  //the last process left as we opened it
+
+            pthread_mutex_unlock(&shared->attach_lock);
+            shared_detach_map();
+            continue;
+        }
+        if ((shared_live() == 0) && (created == 0)) {  //orphaned, the devices may have changed since
+            memset(shared_ways, 0, (size_t)shared->sets * LC_CACHE_SHARED_WAYS * sizeof(L2Way));
+            shared->recovered = 0;
+        }
+        int slot = 0;
+        while ((slot < LC_CACHE_SHARED_MAXPROCS) && (shared->pids[slot] != 0)) {
+            slot += 1;
+        }
+        if (slot == LC_CACHE_SHARED_MAXPROCS) {
+
+            pthread_mutex_unlock(&shared->attach_lock);
+            shared_detach_map();
+            logMessage(LOG_ERROR_LEVEL, "Shared cache [%s] already has %d processes", shared_name, LC_CACHE_SHARED_MAXPROCS);
+            return(-1);
+        }
+        shared->pids[slot] = getpid();
+        pthread_mutex_unlock(&shared->attach_lock);
+
+        logMessage(LOG_INFO_LEVEL, "Shared cache [%s] %s, %d blocks, %d-way", shared_name, (created == 1) ? "created" : "attached",
+            shared->sets * LC_CACHE_SHARED_WAYS, LC_CACHE_SHARED_WAYS);
+        return(0);
+    }
+
+    logMessage(LOG_ERROR_LEVEL, "Gave up attaching shared cache [%s]", shared_name);
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_detach
+// Description  : leaves the shared cache, removing the segment if this was
+//                the last live process using it
+//
+// Inputs       : none
+// Outputs      : nothing
+void shared_detach(void) {
+
+    shared_lock_attach();
+    for (int slot = 0; slot < LC_CACHE_SHARED_MAXPROCS; slot++) {
+        if (shared->pids[slot] == getpid()) {
+            shared->pids[slot] = 0;
+        }
+    }
+    if (shared_live() == 0) {
+
+        shared->unlinked = 1;
+        shm_unlink(shared_name);
+        logMessage(LOG_INFO_LEVEL, "Shared cache [%s] removed, no process is using it", shared_name);
+    }
+    pthread_mutex_unlock(&shared->attach_lock);
+    shared_detach_map();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_find
+// Description  : looks a block up in its set of the shared cache (stripe lock
+//                held)
+//
+// Inputs       : set - the set of the block
+//                key - the block's key
+// Outputs      : index of the way holding it, -1 if not cached
+int shared_find(int set, uint64_t key) {
+
+    for (int w = 0; w < LC_CACHE_SHARED_WAYS; w++) {
+        if (shared_ways[set * LC_CACHE_SHARED_WAYS + w].key == key + 1) {
+            return(set * LC_CACHE_SHARED_WAYS + w);
+        }
+    }
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_count
+// Description  : charges a shared cache event to this process's statistics
+//
+// Inputs       : key - the block
+//                event - the event
+// Outputs      : nothing
+void shared_count(uint64_t key, LcCacheEvent event) {
+
+    CacheShard *shard = cache_shard(cache_hash(key));
+    pthread_mutex_lock(&shard->lock);
+    count_event(shard, key >> 32, block_partition(key >> 32), event);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_lookup
+// Description  : copies a block out of the shared cache.  On a miss the write
+//                count of the stripe is remembered, so the fill that follows
+//                can tell whether another writer beat it.
+//
+// Inputs       : key - the block
+//                buf - place for the 256 bytes of the block
+// Outputs      : 0 if found, -1 if not
+int shared_lookup(uint64_t key, char *buf) {
+
+    int set = cache_hash(key) % shared->sets;
+    int stripe = set % LC_CACHE_SHARED_LOCKS;
+
+    shared_lock(stripe);
+    int way = shared_find(set, key);
+    if (way != -1) {
+        memcpy(buf, &shared_data[(size_t)way * 256], 256);
+        shared_ways[way].stamp = ++shared->clock[stripe];
+    }
+    else {
+        last_miss_key = key;
+        last_miss_valid = 1;
+        shared_miss_writes = shared->writes[stripe];
+    }
+    pthread_mutex_unlock(&shared->locks[stripe]);
+
+    shared_count(key, (way != -1) ? LC_CACHE_HIT : LC_CACHE_MISS);
+    return((way != -1) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shared_store
+// Description  : puts a block in the shared cache, over its old copy or the
+//                least recently used way of the set.  The key is cleared while
+//                the data is copied, so a crash part way leaves an empty way.
+//                With write set the device write happens under the stripe
+//                lock, so every process sees the writes in device order.
+//
+// Inputs       : key - the block
+//                block - the 256 bytes of the block
+//                write - 1 to write the block through to its device
+// Outputs      : 0 if successful, -1 if failure
+int shared_store(uint64_t key, char *block, int write) {
+
+    int set = cache_hash(key) % shared->sets;
+    int stripe = set % LC_CACHE_SHARED_LOCKS;
+    int did = (key >> 32) & 0xff, sec = (key >> 16) & 0xffff, blk = key & 0xffff;
+    int result = 0;
+    LcCacheEvent event = LC_CACHE_UPDATE;
+
+    shared_lock(stripe);
+    if (write == 1) {
+
+        result = write_block_func(block, did, sec, blk);
+        shared->writes[stripe] += 1;
+    }
+    else if ((last_miss_valid == 1) && (last_miss_key == key) && (shared_miss_writes != shared->writes[stripe])) {  //our device read may predate that write
+
+        last_miss_valid = 0;
+        pthread_mutex_unlock(&shared->locks[stripe]);
+        return(0);
+    }
+    last_miss_valid = 0;
+
+    int way = shared_find(set, key);
+    uint64_t evicted = 0;
+    if ((way != -1) && (result == -1)) {  //the device may hold either copy now, drop ours
+
+        shared_ways[way].key = 0;
+        way = -1;
+    }
+    else if ((way == -1) && (result == 0)) {
+
+        event = LC_CACHE_INSERT;
+        way = set * LC_CACHE_SHARED_WAYS;
+        for (int w = 0; w < LC_CACHE_SHARED_WAYS; w++) {  //an empty way, or else the least recently used
+
+            L2Way *candidate = &shared_ways[set * LC_CACHE_SHARED_WAYS + w];
+            if ((candidate->key == 0) || (candidate->stamp < shared_ways[way].stamp)) {
+                way = set * LC_CACHE_SHARED_WAYS + w;
+                if (candidate->key == 0) {
+                    break;
+                }
+            }
+        }
+        evicted = shared_ways[way].key;
+    }
+    if (way != -1) {
+
+        shared_ways[way].key = 0;
+        memcpy(&shared_data[(size_t)way * 256], block, 256);
+        shared_ways[way].key = key + 1;
+        shared_ways[way].stamp = ++shared->clock[stripe];
+    }
+    pthread_mutex_unlock(&shared->locks[stripe]);
+
+    if (evicted != 0) {  //counted once the stripe is unlocked, the shard locks are never taken under it
+        shared_count(evicted - 1, LC_CACHE_EVICT);
+    }
+    if (way != -1) {
+        shared_count(key, event);
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : path_creatable
+// Description  : checks that a file can be created at a path, so that a bad
+//                path is refused when it is set rather than when it is used
+//
+// Inputs       : path - the path of the file
+// Outputs      : 1 if it can, 0 if not
+int path_creatable(const char *path) {
+
+    if (path[0] == '\0') {
+        return(0);
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        return(0);
+    }
+    int creatable = (access(dirname(copy), W_OK | X_OK) == 0);
+    free(copy);
+    return(creatable);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_getcache
+// Description  : Search the cache for a block.  The returned pointer refers to
+//                the cache line itself and may be overwritten by any later
+//                insert, so threaded callers should use lcloud_copycache.  A
+//                shared cache, or a second-tier block with no room in memory,
+//                returns this thread's copy of the block instead.
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : cache block if found (pointer), NULL if not or failure
+
+char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    if (shards == NULL) {
+        return(NULL);
+    }
+
+    if (shared != NULL) {
+        return((shared_lookup(cache_key(did, sec, blk), shared_block) == 0) ? shared_block : NULL);
+    }
+
+    uint64_t hash = cache_hash(cache_key(did, sec, blk));
+    CacheShard *shard = cache_shard(hash);
+    char *data = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    int line = lookup_line(shard, hash, did, sec, blk, shared_block);
+    if (line >= 0) {
+        data = line_data(shard, line);
+    }
+    else if (line == LC_CACHE_LINE_L2) {
+        data = shared_block;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Return the block, NULL if not found */
+    return( data );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_copycache
+// Description  : Search the cache for a block and copy it out while the shard
+//                is locked, so the caller gets a stable copy of the data
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+//                buf - place to put the 256 bytes of the block
+// Outputs      : 0 if found and copied, -1 if not or failure
+
+int lcloud_copycache( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf ) {
+
+    if ((shards == NULL) || (buf == NULL)) {
+        return(-1);
+    }
+    if (shared != NULL) {
+        return(shared_lookup(cache_key(did, sec, blk), buf));
+    }
+
+    uint64_t hash = cache_hash(cache_key(did, sec, blk));
+    CacheShard *shard = cache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int line = lookup_line(shard, hash, did, sec, blk, buf);
+    if (line >= 0) {
+        memcpy(buf, line_data(shard, line), 256);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return( (line != -1) ? 0 : -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : place_block
+// Description  : puts a clean block in the cache, updating its line in place
+//                if it is cached.  A block that was written (rather than read
+//                from its device) bumps the shard's write count, so a
+//                prefetch or warm-up read that raced it is dropped.
+//
+// Inputs       : did, sec, blk - the location of the block
+//                block - the 256 bytes of the block
+//                write - 1 if the block is new data being written, 0 if not
+// Outputs      : 0 if successful
+int place_block(LcDeviceId did, uint16_t sec, uint16_t blk, char *block, int write) {
+
+    uint64_t key = cache_key(did, sec, blk);
+    uint64_t hash = cache_hash(key);
+    CacheShard *shard = cache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    int room = 0;
+    int line = find_line(shard, hash, did, sec, blk);
+    if (line == -1) {
+        room = make_room(shard, block_partition(did));
+        line = find_line(shard, hash, did, sec, blk);
+    }
+    if (line != -1) {  //if this location is already in the cache, update its line in place
+
+        logMessage(LOG_INFO_LEVEL, "Updating cache item [%d/%d/%d]", did, sec, blk);
+        count_event(shard, did, block_partition(did), LC_CACHE_UPDATE);
+        memcpy(line_data(shard, line), block, 256);
+        shard->writes += write;
+        touch_line(shard, line);
+        pthread_mutex_unlock(&shard->lock);
+        return(0);
+    }
+
+    if ((last_miss_valid == 0) || (last_miss_key != key)) {  //writes of new blocks haven't been seen by a lookup
+        record_access(shard, hash, key);
+    }
+    last_miss_valid = 0;
+    int placed = (room == 0) ? insert_line(shard, hash, did, sec, blk, block, 0, 1) : -1;
+    if ((placed == -1) && (l2_sets > 0)) {  //a victim that can't be written back keeps its line, only drop any older copy
+        l2_take(key, NULL, NULL);
+    }
+    shard->writes += write;
+
+    pthread_mutex_unlock(&shard->lock);
+    if ((prefetch_pending_count > 0) && (prefetch_pending_key == key)) {  //the missed block is filled, now speculate
+        prefetch_issue();
+    }
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_putcache
+// Description  : Put a value in the cache
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+
+    // Error Checks
+    if ((shards == NULL) || (block == NULL)) {
+        return(-1);
+    }
+    if (shared != NULL) {
+        return(shared_store(cache_key(did, sec, blk), block, 0));
+    }
+    //////
+
+    return( place_block(did, sec, blk, block, 0) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_writecache
+// Description  : Write a block through the cache.  With write-through the
+//                block is cached and written to the device straight away,
+//                with write-back it is cached dirty (bypassing the admission
+//                filter) and written when it is evicted or flushed.  Without
+//                a cache the block goes straight to its device.
+//
+// Inputs       : did - device number of block to write
+//                sec - sector number of block to write
+//                blk - block number of block to write
+//                block - the 256 bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+
+    if ((block == NULL) || (write_block_func == NULL)) {
+        return(-1);
+    }
+
+    if (shards == NULL) {  //no cache, the block goes straight to its device
+        return(write_block_func(block, did, sec, blk));
+    }
+    if (shared != NULL) {  //always write-through, no process may hold another's dirty data
+        return(shared_store(cache_key(did, sec, blk), block, 1));
+    }
+    if (write_back == 0) {  //write-through
+        place_block(did, sec, blk, block, 1);
+        return(write_block_func(block, did, sec, blk));
+    }
+
+    uint64_t key = cache_key(did, sec, blk);
+    uint64_t hash = cache_hash(key);
+    CacheShard *shard = cache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    int room = 0;
+    int line = find_line(shard, hash, did, sec, blk);
+    if (line == -1) {
+        room = make_room(shard, block_partition(did));
+        line = find_line(shard, hash, did, sec, blk);
+    }
+    if (line != -1) {  //already cached, update it in place and mark it dirty
+
+        logMessage(LOG_INFO_LEVEL, "Updating cache item [%d/%d/%d]", did, sec, blk);
+        count_event(shard, did, block_partition(did), LC_CACHE_UPDATE);
+        memcpy(line_data(shard, line), block, 256);
+        set_dirty(shard, line, 1);
+        shard->prefetched[line] = 0;
+        touch_line(shard, line);
+    }
+    else if (room == 0) {
+
+        if ((last_miss_valid == 0) || (last_miss_key != key)) {
+            record_access(shard, hash, key);
+        }
+        last_miss_valid = 0;
+        line = insert_line(shard, hash, did, sec, blk, block, 1, 0);
+    }
+    shard->writes += 1;
+
+    if (line == -1) {  //no room without losing a dirty block, write through instead
+
+        if (l2_sets > 0) {  //drop any older second-tier copy
+            l2_take(key, NULL, NULL);
+        }
+        pthread_mutex_lock(&writeback_lock);  //lands after any older copy the flusher is writing
+        pthread_mutex_unlock(&shard->lock);
+        int result = write_block_func(block, did, sec, blk);
+        pthread_mutex_unlock(&writeback_lock);
+        return(result);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if ((flusher_running == 1) && (__atomic_load_n(&dirty_lines, __ATOMIC_RELAXED) * 100 > dirty_hard * total_lines)) {  //too far ahead of the devices, wait for the flusher
+        throttle_writer();
+    }
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_pincache
+// Description  : Pin a block into the cache's metadata area, where eviction
+//                never touches it, until it is unpinned as often as it was
+//                pinned.  A block that isn't cached is read from its device.
+//                Pins fail once the metadata area is full, or if they would
+//                leave a shard with no line to evict.
+//
+// Inputs       : did - device number of block to pin
+//                sec - sector number of block to pin
+//                blk - block number of block to pin
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    if ((shards == NULL) || (shared != NULL)) {  //a shared cache has no metadata area
+        return(-1);
+    }
+
+    uint64_t hash = cache_hash(cache_key(did, sec, blk));
+    CacheShard *shard = cache_shard(hash);
     char data[256];
-} Cache;
 
-Cache *cache;
-float hits = 0;
-float misses = 0;
+    pthread_mutex_lock(&shard->lock);
+    int line = find_line(shard, hash, did, sec, blk);
+    if ((line == -1) && (read_block_func != NULL)) {  //bring the block in first
+
+        pthread_mutex_unlock(&shard->lock);
+        if (read_block_func(data, did, sec, blk) == -1) {
+            return(-1);
+        }
+        pthread_mutex_lock(&shard->lock);
+        line = find_line(shard, hash, did, sec, blk);  //someone may have cached it meanwhile, theirs is newer
+        if ((line == -1) && (make_room(shard, block_partition(did)) == 0)) {
+
+            line = find_line(shard, hash, did, sec, blk);
+            if (line == -1) {
+                line = insert_line(shard, hash, did, sec, blk, data, 0, 0);
+            }
+        }
+    }
+
+    if ((line != -1) && (shard->pins[line] == 0)) {  //first pin moves the line off the LRU list
+
+        if ((__atomic_add_fetch(&metadata_lines, 1, __ATOMIC_RELAXED) > metadata_limit) || (shard->stats.pinned_lines + 1 >= (uint64_t)shard->num_lines)) {
+
+            __atomic_sub_fetch(&metadata_lines, 1, __ATOMIC_RELAXED);
+            shard->stats.pin_rejected += 1;
+            logMessage(LOG_INFO_LEVEL, "Cache metadata area full, not pinning [%d/%d/%d]", did, sec, blk);
+            line = -1;
+        }
+        else {
+
+            lru_unlink(shard, line);
+            shard->prev[line] = -1;
+            shard->next[line] = shard->pinned;
+            if (shard->pinned != -1) {
+                shard->prev[shard->pinned] = line;
+            }
+            shard->pinned = line;
+            shard->pins[line] = 1;
+            shard->stats.pinned_lines += 1;
+        }
+    }
+    else if (line != -1) {
+        shard->pins[line] += 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return( (line != -1) ? 0 : -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_unpincache
+// Description  : Drop a pin taken by lcloud_pincache, the last one returns
+//                the block to the LRU list as the most recently used
+//
+// Inputs       : did - device number of block to unpin
+//                sec - sector number of block to unpin
+//                blk - block number of block to unpin
+// Outputs      : 0 if successful, -1 if failure (block not pinned)
+
+int lcloud_unpincache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+
+    if (shards == NULL) {
+        return(-1);
+    }
+
+    uint64_t hash = cache_hash(cache_key(did, sec, blk));
+    CacheShard *shard = cache_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int line = find_line(shard, hash, did, sec, blk);
+    if ((line == -1) || (shard->pins[line] == 0)) {
+        pthread_mutex_unlock(&shard->lock);
+        return(-1);
+    }
+
+    shard->pins[line] -= 1;
+    if (shard->pins[line] == 0) {  //off the pinned list, back on the LRU list
+
+        int prev = shard->prev[line], next = shard->next[line];
+        if (prev != -1) {
+            shard->next[prev] = next;
+        }
+        else {
+            shard->pinned = next;
+        }
+        if (next != -1) {
+            shard->prev[next] = prev;
+        }
+        lru_push(shard, line);
+        shard->stats.pinned_lines -= 1;
+        __atomic_sub_fetch(&metadata_lines, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_flushcache
+// Description  : Write every dirty block (in memory and in the second tier)
+//                back to the devices.  Must be called before the devices
+//                are powered off.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if any block failed to write
+
+int lcloud_flushcache( void ) {
+
+    int result = 0;
+    if (shards == NULL) {
+        return(-1);
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+
+        pthread_mutex_lock(&shards[s].lock);
+        for (int line = first_cached(&shards[s]); line != -1; line = next_cached(&shards[s], line)) {
+
+            if (shards[s].dirty[line] == 1) {
+
+                if (write_back_block(&shards[s], shards[s].keys[line], line_data(&shards[s], line)) == -1) {
+                    result = -1;  //stays dirty for the next flush
+                }
+                else {
+                    set_dirty(&shards[s], line, 0);
+                }
+            }
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+
+    for (int set = 0; set < l2_sets; set++) {
+
+        pthread_mutex_lock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+        for (int w = 0; w < LC_CACHE_L2_WAYS; w++) {
+
+            L2Way *way = &l2_ways[set * LC_CACHE_L2_WAYS + w];
+            if ((way->key != 0) && (way->dirty == 1)) {
+
+                if (write_back_block(NULL, way->key - 1, &l2_data[((size_t)set * LC_CACHE_L2_WAYS + w) * 256]) == -1) {
+                    result = -1;
+                }
+                else {
+                    way->dirty = 0;
+                }
+            }
+        }
+        pthread_mutex_unlock(&l2_locks[set % LC_CACHE_L2_LOCKS]);
+    }
+
+    return( result );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_initcache
+// Description  : Initialze the cache by setting up metadata a cache elements.
+//                The blocks are divided evenly across the shards.
+//
+// Inputs       : maxblocks - the max number number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_initcache( int maxblocks ) {
+
+    if ((maxblocks <= 0) || (shards != NULL)) {
+        return(-1);
+    }
+
+    if (num_shards > maxblocks) {  //every shard needs at least one line
+        num_shards = maxblocks;
+    }
+
+    int reserved = 0;
+    for (int partition = 0; partition < LC_CACHE_MAXPARTITIONS; partition++) {
+        reserved += partition_min[partition];
+    }
+    if (reserved > maxblocks) {  //the reservations must fit, or some could never be met
+
+        logMessage(LOG_ERROR_LEVEL, "Cache partitions reserve %d blocks, more than the %d in the cache", reserved, maxblocks);
+        return(-1);
+    }
+
+    if (posix_memalign((void **)&shards, 64, num_shards * sizeof(CacheShard)) != 0) {
+        shards = NULL;
+        return(-1);
+    }
+    memset(shards, 0, num_shards * sizeof(CacheShard));
+    for (int s = 0; s < num_shards; s++) {  //empty LRU lists, in case setup fails part way
+        shards[s].most_recent = -1;
+        shards[s].least_recent = -1;
+        shards[s].pinned = -1;
+    }
+    metadata_lines = 0;
+    advisor_lookups = 0;
+    memset(advisor_hits, 0, sizeof(advisor_hits));
+    total_lines = maxblocks;
+    dirty_lines = 0;
+    peak_dirty_lines = 0;
+    flusher_rounds = flusher_blocks = flusher_batches = flusher_busy_ms = throttle_count = throttle_ms = l2_writebacks = 0;
+
+    if (arena_alloc((size_t)maxblocks * 256) == -1) {
+        lcloud_closecache();
+        return(-1);
+    }
+
+    size_t first_line = 0;
+    for (int s = 0; s < num_shards; s++) {
+
+        CacheShard *shard = &shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->num_lines = (maxblocks / num_shards) + ((s < (maxblocks % num_shards)) ? 1 : 0);
+        shard->keys = (uint64_t *)calloc(shard->num_lines, sizeof(uint64_t));
+        shard->prev = (int *)malloc(shard->num_lines * sizeof(int));
+        shard->next = (int *)malloc(shard->num_lines * sizeof(int));
+        shard->hash_next = (int *)malloc(shard->num_lines * sizeof(int));
+        shard->dirty = (uint8_t *)calloc(shard->num_lines, sizeof(uint8_t));
+        shard->prefetched = (uint8_t *)calloc(shard->num_lines, sizeof(uint8_t));
+        shard->owner = (uint8_t *)calloc(shard->num_lines, sizeof(uint8_t));
+        shard->pins = (uint16_t *)calloc(shard->num_lines, sizeof(uint16_t));
+        shard->dirty_since = (uint64_t *)calloc(shard->num_lines, sizeof(uint64_t));
+        for (int partition = 0; partition < LC_CACHE_MAXPARTITIONS; partition++) {  //each shard gets its share, caps round up
+
+            shard->partition_min[partition] = (int)(((int64_t)partition_min[partition] * shard->num_lines) / maxblocks);
+            shard->partition_max[partition] = (int)(((int64_t)partition_max[partition] * shard->num_lines + maxblocks - 1) / maxblocks);
+        }
+        shard->data = &arena[first_line * 256];
+        first_line += shard->num_lines;
+
+        shard->num_buckets = 1;  //at least twice as many buckets as lines, keeps the chains short
+        while (shard->num_buckets < shard->num_lines * 2) {
+            shard->num_buckets *= 2;
+        }
+        shard->buckets = (int *)malloc(shard->num_buckets * sizeof(int));
+        shard->reuse_slots = shard->num_lines * LC_CACHE_REUSE_TRACKING;
+        shard->reuse_keys = (uint64_t *)calloc(shard->reuse_slots, sizeof(uint64_t));
+        shard->reuse_clock = (uint64_t *)calloc(shard->reuse_slots, sizeof(uint64_t));
+        if (advisor_enabled == 1) {  //the ghost list remembers as many keys as the shard has lines
+
+            shard->ghost_keys = (uint64_t *)calloc(shard->num_lines, sizeof(uint64_t));
+            shard->ghost_next = (int *)malloc(shard->num_lines * sizeof(int));
+            shard->ghost_buckets = (int *)malloc(shard->num_buckets * sizeof(int));
+            if ((shard->ghost_keys == NULL) || (shard->ghost_next == NULL) || (shard->ghost_buckets == NULL)) {
+                lcloud_closecache();
+                return(-1);
+            }
+        }
+        if ((shard->keys == NULL) || (shard->prev == NULL) || (shard->next == NULL) || (shard->hash_next == NULL) || (shard->dirty == NULL) ||
+            (shard->prefetched == NULL) || (shard->owner == NULL) || (shard->pins == NULL) || (shard->dirty_since == NULL) || (shard->buckets == NULL) || (shard->reuse_keys == NULL) || (shard->reuse_clock == NULL)) {
+            lcloud_closecache();
+            return(-1);
+        }
+
+        for (int bucket = 0; bucket < shard->num_buckets; bucket++) {
+            shard->buckets[bucket] = -1;
+            if (shard->ghost_buckets != NULL) {
+                shard->ghost_buckets[bucket] = -1;
+            }
+        }
+
+        for (int line = 0; line < shard->num_lines; line++) {  //chain every line onto the free list
+
+            shard->prev[line] = -1;
+            shard->next[line] = (line + 1 < shard->num_lines) ? line + 1 : -1;
+            shard->hash_next[line] = -1;
+        }
+        shard->free_line = 0;
+        shard->most_recent = -1;
+        shard->least_recent = -1;
+        shard->sketch_sample_size = (unsigned long)shard->num_lines * LC_CACHE_SKETCH_SAMPLE;
+        shard->stats.num_lines = shard->num_lines;
+    }
+
+    for (int did = 0; did < LC_CACHE_MAXDEVICES; did++) {  //prefetchers start cautious
+
+        Prefetcher *pf = &prefetchers[did];
+        memset(pf, 0, sizeof(Prefetcher));
+        pthread_mutex_init(&pf->lock, NULL);
+        pf->last_miss = -1;
+        pf->degree = 2;
+        for (int slot = 0; slot < LC_CACHE_PREFETCH_TABLE; slot++) {
+            pf->table_from[slot] = -1;
+        }
+    }
+
+    if ((shared_name != NULL) && (shared_attach(maxblocks) == -1)) {  //the private shards are then only used for statistics
+        lcloud_closecache();
+        return(-1);
+    }
+
+    if ((l2_path != NULL) && (shared == NULL)) {  //the file is recreated empty, so nothing left by an earlier run is ever trusted
+
+        l2_sets = (l2_maxblocks + LC_CACHE_L2_WAYS - 1) / LC_CACHE_L2_WAYS;
+        size_t size = (size_t)l2_sets * LC_CACHE_L2_WAYS * 256;
+        l2_fd = open(l2_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if ((l2_fd == -1) || (ftruncate(l2_fd, size) == -1) ||
+            ((l2_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, l2_fd, 0)) == MAP_FAILED)) {
+
+            logMessage(LOG_ERROR_LEVEL, "Failed creating second tier cache file [%s]", l2_path);
+            l2_data = NULL;
+            l2_sets = 0;
+            lcloud_closecache();
+            return(-1);
+        }
+        for (int stripe = 0; stripe < LC_CACHE_L2_LOCKS; stripe++) {
+            pthread_mutex_init(&l2_locks[stripe], NULL);
+            l2_clock[stripe] = 0;
+        }
+        l2_ways = (L2Way *)calloc((size_t)l2_sets * LC_CACHE_L2_WAYS, sizeof(L2Way));
+        if (l2_ways == NULL) {
+
+            logMessage(LOG_ERROR_LEVEL, "Failed allocating second tier cache tags [%s]", l2_path);
+            lcloud_closecache();
+            return(-1);
+        }
+        logMessage(LOG_INFO_LEVEL, "Second tier cache [%s] %d blocks, %d-way", l2_path, l2_sets * LC_CACHE_L2_WAYS, LC_CACHE_L2_WAYS);
+    }
+
+    warm_stop = 0;  //warm up from the last run in the background
+    if ((snapshot_path != NULL) && (read_block_func != NULL) && (shared == NULL) && (access(snapshot_path, R_OK) == 0)) {
+        warm_running = (pthread_create(&warm_thread, NULL, warm_cache, NULL) == 0);
+    }
+
+    flusher_stop = 0;  //write-behind, only useful when writes are deferred
+    if ((flusher_enabled == 1) && (write_back == 1) && (write_block_func != NULL) && (shared == NULL)) {
+        flusher_running = (pthread_create(&flusher_thread, NULL, flush_dirty, NULL) == 0);
+    }
+
+    logMessage(LOG_INFO_LEVEL, "init_cmpsc311_cache: initialization complete [%d/%d], %d shard(s)", maxblocks, maxblocks*256, num_shards);
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_closecache
+// Description  : Clean up the cache when program is closing
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_closecache( void ) {
+
+    if (shards == NULL) {
+        return(-1);
+    }
+
+    if (warm_running == 1) {  //no device reads may follow the close
+
+        warm_stop = 1;
+        pthread_join(warm_thread, NULL);
+        warm_running = 0;
+    }
+    if (flusher_running == 1) {
+
+        pthread_mutex_lock(&flusher_mutex);
+        flusher_stop = 1;
+        pthread_cond_broadcast(&flusher_cond);
+        pthread_mutex_unlock(&flusher_mutex);
+        pthread_join(flusher_thread, NULL);
+        flusher_running = 0;
+    }
+    lcloud_flushcache();  //nothing dirty may be lost
+    if ((snapshot_path != NULL) && (shared == NULL) && (save_snapshot(snapshot_path) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed saving cache snapshot [%s]", snapshot_path);
+    }
+    for (int s = 0; s < num_shards; s++) {  //every block still cached is discarded
+
+        pthread_mutex_lock(&shards[s].lock);
+        for (int line = first_cached(&shards[s]); line != -1; line = next_cached(&shards[s], line)) {
+
+            count_event(&shards[s], shards[s].keys[line] >> 32, shards[s].owner[line], LC_CACHE_EVICT);
+            shards[s].stats.evict_reason[LC_CACHE_EVICT_CLOSE] += 1;
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+
+    LcCacheStats stats;
+    lcloud_getcachestats(&stats);
+    uint64_t hits = stats.total[LC_CACHE_HIT];
+    uint64_t misses = stats.total[LC_CACHE_MISS];
+    double hit_rate = ((hits + misses) > 0) ? ((double)hits / (double)(hits + misses)) * 100 : 0.0;
+
+    logMessage(LOG_INFO_LEVEL, "Closed cmpsc311 cache, deleting %lu items", (unsigned long)stats.used_lines);
+    logMessage(LOG_INFO_LEVEL, "Cache hits [%lu]", (unsigned long)hits);
+    logMessage(LOG_INFO_LEVEL, "Cache misses [%lu]", (unsigned long)misses);
+    logMessage(LOG_INFO_LEVEL, "Cache efficiency [%.2f%%]", hit_rate);
+    logMessage(LOG_INFO_LEVEL, "Cache peak occupancy [%lu/%lu]", (unsigned long)stats.peak_lines, (unsigned long)stats.num_lines);
+    for (int did = 0; did < LC_CACHE_MAXDEVICES; did++) {  //per-device breakdown, only for devices that were used
+
+        uint64_t *dev = stats.device[did];
+        if (dev[LC_CACHE_HIT] + dev[LC_CACHE_MISS] + dev[LC_CACHE_INSERT] > 0) {
+            logMessage(LOG_INFO_LEVEL, "Cache device [%d] hits [%lu] misses [%lu] inserts [%lu] updates [%lu] evictions [%lu]", did,
+                (unsigned long)dev[LC_CACHE_HIT], (unsigned long)dev[LC_CACHE_MISS], (unsigned long)dev[LC_CACHE_INSERT],
+                (unsigned long)dev[LC_CACHE_UPDATE], (unsigned long)dev[LC_CACHE_EVICT]);
+        }
+    }
+    for (int caller = 0; caller < LC_CACHE_MAXCALLER; caller++) {
+
+        uint64_t *path = stats.caller[caller];
+        logMessage(LOG_INFO_LEVEL, "Cache %s path hits [%lu] misses [%lu] inserts [%lu] updates [%lu] evictions [%lu]", LC_CACHE_CALLER_LABELS[caller],
+            (unsigned long)path[LC_CACHE_HIT], (unsigned long)path[LC_CACHE_MISS], (unsigned long)path[LC_CACHE_INSERT],
+            (unsigned long)path[LC_CACHE_UPDATE], (unsigned long)path[LC_CACHE_EVICT]);
+    }
+    for (int partition = 0; (partition < LC_CACHE_MAXPARTITIONS) && (partitions_enabled == 1); partition++) {  //hit ratios to size the quotas by
+
+        uint64_t *part = stats.partition[partition];
+        if (part[LC_CACHE_HIT] + part[LC_CACHE_MISS] + part[LC_CACHE_INSERT] > 0) {
+
+            double part_rate = ((double)part[LC_CACHE_HIT] * 100) / (double)((part[LC_CACHE_HIT] + part[LC_CACHE_MISS] > 0) ? part[LC_CACHE_HIT] + part[LC_CACHE_MISS] : 1);
+            logMessage(LOG_INFO_LEVEL, "Cache partition [%d] hits [%lu] misses [%lu] efficiency [%.2f%%] holding [%lu] of min [%d] max [%d]", partition,
+                (unsigned long)part[LC_CACHE_HIT], (unsigned long)part[LC_CACHE_MISS], part_rate, (unsigned long)stats.partition_used[partition],
+                partition_min[partition], partition_max[partition]);
+        }
+    }
+    if (admission_enabled == 1) {
+        logMessage(LOG_INFO_LEVEL, "Cache admission filter admitted [%lu], rejected [%lu]", (unsigned long)stats.admitted, (unsigned long)stats.rejected);
+    }
+    if (write_back == 1) {
+        logMessage(LOG_INFO_LEVEL, "Cache write-backs [%lu]", (unsigned long)stats.writebacks);
+    }
+    if (prefetch_enabled == 1) {
+        logMessage(LOG_INFO_LEVEL, "Cache prefetches issued [%lu], useful [%lu], useless [%lu]", (unsigned long)stats.prefetch_issued,
+            (unsigned long)stats.prefetch_useful, (unsigned long)stats.prefetch_useless);
+    }
+    if (flusher_enabled == 1) {
+
+        double rate = (stats.flusher_busy_ms > 0) ? ((double)stats.flusher_blocks * 1000) / stats.flusher_busy_ms : 0.0;
+        logMessage(LOG_INFO_LEVEL, "Cache flusher wrote [%lu] blocks in [%lu] runs over [%lu] rounds (%.0f blocks/s busy), peak dirty [%lu], writers throttled [%lu] for [%lu] ms",
+            (unsigned long)stats.flusher_blocks, (unsigned long)stats.flusher_batches, (unsigned long)stats.flusher_rounds, rate,
+            (unsigned long)stats.peak_dirty_lines, (unsigned long)stats.throttled, (unsigned long)stats.throttled_ms);
+    }
+    if (advisor_enabled == 1) {
+        advisor_report();
+    }
+    if (shared != NULL) {
+        logMessage(LOG_INFO_LEVEL, "Shared cache [%s] locks recovered from dead processes [%lu]", shared_name, (unsigned long)stats.shared_recovered);
+    }
+    if (stats.pinned_lines + stats.pin_rejected > 0) {
+        logMessage(LOG_INFO_LEVEL, "Cache metadata area pinned [%lu/%d], rejected pins [%lu]", (unsigned long)stats.pinned_lines, metadata_limit, (unsigned long)stats.pin_rejected);
+    }
+    if (snapshot_path != NULL) {
+        logMessage(LOG_INFO_LEVEL, "Cache warmed [%lu] blocks, dropped [%lu] stale", (unsigned long)stats.warm_loaded, (unsigned long)stats.warm_stale);
+    }
+    if (l2_sets > 0) {
+        logMessage(LOG_INFO_LEVEL, "Cache L1 hits [%lu], L2 hits [%lu], L2 misses [%lu]", (unsigned long)hits, (unsigned long)stats.l2_hits, (unsigned long)stats.l2_misses);
+    }
+    if ((stats_file != NULL) && (lcloud_dumpcachestats(stats_file) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed dumping cache statistics to [%s]", stats_file);
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+
+        free(shards[s].keys);
+        free(shards[s].prev);
+        free(shards[s].next);
+        free(shards[s].hash_next);
+        free(shards[s].dirty);
+        free(shards[s].prefetched);
+        free(shards[s].owner);
+        free(shards[s].pins);
+        free(shards[s].dirty_since);
+        free(shards[s].buckets);
+        free(shards[s].reuse_keys);
+        free(shards[s].reuse_clock);
+        free(shards[s].ghost_keys);
+        free(shards[s].ghost_next);
+        free(shards[s].ghost_buckets);
+        pthread_mutex_destroy(&shards[s].lock);
+    }
+    free(shards);
+    shards = NULL;
+    arena_free();
+    if (shared != NULL) {
+        shared_detach();
+    }
+    for (int did = 0; did < LC_CACHE_MAXDEVICES; did++) {
+        pthread_mutex_destroy(&prefetchers[did].lock);
+    }
+
+    if (l2_data != NULL) {  //the second tier is only a cache, throw the file away
+
+        munmap(l2_data, (size_t)l2_sets * LC_CACHE_L2_WAYS * 256);
+        for (int stripe = 0; stripe < LC_CACHE_L2_LOCKS; stripe++) {
+            pthread_mutex_destroy(&l2_locks[stripe]);
+        }
+    }
+    if (l2_fd != -1) {
+        close(l2_fd);
+        unlink(l2_path);
+    }
+    free(l2_ways);
+    l2_data = NULL;
+    l2_ways = NULL;
+    l2_fd = -1;
+    l2_sets = 0;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacheadmission
+// Description  : Enable/disable the TinyLFU admission filter.  When enabled a
+//                new block only displaces the LRU victim if the frequency
+//                sketch estimates it to be more popular.
+//
+// Inputs       : enabled - 1 to filter admissions, 0 to admit every block
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcacheadmission( int enabled ) {
+
+    if ((enabled != 0) && (enabled != 1)) {
+        return(-1);
+    }
+
+    admission_enabled = enabled;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacheshards
+// Description  : Set the number of independently locked shards the cache is
+//                split into.  Blocks are assigned to shards by key hash, so
+//                threads working on different shards never contend.
+//
+// Inputs       : count - number of shards (1 to LC_CACHE_MAXSHARDS)
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized)
+
+int lcloud_setcacheshards( int count ) {
+
+    if ((count < 1) || (count > LC_CACHE_MAXSHARDS) || (shards != NULL)) {
+        return(-1);
+    }
+
+    num_shards = count;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachecaller
+// Description  : Set the filesystem path that this thread's cache accesses
+//                are charged to in the statistics
+//
+// Inputs       : caller - the calling path
+// Outputs      : the previous caller, so that it can be restored
+
+LcCacheCaller lcloud_setcachecaller( LcCacheCaller caller ) {
+
+    LcCacheCaller previous = cache_caller;
+    if (caller < LC_CACHE_MAXCALLER) {
+        cache_caller = caller;
+    }
+    return( previous );
+}
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Functions
+// Function     : lcloud_getcachecaller
+// Description  : Get the filesystem path that this thread's cache accesses
+//                are charged to in the statistics
+//
+// Inputs       : none
+// Outputs      : the current caller
+
+LcCacheCaller lcloud_getcachecaller( void ) {
+
+    return( cache_caller );
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : adjust_timestamps
-// Description  : increments all timestamps by one except for the one given by the inputted cache line
+// Function     : lcloud_getcachestats
+// Description  : Get a snapshot of the cache statistics, summed over the
+//                shards.  Peak occupancy is the sum of the per-shard peaks.
 //
-// Inputs       : cache_line - the cache line number for the data whose timestamp will not be changed
-// Outputs      : nothing
-void adjust_timestamps(int cache_line) {
+// Inputs       : stats - the structure to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_getcachestats( LcCacheStats *stats ) {
+
+    if ((shards == NULL) || (stats == NULL)) {
+        return(-1);
+    }
 
-    for (int cache_block = 0; cache_block < LC_CACHE_MAXBLOCKS; cache_block++) {
+    memset(stats, 0, sizeof(LcCacheStats));
+    for (int s = 0; s < num_shards; s++) {
 
-        if ((cache[cache_block].cache_line != cache_line) && (cache[cache_block].timestamp != -1)) {
+        pthread_mutex_lock(&shards[s].lock);
+        LcCacheStats *shard = &shards[s].stats;
+        for (int event = 0; event < LC_CACHE_MAXEVENT; event++) {
 
-            cache[cache_block].timestamp += 1;
+            stats->total[event] += shard->total[event];
+            for (int did = 0; did < LC_CACHE_MAXDEVICES; did++) {
+                stats->device[did][event] += shard->device[did][event];
+            }
+            for (int caller = 0; caller < LC_CACHE_MAXCALLER; caller++) {
+                stats->caller[caller][event] += shard->caller[caller][event];
+            }
+            for (int partition = 0; partition < LC_CACHE_MAXPARTITIONS; partition++) {
+                stats->partition[partition][event] += shard->partition[partition][event];
+            }
+        }
+        for (int partition = 0; partition < LC_CACHE_MAXPARTITIONS; partition++) {
+            stats->partition_used[partition] += shard->partition_used[partition];
+        }
+        for (int reason = 0; reason < LC_CACHE_MAXEVICT; reason++) {
+            stats->evict_reason[reason] += shard->evict_reason[reason];
+        }
+        for (int bucket = 0; bucket < LC_CACHE_REUSE_BUCKETS; bucket++) {
+            stats->reuse[bucket] += shard->reuse[bucket];
         }
+        stats->writebacks += shard->writebacks;
+        stats->l2_hits += shard->l2_hits;
+        stats->l2_misses += shard->l2_misses;
+        stats->l2_stores += shard->l2_stores;
+        stats->l2_evictions += shard->l2_evictions;
+        stats->prefetch_issued += shard->prefetch_issued;
+        stats->prefetch_useful += shard->prefetch_useful;
+        stats->prefetch_useless += shard->prefetch_useless;
+        stats->warm_loaded += shard->warm_loaded;
+        stats->warm_stale += shard->warm_stale;
+        stats->pinned_lines += shard->pinned_lines;
+        stats->pin_rejected += shard->pin_rejected;
+        stats->admitted += shard->admitted;
+        stats->rejected += shard->rejected;
+        stats->used_lines += shard->used_lines;
+        stats->peak_lines += shard->peak_lines;
+        stats->num_lines += shard->num_lines;
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+
+    pthread_mutex_lock(&writeback_lock);  //the flusher's counters are global
+    stats->flusher_rounds = flusher_rounds;
+    stats->flusher_blocks = flusher_blocks;
+    stats->flusher_batches = flusher_batches;
+    stats->flusher_busy_ms = flusher_busy_ms;
+    stats->writebacks += l2_writebacks;
+    pthread_mutex_unlock(&writeback_lock);
+    stats->dirty_lines = __atomic_load_n(&dirty_lines, __ATOMIC_RELAXED);
+    stats->peak_dirty_lines = __atomic_load_n(&peak_dirty_lines, __ATOMIC_RELAXED);
+    stats->throttled = __atomic_load_n(&throttle_count, __ATOMIC_RELAXED);
+    stats->throttled_ms = __atomic_load_n(&throttle_ms, __ATOMIC_RELAXED);
+    stats->advisor_lookups = __atomic_load_n(&advisor_lookups, __ATOMIC_RELAXED);
+    stats->shared_recovered = (shared != NULL) ? __atomic_load_n(&shared->recovered, __ATOMIC_RELAXED) : 0;
+    for (int size = 0; size < LC_CACHE_ADVISOR_SIZES; size++) {
+        stats->ghost_hits[size] = __atomic_load_n(&advisor_hits[size], __ATOMIC_RELAXED);
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_json_counters
+// Description  : writes one set of event counters as a JSON object
+//
+// Inputs       : fh - the file to write to
+//                counts - the event counters
+// Outputs      : nothing
+void write_json_counters(FILE *fh, const uint64_t *counts) {
+
+    fprintf(fh, "{");
+    for (int event = 0; event < LC_CACHE_MAXEVENT; event++) {
+        fprintf(fh, "%s\"%s\": %lu", (event > 0) ? ", " : " ", LC_CACHE_EVENT_LABELS[event], (unsigned long)counts[event]);
     }
+    fprintf(fh, " }");
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_getcache
-// Description  : Search the cache for a block 
+// Function     : lcloud_dumpcachestats
+// Description  : Write the cache statistics to a file as JSON
 //
-// Inputs       : did - device number of block to find
-//                sec - sector number of block to find
-//                blk - block number of block to find
-// Outputs      : cache block if found (pointer), NULL if not or failure
+// Inputs       : path - the file to write (overwritten)
+// Outputs      : 0 if successful, -1 if failure
 
-char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk ) {
+int lcloud_dumpcachestats( const char *path ) {
 
-    for (int cache_block = 0; cache_block < LC_CACHE_MAXBLOCKS; cache_block++) {
+    LcCacheStats stats;
+    if ((path == NULL) || (lcloud_getcachestats(&stats) == -1)) {
+        return(-1);
+    }
+
+    FILE *fh = fopen(path, "w");
+    if (fh == NULL) {
+        return(-1);
+    }
+
+    fprintf(fh, "{\n  \"lines\": %lu,\n  \"used_lines\": %lu,\n  \"peak_lines\": %lu,\n  \"shards\": %d,\n",
+        (unsigned long)stats.num_lines, (unsigned long)stats.used_lines, (unsigned long)stats.peak_lines, num_shards);
+    fprintf(fh, "  \"total\": ");
+    write_json_counters(fh, stats.total);
+
+    fprintf(fh, ",\n  \"devices\": {");  //only devices that saw any traffic
+    int first = 1;
+    for (int did = 0; did < LC_CACHE_MAXDEVICES; did++) {
+
+        uint64_t *dev = stats.device[did];
+        if (dev[LC_CACHE_HIT] + dev[LC_CACHE_MISS] + dev[LC_CACHE_INSERT] > 0) {
+            fprintf(fh, "%s\n    \"%d\": ", (first == 1) ? "" : ",", did);
+            write_json_counters(fh, dev);
+            first = 0;
+        }
+    }
+
+    fprintf(fh, "\n  },\n  \"callers\": {");
+    for (int caller = 0; caller < LC_CACHE_MAXCALLER; caller++) {
+
+        fprintf(fh, "%s\n    \"%s\": ", (caller == 0) ? "" : ",", LC_CACHE_CALLER_LABELS[caller]);
+        write_json_counters(fh, stats.caller[caller]);
+    }
+
+    fprintf(fh, "\n  },\n  \"partitions\": {");  //only partitions that were configured or used
+    first = 1;
+    for (int partition = 0; partition < LC_CACHE_MAXPARTITIONS; partition++) {
 
-        int found = 1;  //assume cache location exists for given input
-        if (cache[cache_block].device_id != did  || cache[cache_block].sector != sec || cache[cache_block].block != blk) {
+        uint64_t *part = stats.partition[partition];
+        if ((part[LC_CACHE_HIT] + part[LC_CACHE_MISS] + part[LC_CACHE_INSERT] > 0) || (partition_min[partition] + partition_max[partition] > 0)) {
 
-            found = 0;  //if the inputted information is not found, set found to 0
+            fprintf(fh, "%s\n    \"%d\": { \"min\": %d, \"max\": %d, \"used\": %lu, \"events\": ", (first == 1) ? "" : ",", partition,
+                partition_min[partition], partition_max[partition], (unsigned long)stats.partition_used[partition]);
+            write_json_counters(fh, part);
+            fprintf(fh, " }");
+            first = 0;
         }
-        
-        if (found == 1) {  //cache hit! fix timestamps and return the cache block's data
+    }
+
+    fprintf(fh, "\n  },\n  \"evict_reasons\": {");
+    for (int reason = 0; reason < LC_CACHE_MAXEVICT; reason++) {
+        fprintf(fh, "%s\"%s\": %lu", (reason == 0) ? " " : ", ", LC_CACHE_EVICT_LABELS[reason], (unsigned long)stats.evict_reason[reason]);
+    }
+
+    fprintf(fh, " },\n  \"admission\": { \"enabled\": %s, \"admitted\": %lu, \"rejected\": %lu },\n",
+        (admission_enabled == 1) ? "true" : "false", (unsigned long)stats.admitted, (unsigned long)stats.rejected);
+
+    fprintf(fh, "  \"write_back\": { \"enabled\": %s, \"writebacks\": %lu },\n", (write_back == 1) ? "true" : "false", (unsigned long)stats.writebacks);
+    fprintf(fh, "  \"l2\": { \"blocks\": %d, \"hits\": %lu, \"misses\": %lu, \"stores\": %lu, \"evictions\": %lu },\n",
+        l2_sets * LC_CACHE_L2_WAYS, (unsigned long)stats.l2_hits, (unsigned long)stats.l2_misses, (unsigned long)stats.l2_stores, (unsigned long)stats.l2_evictions);
+
+    fprintf(fh, "  \"prefetch\": { \"enabled\": %s, \"issued\": %lu, \"useful\": %lu, \"useless\": %lu },\n", (prefetch_enabled == 1) ? "true" : "false",
+        (unsigned long)stats.prefetch_issued, (unsigned long)stats.prefetch_useful, (unsigned long)stats.prefetch_useless);
 
-            hits += 1;
-            cache[cache_block].timestamp = 0;
-            adjust_timestamps(cache[cache_block].cache_line);
+    fprintf(fh, "  \"flusher\": { \"enabled\": %s, \"rounds\": %lu, \"blocks\": %lu, \"runs\": %lu, \"busy_ms\": %lu, \"dirty\": %lu, \"peak_dirty\": %lu, \"throttled\": %lu, \"throttled_ms\": %lu },\n",
+        (flusher_enabled == 1) ? "true" : "false", (unsigned long)stats.flusher_rounds, (unsigned long)stats.flusher_blocks, (unsigned long)stats.flusher_batches,
+        (unsigned long)stats.flusher_busy_ms, (unsigned long)stats.dirty_lines, (unsigned long)stats.peak_dirty_lines, (unsigned long)stats.throttled,
+        (unsigned long)stats.throttled_ms);
+    fprintf(fh, "  \"advisor\": { \"enabled\": %s, \"lookups\": %lu, \"extra_hits\": {", (advisor_enabled == 1) ? "true" : "false",
+        (unsigned long)stats.advisor_lookups);
+    for (int size = 0; size < LC_CACHE_ADVISOR_SIZES; size++) {
+        fprintf(fh, "%s\"%s\": %lu", (size == 0) ? " " : ", ", LC_CACHE_ADVISOR_LABELS[size], (unsigned long)stats.ghost_hits[size]);
+    }
+    fprintf(fh, " } },\n");
+    fprintf(fh, "  \"shared\": { \"enabled\": %s, \"blocks\": %d, \"recovered\": %lu },\n", (shared != NULL) ? "true" : "false",
+        (shared != NULL) ? shared->sets * LC_CACHE_SHARED_WAYS : 0, (unsigned long)stats.shared_recovered);
+    fprintf(fh, "  \"metadata\": { \"limit\": %d, \"pinned\": %lu, \"rejected\": %lu },\n", metadata_limit,
+        (unsigned long)stats.pinned_lines, (unsigned long)stats.pin_rejected);
+    fprintf(fh, "  \"warm\": { \"loaded\": %lu, \"stale\": %lu },\n", (unsigned long)stats.warm_loaded, (unsigned long)stats.warm_stale);
+
+    fprintf(fh, "  \"reuse_distance\": [");  //[min, max) of each bucket, bucket 0 counts first accesses
+    first = 1;
+    for (int bucket = 0; bucket < LC_CACHE_REUSE_BUCKETS; bucket++) {
 
-            logMessage(LOG_INFO_LEVEL, "Found cache item [%d/%d/%d]", did, sec, blk);
-            return(cache[cache_block].data);
+        if (stats.reuse[bucket] > 0) {
+            uint64_t min = (bucket == 0) ? 0 : ((uint64_t)1 << (bucket - 1));
+            uint64_t max = (bucket == 0) ? 0 : ((uint64_t)1 << bucket);
+            fprintf(fh, "%s\n    { \"min\": %lu, \"max\": %lu, \"count\": %lu }", (first == 1) ? "" : ",",
+                (unsigned long)min, (unsigned long)max, (unsigned long)stats.reuse[bucket]);
+            first = 0;
         }
     }
+    fprintf(fh, "\n  ]\n}\n");
 
-    misses += 1;  //cache miss, increment miss count and return NULL
-    logMessage(LOG_INFO_LEVEL, "Cache item [%d/%d/%d] not found", did, sec, blk);
-    /* Return not found */
-    return( NULL );
+    fclose(fh);
+
+    /* Return successfully */
+    return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_putcache
-// Description  : Put a value in the cache 
+// Function     : lcloud_setcachestatsfile
+// Description  : Dump the statistics as JSON to this file when the cache closes
 //
-// Inputs       : did - device number of block to insert
-//                sec - sector number of block to insert
-//                blk - block number of block to insert
-// Outputs      : 0 if succesfully inserted, -1 if failure
+// Inputs       : path - the file to write, NULL to disable the dump
+// Outputs      : 0 if successful, -1 if failure (or the file can't be created)
 
-int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block ) {
+int lcloud_setcachestatsfile( const char *path ) {
 
-    // Error Checks
-    for (int cache_block = 0; cache_block < LC_CACHE_MAXBLOCKS; cache_block++) {
+    if ((path != NULL) && (path_creatable(path) == 0)) {
+        return(-1);
+    }
 
-        int exists = 1;
-        for (int index = 0; index < 256; index++) {
+    free(stats_file);
+    stats_file = NULL;
+    if (path != NULL) {
 
-            if (cache[cache_block].data[index] != block[index]) {
-                exists = 0;
-            }
+        stats_file = strdup(path);
+        if (stats_file == NULL) {
+            return(-1);
         }
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacheio
+// Description  : Set the functions the cache uses to read and write device
+//                blocks (the filesystem's get_block and put_block)
+//
+// Inputs       : read_block - reads a device block into a buffer
+//                write_block - writes a buffer to a device block
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcacheio( LcCacheBlockIo read_block, LcCacheBlockIo write_block ) {
+
+    read_block_func = read_block;
+    write_block_func = write_block;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacherunio
+// Description  : Set the function the flusher uses to write a run of adjacent
+//                blocks of a sector in one transfer (the filesystem's
+//                put_blocks), without one it writes them one by one
+//
+// Inputs       : write_run - writes count buffered blocks from sec/blk on
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcacherunio( LcCacheRunIo write_run ) {
+
+    write_run_func = write_run;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachewriteback
+// Description  : Enable/disable write-back.  With write-back, blocks written
+//                with lcloud_writecache only reach the device when they are
+//                evicted (from the last tier) or flushed.
+//
+// Inputs       : enabled - 1 for write-back, 0 for write-through
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcachewriteback( int enabled ) {
+
+    if ((enabled != 0) && (enabled != 1)) {
+        return(-1);
+    }
+
+    if ((enabled == 0) && (write_back == 1) && (shards != NULL)) {  //nothing may stay dirty once writes go straight through
+        lcloud_flushcache();
+    }
+    write_back = enabled;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachel2
+// Description  : Back the cache with a set-associative second tier kept in a
+//                memory mapped file.  Blocks evicted from memory move to the
+//                file and misses check it before going to the device.  The
+//                file is recreated empty at init and removed at close.
+//
+// Inputs       : path - the file to use, NULL to disable the second tier
+//                maxblocks - the number of blocks in the second tier
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized,
+//                or the file can't be created)
+
+int lcloud_setcachel2( const char *path, int maxblocks ) {
+
+    if ((shards != NULL) || ((path != NULL) && ((maxblocks < LC_CACHE_L2_WAYS) || (path_creatable(path) == 0)))) {
+        return(-1);
+    }
 
-        if (exists == 1) {
+    free(l2_path);
+    l2_path = NULL;
+    l2_maxblocks = 0;
+    if (path != NULL) {
+
+        l2_path = strdup(path);
+        if (l2_path == NULL) {
             return(-1);
         }
+        l2_maxblocks = maxblocks;
     }
 
-    if (did == -1 || sec == -1 || blk == -1) {
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacheprefetch
+// Description  : Enable/disable the prefetcher.  It watches each device's miss
+//                stream for constant strides and repeating sequences, and
+//                reads the predicted blocks with the read function given to
+//                lcloud_setcacheio once the missed block has been filled.
+//
+// Inputs       : enabled - 1 to prefetch, 0 not to
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcacheprefetch( int enabled ) {
+
+    if ((enabled != 0) && (enabled != 1)) {
         return(-1);
     }
-    //////
 
-    for (int cache_block = 0; cache_block < LC_CACHE_MAXBLOCKS; cache_block++) {
+    prefetch_enabled = enabled;
 
-        if (cache[cache_block].device_id == did && cache[cache_block].sector == sec && cache[cache_block].block == blk) {  //if this location is already in the cache, select its cache line
-            break;
-        }
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachegeometry
+// Description  : Tell the prefetcher the shape of a device, so strides are
+//                measured in the order the filesystem lays blocks out and no
+//                block past the end of the device is predicted
+//
+// Inputs       : did - the device
+//                sectors - the number of sectors on the device
+//                blocks - the number of blocks per sector
+// Outputs      : 0 if successful, -1 if failure
 
-        if (cache[cache_block].timestamp == -1) {  //go through all of the cache blocks that haven't been used
+int lcloud_setcachegeometry( LcDeviceId did, int sectors, int blocks ) {
 
-            cache[cache_block].timestamp = 0;  //set the values
-            cache[cache_block].device_id = did;
-            cache[cache_block].sector = sec;
-            cache[cache_block].block = blk;
-            memcpy(cache[cache_block].data, block, 256);
+    if ((did >= LC_CACHE_MAXDEVICES) || (sectors < 0) || (blocks < 0)) {
+        return(-1);
+    }
 
-            /*for (int index = 0; index < 256; index++) {  //insert the data
-                cache[cache_block].data[index] = block[index];
-            }*/
+    geometry_sectors[did] = sectors;
+    geometry_blocks[did] = blocks;
 
-            adjust_timestamps(cache[cache_block].cache_line);
-            logMessage(LOG_INFO_LEVEL, "LionCloud Cache success inserting cache item [%d/%d/%d]", did, sec, blk);
-            return(0);
-        }
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachehugepages
+// Description  : Enable/disable backing the block data with huge pages.  It
+//                only applies to caches of at least one huge page, and falls
+//                back to transparent huge pages when none are reserved.
+//
+// Inputs       : enabled - 1 to use huge pages, 0 not to
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_setcachehugepages( int enabled ) {
+
+    if ((enabled != 0) && (enabled != 1)) {
+        return(-1);
     }
 
-    int least_recent = 0;  //if the code reaches this point, all cache blocks have been used
-    int least_recent_line = 0;
-    for (int cache_block = 0; cache_block < LC_CACHE_MAXBLOCKS; cache_block++) {
+    huge_pages = enabled;
 
-        if (cache[cache_block].device_id == did && cache[cache_block].sector == sec && cache[cache_block].block == blk) {  //if this location is already in the cache, select its cache line
+    /* Return successfully */
+    return( 0 );
+}
 
-            least_recent = cache[cache_block].timestamp;
-            least_recent_line = cache[cache_block].cache_line;
-            break;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachesnapshot
+// Description  : Keep the cache warm across restarts.  At close the keys of
+//                the cached blocks are saved to a file in recency order, and
+//                at init a thread reads them back from the devices through
+//                the read function given to lcloud_setcacheio, dropping any
+//                block whose contents changed in between.
+//
+// Inputs       : path - the snapshot file, NULL to disable snapshots
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized,
+//                or the file can't be created)
+
+int lcloud_setcachesnapshot( const char *path ) {
+
+    if ((shards != NULL) || ((path != NULL) && (path_creatable(path) == 0))) {
+        return(-1);
+    }
+
+    free(snapshot_path);
+    snapshot_path = NULL;
+    if (path != NULL) {
+
+        snapshot_path = strdup(path);
+        if (snapshot_path == NULL) {
+            return(-1);
         }
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachepartition
+// Description  : Set the reservation and cap of a cache partition.  Eviction
+//                never takes a partition below its reservation, and a
+//                partition at its cap replaces its own blocks, so one big
+//                reader can't flush the blocks other files depend on.
+//
+// Inputs       : partition - the partition, 0 is where blocks go by default
+//                min_blocks - blocks reserved for the partition
+//                max_blocks - most blocks the partition may hold, 0 for no cap
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized)
 
-        if (cache[cache_block].timestamp > least_recent) {  //if the function inputs are not in the cache, select the least recently used cache line to be overwritten
+int lcloud_setcachepartition( int partition, int min_blocks, int max_blocks ) {
 
-            least_recent = cache[cache_block].timestamp;
-            least_recent_line = cache[cache_block].cache_line;
-        }   
+    if ((shards != NULL) || (partition < 0) || (partition >= LC_CACHE_MAXPARTITIONS) || (min_blocks < 0) || (max_blocks < 0) ||
+        ((max_blocks > 0) && (min_blocks > max_blocks))) {
+        return(-1);
     }
 
-    if (cache[least_recent_line].device_id == did && cache[least_recent_line].sector == sec && cache[least_recent_line].block == blk) {
-        logMessage(LOG_INFO_LEVEL, "Updating cache item [%d/%d/%d]", cache[least_recent_line].device_id, cache[least_recent_line].sector, cache[least_recent_line].block);
+    partition_min[partition] = min_blocks;
+    partition_max[partition] = max_blocks;
+    partitions_enabled = 0;
+    for (int part = 0; part < LC_CACHE_MAXPARTITIONS; part++) {
+        if (partition_min[part] + partition_max[part] > 0) {
+            partitions_enabled = 1;
+        }
     }
-    else {
-        logMessage(LOG_INFO_LEVEL, "Ejecting cache item [%d/%d/%d]", cache[least_recent_line].device_id, cache[least_recent_line].sector, cache[least_recent_line].block);
-    }
-    cache[least_recent_line].timestamp = 0;  //set the new values for this line of the cache
-    cache[least_recent_line].device_id = did;
-    cache[least_recent_line].sector = sec;
-    cache[least_recent_line].block = blk;
-    memcpy(cache[least_recent_line].data, block, 256);
-
-    /*for (int index = 0; index < 256; index++) {  //insert the data
-        cache[least_recent_line].data[index] = block[index];
-    }*/
-    adjust_timestamps(least_recent_line);
-    logMessage(LOG_INFO_LEVEL, "LionCloud Cache success inserting cache item [%d/%d/%d]", did, sec, blk);
+
     /* Return successfully */
     return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_initcache
-// Description  : Initialze the cache by setting up metadata a cache elements.
+// Function     : lcloud_setcachedevicepartition
+// Description  : Charge a device's blocks to a partition, unless the thread
+//                accessing them selected one with lcloud_usecachepartition
 //
-// Inputs       : maxblocks - the max number number of blocks 
+// Inputs       : did - the device
+//                partition - the partition
 // Outputs      : 0 if successful, -1 if failure
 
-int lcloud_initcache( int maxblocks ) {
+int lcloud_setcachedevicepartition( LcDeviceId did, int partition ) {
 
-    if (maxblocks != LC_CACHE_MAXBLOCKS) {
+    if ((did >= LC_CACHE_MAXDEVICES) || (partition < 0) || (partition >= LC_CACHE_MAXPARTITIONS)) {
         return(-1);
     }
 
-    cache = (int*)malloc(maxblocks*sizeof(Cache));
+    device_partition[did] = partition;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_usecachepartition
+// Description  : Select the partition this thread's cache accesses are
+//                charged to, e.g. the one of the file being read or written
+//
+// Inputs       : partition - the partition, -1 to go by device
+// Outputs      : the partition selected before, so it can be restored
+
+int lcloud_usecachepartition( int partition ) {
 
-    for (int cache_block = 0; cache_block < maxblocks; cache_block++) {
+    int previous = cache_partition;
+    if ((partition >= -1) && (partition < LC_CACHE_MAXPARTITIONS)) {
+        cache_partition = partition;
+    }
+    return( previous );
+}
 
-        cache[cache_block].cache_line = cache_block;
-        cache[cache_block].device_id = -1;
-        cache[cache_block].sector = -1;
-        cache[cache_block].block = -1;
-        cache[cache_block].timestamp = -1;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcachemetadata
+// Description  : Set the size of the metadata area, the most blocks that may
+//                be pinned at once
+//
+// Inputs       : maxblocks - the limit, 0 to disallow pinning
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized)
 
-        for (int byte = 0; byte < 256; byte++) {
+int lcloud_setcachemetadata( int maxblocks ) {
 
-            cache[cache_block].data[byte] = 0;
-        }
+    if ((shards != NULL) || (maxblocks < 0)) {
+        return(-1);
     }
 
-    logMessage(LOG_INFO_LEVEL, "init_cmpsc311_cache: initialization complete [%d/%d]", maxblocks, maxblocks*256);
+    metadata_limit = maxblocks;
+
     /* Return successfully */
     return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcloud_closecache
-// Description  : Clean up the cache when program is closing
+// Function     : lcloud_setcacheflusher
+// Description  : Enable the write-behind flusher of a write-back cache.  A
+//                thread writes dirty lines back once they pass the age limit,
+//                and keeps writing back the oldest while the dirty ratio is
+//                above the background threshold.  Writers only wait when the
+//                ratio passes the hard limit.
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : background - % of lines dirty that starts write-behind
+//                hard - % of lines dirty at which writers are throttled
+//                age - ms a line may stay dirty, 0 for no age limit
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized)
 
-int lcloud_closecache( void ) {
+int lcloud_setcacheflusher( int background, int hard, int age ) {
 
-    float total_accesses = hits + misses;
-    float hit_rate = (hits / total_accesses) * 100;
+    if ((shards != NULL) || (background < 0) || (hard <= background) || (hard > 100) || (age < 0)) {
+        return(-1);
+    }
+
+    flusher_enabled = 1;
+    dirty_background = background;
+    dirty_hard = hard;
+    dirty_age = (age > 0) ? age : INT32_MAX;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacheadvisor
+// Description  : Enable/disable the cache size advisor.  Each shard keeps a
+//                ghost list of the keys it evicted, and misses found there
+//                estimate the extra hits of a cache 10%, 50% and 100% larger.
+//                The estimates are logged every LC_CACHE_ADVISOR_INTERVAL
+//                lookups and at close.
+//
+// Inputs       : enabled - 1 to keep the ghost lists, 0 to not
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized)
+
+int lcloud_setcacheadvisor( int enabled ) {
+
+    if ((shards != NULL) || ((enabled != 0) && (enabled != 1))) {
+        return(-1);
+    }
+
+    advisor_enabled = enabled;
 
-    logMessage(LOG_INFO_LEVEL, "Closed cmpsc311 cache, deleting 64 items");
-    logMessage(LOG_INFO_LEVEL, "Cache hits [%d]", (int)hits);
-    logMessage(LOG_INFO_LEVEL, "Cache misses [%d]", (int)misses);
-    logMessage(LOG_INFO_LEVEL, "Cache efficiency [%.2f\%]", hit_rate);
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setcacheshared
+// Description  : Share the cache with the other processes on this host.  The
+//                blocks live in the POSIX shared memory segment of this name,
+//                set associative with robust process-shared locks, created by
+//                the first process and removed when the last one closes.  The
+//                cache is then always write-through, and the second tier,
+//                prefetcher, pinning and snapshots are not used.
+//
+// Inputs       : name - the segment (e.g. "/lcloud_cache"), NULL for a private cache
+// Outputs      : 0 if successful, -1 if failure (or cache already initialized)
+
+int lcloud_setcacheshared( const char *name ) {
 
-    free(cache);
+    if ((shards != NULL) || ((name != NULL) && (name[0] != '/'))) {
+        return(-1);
+    }
+
+    free(shared_name);
+    shared_name = NULL;
+    if (name != NULL) {
+
+        shared_name = strdup(name);
+        if (shared_name == NULL) {
+            return(-1);
+        }
+    }
 
     /* Return successfully */
     return( 0 );
-}
\ No newline at end of file
+}
@@ -17,6 +17,117 @@
 
 // Defines 
 #define LC_CACHE_MAXBLOCKS 64
+#define LC_CACHE_SHARDS 1            // Default number of independently locked cache shards
+#define LC_CACHE_MAXSHARDS 64        // Maximum number of cache shards
+#define LC_CACHE_SKETCH_DEPTH 4      // Rows (hash functions) in the frequency sketch
+#define LC_CACHE_SKETCH_WIDTH 1024   // 4-bit counters per row (power of two)
+#define LC_CACHE_SKETCH_MAXCOUNT 15  // Saturation value of a sketch counter
+#define LC_CACHE_SKETCH_SAMPLE 10    // Age the sketch every (SAMPLE * maxblocks) accesses
+#define LC_CACHE_MAXDEVICES 16       // Device ids tracked individually by the statistics
+#define LC_CACHE_REUSE_BUCKETS 32    // Power-of-two buckets in the reuse distance histogram
+#define LC_CACHE_REUSE_TRACKING 4    // Keys remembered for reuse distances, per cache line
+#define LC_CACHE_L2_MAXBLOCKS 4096   // Default size of the second-tier (mmap'd file) cache
+#define LC_CACHE_L2_WAYS 8           // Associativity of the second-tier cache
+#define LC_CACHE_L2_LOCKS 64         // Lock stripes over the second-tier cache sets
+#define LC_CACHE_PREFETCH_MAXDEGREE 8  // Most blocks prefetched after one miss
+#define LC_CACHE_PREFETCH_TABLE 64     // Entries in each device's miss correlation table
+#define LC_CACHE_PREFETCH_WINDOW 32    // Prefetches judged between accuracy checks
+#define LC_CACHE_PREFETCH_LOW 40       // Accuracy (%) below which the degree is halved
+#define LC_CACHE_PREFETCH_HIGH 75      // Accuracy (%) above which the degree is doubled
+#define LC_CACHE_PREFETCH_BACKOFF 256  // Misses to sit out once the degree drops to zero
+#define LC_CACHE_HUGEPAGE_SIZE (2 * 1024 * 1024)  // Smallest block data arena put in huge pages
+#define LC_CACHE_SNAPSHOT_MAGIC 0x4e53434c   // "LCSN", marks a warm-cache snapshot file
+#define LC_CACHE_SNAPSHOT_VERSION 1          // Snapshot layout, older layouts are ignored
+#define LC_CACHE_MAXPARTITIONS 8             // Cache partitions, 0 is the default partition
+#define LC_CACHE_METADATA_BLOCKS 16          // Default size of the pinned metadata area
+#define LC_CACHE_DIRTY_BACKGROUND 10         // Default % of lines dirty that starts write-behind
+#define LC_CACHE_DIRTY_HARD 40               // Default % of lines dirty that throttles writers
+#define LC_CACHE_DIRTY_AGE 1000              // Default ms a line may stay dirty
+#define LC_CACHE_FLUSH_INTERVAL 100          // ms between flusher rounds when it has caught up
+#define LC_CACHE_FLUSH_BATCH 32              // Most blocks a flusher pass takes from one shard
+#define LC_CACHE_ROOM_TRIES 4                // Victims written back unlocked before an eviction writes under the lock
+#define LC_CACHE_LINE_L2 -2                  // lookup_line found the block in the second tier, but had no line for it
+#define LC_CACHE_ADVISOR_SIZES 3             // Larger caches the size advisor estimates: +10%, +50%, 2x
+#define LC_CACHE_ADVISOR_INTERVAL 100000     // Lookups between size advisor log reports
+#define LC_CACHE_SHARED_MAGIC 0x4853434c     // "LCSH", marks a shared cache segment
+#define LC_CACHE_SHARED_VERSION 1            // Shared segment layout, processes must agree on it
+#define LC_CACHE_SHARED_WAYS 8               // Associativity of the shared cache
+#define LC_CACHE_SHARED_LOCKS 64             // Lock stripes over the shared cache sets
+#define LC_CACHE_SHARED_MAXPROCS 64          // Most processes attached to a shared cache
+#define LC_CACHE_SHARED_RETRIES 8            // Attempts to attach a segment that keeps going away
+#define LC_CACHE_SHARED_WAIT 1000            // ms to wait for another process to set a segment up
+
+// Type definitions
+
+/* Cache events counted by the statistics */
+typedef enum {
+    LC_CACHE_HIT      = 0,  // Lookup found the block
+    LC_CACHE_MISS     = 1,  // Lookup did not find the block
+    LC_CACHE_INSERT   = 2,  // New block placed in the cache
+    LC_CACHE_UPDATE   = 3,  // Cached block overwritten in place
+    LC_CACHE_EVICT    = 4,  // Block removed from the cache
+    LC_CACHE_MAXEVENT = 5   // Maximum event number
+} LcCacheEvent;
+
+/* The filesystem paths that use the cache */
+typedef enum {
+    LC_CACHE_CALLER_OTHER = 0,  // Not inside a filesystem call
+    LC_CACHE_CALLER_READ  = 1,  // lcread
+    LC_CACHE_CALLER_WRITE = 2,  // lcwrite (including its read-modify-write)
+    LC_CACHE_MAXCALLER    = 3   // Maximum caller number
+} LcCacheCaller;
+
+/* Reasons a block leaves the cache */
+typedef enum {
+    LC_CACHE_EVICT_CAPACITY = 0,  // Replaced by a newer block
+    LC_CACHE_EVICT_CLOSE    = 1,  // Discarded when the cache was closed
+    LC_CACHE_MAXEVICT       = 2   // Maximum reason number
+} LcCacheEvictReason;
+
+/* Cache statistics, by device (of the block), by caller and by partition */
+typedef struct {
+    uint64_t total[LC_CACHE_MAXEVENT];
+    uint64_t device[LC_CACHE_MAXDEVICES][LC_CACHE_MAXEVENT];
+    uint64_t caller[LC_CACHE_MAXCALLER][LC_CACHE_MAXEVENT];
+    uint64_t partition[LC_CACHE_MAXPARTITIONS][LC_CACHE_MAXEVENT];
+    uint64_t partition_used[LC_CACHE_MAXPARTITIONS];  // Lines held by each partition
+    uint64_t evict_reason[LC_CACHE_MAXEVICT];
+    uint64_t admitted;        // Admission filter decisions
+    uint64_t rejected;
+    uint64_t reuse[LC_CACHE_REUSE_BUCKETS];  // [0] first/forgotten access, [i] distance in [2^(i-1), 2^i)
+    uint64_t writebacks;      // Dirty blocks written to the devices
+    uint64_t l2_hits;         // Second-tier lookups (L1 misses only)
+    uint64_t l2_misses;
+    uint64_t l2_stores;       // Blocks demoted from L1 into L2
+    uint64_t l2_evictions;    // Blocks pushed out of L2
+    uint64_t prefetch_issued; // Speculative blocks fetched and cached
+    uint64_t prefetch_useful; // ... later hit
+    uint64_t prefetch_useless;// ... evicted without being used
+    uint64_t warm_loaded;     // Snapshot blocks cached at startup
+    uint64_t warm_stale;      // Snapshot blocks dropped because the device changed
+    uint64_t pinned_lines;    // Lines in the metadata area
+    uint64_t pin_rejected;    // Pins refused because the area was full
+    uint64_t flusher_rounds;  // Write-behind passes over the shards
+    uint64_t flusher_blocks;  // ... blocks they wrote back
+    uint64_t flusher_batches; // ... runs of adjacent blocks those made up
+    uint64_t flusher_busy_ms; // ... time spent in them
+    uint64_t dirty_lines;     // Write-back backlog
+    uint64_t peak_dirty_lines;
+    uint64_t throttled;       // Writes held back at the hard dirty limit
+    uint64_t throttled_ms;    // ... and the time they waited
+    uint64_t advisor_lookups; // Lookups seen by the size advisor
+    uint64_t ghost_hits[LC_CACHE_ADVISOR_SIZES];  // ... misses a larger cache would have hit
+    uint64_t shared_recovered;// Shared cache locks recovered from dead processes
+    uint64_t used_lines;      // Occupancy
+    uint64_t peak_lines;
+    uint64_t num_lines;
+} LcCacheStats;
+
+/* Device block I/O used by the cache, same shape as the filesystem's get_block/put_block */
+typedef int (*LcCacheBlockIo)( char *buffer, int device_id, int sector, int block );
+
+/* Multi-block device writes used by the flusher, same shape as the filesystem's put_blocks */
+typedef int (*LcCacheRunIo)( char *buffer, int device_id, int sector, int block, int count );
 
 //
 // Functional Prototypes
@@ -24,13 +135,94 @@
 char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk );
     // Search the cache for a block 
 
+int lcloud_copycache( LcDeviceId did, uint16_t sec, uint16_t blk, char *buf );
+    // Search the cache for a block, copying it out (thread safe)
+
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
     // Put a value in the cache 
 
+int lcloud_writecache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Write a block through the cache (to the device now, or later if write-back)
+
+int lcloud_pincache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Pin a block in the metadata area, reading it in if needed
+
+int lcloud_unpincache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Drop a pin, the block becomes evictable with its last pin
+
+int lcloud_flushcache( void );
+    // Write every dirty block back to the devices
+
 int lcloud_initcache( int maxblocks );
     // Initialze the cache by setting up metadata a cache elements.
 
 int lcloud_closecache( void );
     // Clean up the cache when program is closing.
 
+int lcloud_setcacheadmission( int enabled );
+    // Enable/disable the TinyLFU admission filter (call before init)
+
+int lcloud_setcacheshards( int count );
+    // Set the number of lock-striped cache shards (call before init)
+
+int lcloud_setcacheio( LcCacheBlockIo read_block, LcCacheBlockIo write_block );
+    // Set the functions the cache uses to read and write device blocks
+
+int lcloud_setcacherunio( LcCacheRunIo write_run );
+    // Set the function the flusher uses to write runs of adjacent blocks
+
+int lcloud_setcachewriteback( int enabled );
+    // Enable/disable write-back, deferring writes until eviction or flush
+
+int lcloud_setcachel2( const char *path, int maxblocks );
+    // Back the cache with a second tier in a memory mapped file (call before init)
+
+int lcloud_setcacheprefetch( int enabled );
+    // Enable/disable the stride and correlation prefetcher
+
+int lcloud_setcachegeometry( LcDeviceId did, int sectors, int blocks );
+    // Tell the prefetcher the shape of a device
+
+int lcloud_setcachehugepages( int enabled );
+    // Enable/disable huge pages for the block data (call before init)
+
+int lcloud_setcachesnapshot( const char *path );
+    // Save the cache to this file at close and warm it from there at init (call before init)
+
+int lcloud_setcacheflusher( int background, int hard, int age );
+    // Write dirty lines back in the background past these thresholds (call before init)
+
+int lcloud_setcacheshared( const char *name );
+    // Keep the cache in this POSIX shared memory segment, shared by every process using it (call before init)
+
+int lcloud_setcacheadvisor( int enabled );
+    // Enable/disable the ghost-list cache size advisor (call before init)
+
+int lcloud_setcachemetadata( int maxblocks );
+    // Set the most blocks that may be pinned at once (call before init)
+
+int lcloud_setcachepartition( int partition, int min_blocks, int max_blocks );
+    // Set the blocks reserved for and the cap on a cache partition (call before init)
+
+int lcloud_setcachedevicepartition( LcDeviceId did, int partition );
+    // Charge a device's blocks to a partition
+
+int lcloud_usecachepartition( int partition );
+    // Select the partition this thread's cache accesses are charged to, returning the old one
+
+LcCacheCaller lcloud_setcachecaller( LcCacheCaller caller );
+    // Set the caller that this thread's cache accesses are charged to
+
+LcCacheCaller lcloud_getcachecaller( void );
+    // Get the caller that this thread's cache accesses are charged to
+
+int lcloud_getcachestats( LcCacheStats *stats );
+    // Get a snapshot of the cache statistics
+
+int lcloud_dumpcachestats( const char *path );
+    // Write the cache statistics to a file as JSON
+
+int lcloud_setcachestatsfile( const char *path );
+    // Dump the statistics as JSON to this file when the cache closes
+
 #endif
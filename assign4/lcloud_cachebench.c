@@ -0,0 +1,290 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_cachebench.c
+//  Description    : This is a stand-alone benchmark of the LionCloud block
+//                   cache.  It hammers the cache from a growing number of
+//                   threads and reports the aggregate operation rate, so
+//                   the effect of lock striping can be measured.  It then
+//                   times single lookups and evictions in ever larger caches,
+//                   where the memory layout of the cache dominates.
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Project Includes
+#include <lcloud_cache.h>
+
+// Defines
+#define LCLOUD_CACHEBENCH_ARGUMENTS "hHb:s:t:o:c:"
+#define LCLOUD_CACHEBENCH_MAXTHREADS 256
+#define USAGE                                                                    \
+    "USAGE: lcloud_cachebench [-h] [-H] [-b <blocks>] [-s <shards>] [-t <threads>] [-o <ops>] [-c <capacity>]\n" \
+    "\n"                                                                         \
+    "where:\n"                                                                   \
+    "    -h - help mode (display this message)\n"                                \
+    "    -H - back the cache data with huge pages\n"                            \
+    "    -b - cache size in blocks (default 4096)\n"                             \
+    "    -s - number of cache shards to compare against one (default 16)\n"     \
+    "    -t - maximum number of threads, doubled from 1 (default 32)\n"          \
+    "    -o - cache operations per thread (default 1000000)\n"                   \
+    "    -c - largest cache, in blocks, to time lookups and evictions in (default 262144)\n" \
+    "\n"
+
+// Type definitions
+typedef struct {
+    int seed;         // The seed for this thread's key stream
+    int ops;          // The number of operations to perform
+    int key_space;    // The number of distinct blocks to touch
+} BenchThread;
+
+//
+// Functional Prototypes
+
+double runCacheBench( int blocks, int shards, int threads, int ops ); // Run one benchmark configuration
+int runCapacityBench( int blocks, int ops, double *lookup_ns, double *evict_ns, double *scan_ns ); // Time lookups, evictions and scans in one cache size
+void * cacheBenchThread( void *arg ); // Benchmark worker thread
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the cache benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+
+    // Local variables
+    int ch, blocks = 4096, shards = 16, max_threads = 32, ops = 1000000, capacity = 262144;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_CACHEBENCH_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'b': // Cache size
+            blocks = atoi(optarg);
+            break;
+
+        case 's': // Shard count
+            shards = atoi(optarg);
+            break;
+
+        case 't': // Maximum thread count
+            max_threads = atoi(optarg);
+            break;
+
+        case 'o': // Operations per thread
+            ops = atoi(optarg);
+            break;
+
+        case 'c': // Largest capacity
+            capacity = atoi(optarg);
+            break;
+
+        case 'H': // Huge page backed data
+            lcloud_setcachehugepages(1);
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    if ((blocks <= 0) || (ops <= 0) || (max_threads < 1) || (max_threads > LCLOUD_CACHEBENCH_MAXTHREADS) ||
+        (shards < 1) || (shards > LC_CACHE_MAXSHARDS) || (capacity < 0)) {
+        fprintf(stderr, "Bad benchmark parameters, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+    initializeLogWithFilehandle(CMPSC311_LOG_STDOUT);
+
+    // Run each thread count against a single lock and the sharded cache
+    logMessage(LOG_OUTPUT_LEVEL, "Cache benchmark: %d blocks, %d ops/thread, 1 vs %d shards", blocks, ops, shards);
+    logMessage(LOG_OUTPUT_LEVEL, "%8s %16s %16s %8s", "threads", "1 shard Mops/s", "sharded Mops/s", "speedup");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+
+        double single = runCacheBench(blocks, 1, threads, ops);
+        double sharded = runCacheBench(blocks, shards, threads, ops);
+        if ((single < 0) || (sharded < 0)) {
+            logMessage(LOG_ERROR_LEVEL, "Cache benchmark failed at %d threads, aborting", threads);
+            return (-1);
+        }
+        logMessage(LOG_OUTPUT_LEVEL, "%8d %16.2f %16.2f %7.2fx", threads, single, sharded, sharded / single);
+    }
+
+    // Time lookups and evictions from the benchmark size up to the largest capacity
+    logMessage(LOG_OUTPUT_LEVEL, "Cache capacity benchmark: %d ops per size, 1 shard", ops);
+    logMessage(LOG_OUTPUT_LEVEL, "%10s %16s %16s %16s", "blocks", "lookup ns/op", "evict ns/op", "scan ns/line");
+    for (int size = blocks; size <= capacity; size *= 2) {
+
+        double lookup_ns, evict_ns, scan_ns;
+        if (runCapacityBench(size, ops, &lookup_ns, &evict_ns, &scan_ns) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Cache capacity benchmark failed at %d blocks, aborting", size);
+            return (-1);
+        }
+        logMessage(LOG_OUTPUT_LEVEL, "%10d %16.1f %16.1f %16.2f", size, lookup_ns, evict_ns, scan_ns);
+    }
+
+    // Return successfully
+    freeLogRegistrations();
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : runCacheBench
+// Description  : Build a cache, run the worker threads against it and time them
+//
+// Inputs       : blocks - cache size in blocks
+//                shards - number of cache shards
+//                threads - number of worker threads
+//                ops - operations per thread
+// Outputs      : millions of cache operations per second, -1 if failure
+
+double runCacheBench( int blocks, int shards, int threads, int ops )
+{
+
+    pthread_t tids[LCLOUD_CACHEBENCH_MAXTHREADS];
+    BenchThread args[LCLOUD_CACHEBENCH_MAXTHREADS];
+    struct timeval start, end;
+
+    if ((lcloud_setcacheshards(shards) != 0) || (lcloud_initcache(blocks) != 0)) {
+        return (-1);
+    }
+
+    gettimeofday(&start, NULL);
+    for (int t = 0; t < threads; t++) {
+
+        args[t].seed = t + 1;
+        args[t].ops = ops;
+        args[t].key_space = blocks * 2;  // Roughly half of the lookups hit
+        if (pthread_create(&tids[t], NULL, cacheBenchThread, &args[t]) != 0) {
+            return (-1);
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    gettimeofday(&end, NULL);
+
+    lcloud_closecache();
+    return (((double)threads * ops) / (double)compareTimes(&start, &end));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : runCapacityBench
+// Description  : Fill a cache, then time random lookups that all hit,
+//                inserts of new blocks that each evict the oldest block, and
+//                flushes of the clean cache, which walk every line's metadata
+//
+// Inputs       : blocks - cache size in blocks
+//                ops - lookups and inserts to time
+//                lookup_ns - set to the mean time of a lookup
+//                evict_ns - set to the mean time of an evicting insert
+//                scan_ns - set to the mean time spent on each line by a flush
+// Outputs      : 0 if successful, -1 if failure
+
+int runCapacityBench( int blocks, int ops, double *lookup_ns, double *evict_ns, double *scan_ns )
+{
+
+    struct timeval start, end;
+    uint32_t state = 2654435761u;
+    char block[256];
+    uint32_t next = 0;
+
+    if ((lcloud_setcacheshards(1) != 0) || (lcloud_initcache(blocks) != 0)) {
+        return (-1);
+    }
+
+    memset(block, 0x5a, sizeof(block));
+    for (; next < (uint32_t)blocks; next++) {  // Fill every line, block keys are just a counter
+        lcloud_putcache(next >> 24, (next >> 12) & 0xfff, next & 0xfff, block);
+    }
+
+    gettimeofday(&start, NULL);
+    for (int op = 0; op < ops; op++) {
+
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        uint32_t key = state % blocks;
+        if (lcloud_copycache(key >> 24, (key >> 12) & 0xfff, key & 0xfff, block) == -1) {
+            return (-1);
+        }
+    }
+    gettimeofday(&end, NULL);
+    *lookup_ns = ((double)compareTimes(&start, &end) * 1000.0) / ops;
+
+    gettimeofday(&start, NULL);
+    for (int op = 0; op < ops; op++, next++) {
+        lcloud_putcache(next >> 24, (next >> 12) & 0xfff, next & 0xfff, block);
+    }
+    gettimeofday(&end, NULL);
+    *evict_ns = ((double)compareTimes(&start, &end) * 1000.0) / ops;
+
+    int scans = (ops / blocks > 0) ? ops / blocks : 1;
+    gettimeofday(&start, NULL);
+    for (int scan = 0; scan < scans; scan++) {
+        lcloud_flushcache();
+    }
+    gettimeofday(&end, NULL);
+    *scan_ns = ((double)compareTimes(&start, &end) * 1000.0) / ((double)scans * blocks);
+
+    lcloud_closecache();
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheBenchThread
+// Description  : Look up random blocks, inserting each one that misses
+//
+// Inputs       : arg - the BenchThread parameters for this thread
+// Outputs      : NULL
+
+void * cacheBenchThread( void *arg )
+{
+
+    BenchThread *bt = (BenchThread *)arg;
+    uint32_t state = (uint32_t)bt->seed * 2654435761u;
+    char block[256];
+
+    memset(block, bt->seed, sizeof(block));
+    for (int op = 0; op < bt->ops; op++) {
+
+        state ^= state << 13;  // xorshift32, cheap enough not to dominate the timing
+        state ^= state >> 17;
+        state ^= state << 5;
+        uint32_t key = state % bt->key_space;
+
+        LcDeviceId did = key & 0x0f;
+        uint16_t sec = (key >> 4) >> 8;
+        uint16_t blk = (key >> 4) & 0xff;
+        if (lcloud_copycache(did, sec, blk, block) == -1) {
+            lcloud_putcache(did, sec, blk, block);
+        }
+    }
+    return (NULL);
+}
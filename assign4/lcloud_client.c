@@ -12,12 +12,20 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <pthread.h>
 
 // Project Include Files
 #include <lcloud_network.h>
@@ -26,9 +34,68 @@
 #include <cmpsc311_util.h>
 #include <lcloud_controller.h>
 #include <lcloud_cache.h>
+#include <lcloud_ring.h>
+#include <lcloud_uring.h>
 
 
-socket_handle = -1;
+typedef struct {
+    int sock;              //-1 until the first request on it
+    LcRingChannel *channel;  //instead of the socket, for a shared memory ring server
+    LcUring *uring;        //batches go through it, with the io_uring engine
+    LCloudRegisterFrame stale;  //a hedged read this connection lost, its response still to come, 0 if none
+    int server;            //the server it goes to
+    pthread_mutex_t lock;  //one request, or batch, at a time
+} Connection;
+
+typedef struct {
+    Connection *conn;      //the connection carrying it, locked for the batch
+    int *requests;         //the indexes of the batch's requests it carries, in order
+    int share;             //the number of them
+    int sent, received;    //requests out, and responses matched to them
+    int pipelined;         //1 while it still waits on responses with the others, 0 once done (or run on its own)
+    size_t packed, written;  //with the io_uring engine, the send area's window and how much of it is out
+    size_t filled, matched;  //and the receive area's bytes, and how many are matched to responses
+    int writing, reading;    //and whether a write, and a read, are in flight
+} BatchShare;
+
+Connection connections[LCLOUD_SERVERS_MAX][LCLOUD_POOL_MAXSIZE];  //a device's requests always take the same connection to its server, in order
+Connection hedge_connections[LCLOUD_SERVERS_MAX][LCLOUD_POOL_MAXSIZE];  //the second connection a slow read on connections[s][i] is repeated on
+int pool_size = LCLOUD_POOL_SIZE;
+char *server_addresses[LCLOUD_SERVERS_MAX] = { NULL };  //"shm:/name", "unix:/path", "ip" or "ip:port", NULL for the default IP and port
+int server_count = 1;
+unsigned int device_server[LCLOUD_MAX_DEVICES];  //where each device the file system sees lives, its server and its id there
+unsigned int device_local[LCLOUD_MAX_DEVICES];
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+int pipeline_depth = LCLOUD_PIPELINE_DEPTH;  //requests a batch keeps outstanding, the server answers them in order
+int io_engine = LCLOUD_ENGINE_BLOCKING;
+int hedge_percentile = 0;  //reads slower than this percentile of recent reads are hedged, 0 for none
+int64_t hedge_samples[LCLOUD_HEDGE_SAMPLES];  //recent read latencies (ns), and the delay they give
+int64_t hedge_delay = -1;
+int hedge_count = 0, hedge_reads = 0, hedge_sent = 0, hedge_won = 0;
+pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Functional Prototypes
+
+void client_lcloud_pool_init( void ); // Connection pool
+Connection * client_lcloud_route( LCloudRegisterFrame reg );
+LCloudRegisterFrame client_lcloud_set_device( LCloudRegisterFrame reg, unsigned int did ); // Device sharding
+unsigned int client_lcloud_map_devices( unsigned int *masks );
+LCloudRegisterFrame client_lcloud_connection_request( Connection *conn, LCloudRegisterFrame reg, void *buf );
+int client_lcloud_connect( Connection *conn );
+int client_lcloud_disconnect( Connection *conn );
+size_t client_lcloud_payload_size( LCloudRegisterFrame reg ); // Request framing
+int client_lcloud_transfer_iov( Connection *conn, struct iovec *iov, int iovcnt, int sending );
+int client_lcloud_bus_send( Connection *conn, LCloudRegisterFrame *regs, void **bufs, int count );
+LCloudRegisterFrame client_lcloud_bus_receive( Connection *conn, LCloudRegisterFrame reg, void *buf );
+LCloudRegisterFrame client_lcloud_bus_exchange( Connection *conn, LCloudRegisterFrame reg, void *buf ); // Hedged reads
+int client_lcloud_drain( Connection *conn );
+void client_lcloud_hedge_record( int64_t latency, int hedged, int won );
+int client_lcloud_compare_latency( const void *a, const void *b );
+int client_lcloud_share_send( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs ); // Batches
+int client_lcloud_share_step( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *rframes, int wait );
+int client_lcloud_uring_queue( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs );
+int client_lcloud_uring_step( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *rframes, int wait );
 
 //
 // Functions
@@ -43,119 +110,1070 @@ socket_handle = -1;
 //                2) send any request to the server, returning results
 //                3) if CLOSE, will close the connection
 //
+//                Requests for a device go to the server it lives on, over
+//                its connection in that server's pool, with the device id
+//                the server knows it by.  The rest go to every server over
+//                its first connection, a probe putting the servers' devices
+//                together.  A power off waits for each connection to finish
+//                what it is doing and closes it, then goes to the servers.
+//
 // Inputs       : reg - the request reqisters for the command
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
 
 LCloudRegisterFrame client_lcloud_bus_request( LCloudRegisterFrame reg, void *buf ) {
 
-    if (socket_handle == -1) {  //if there is no valid connection, make one
-        
-        char *ip = LCLOUD_DEFAULT_IP;  //set the IP
-        unsigned short port = LCLOUD_DEFAULT_PORT;  //set the port
-        struct sockaddr_in address;  //declare 
+    unsigned int b0, b1, c0, c1, c2, d0, d1;  //extract the inputted register opcode to determine what operation must be done
+    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+
+    pthread_once(&pool_once, client_lcloud_pool_init);
+    if (c0 == LC_POWER_OFF) {  //drain and close the other connections
+
+        for (int s = 0; s < LCLOUD_SERVERS_MAX; s++) {
+            for (int i = 0; i < LCLOUD_POOL_MAXSIZE; i++) {
+
+                if (i > 0) {
+                    pthread_mutex_lock(&connections[s][i].lock);
+                    client_lcloud_disconnect(&connections[s][i]);
+                    pthread_mutex_unlock(&connections[s][i].lock);
+                }
+                pthread_mutex_lock(&hedge_connections[s][i].lock);
+                client_lcloud_disconnect(&hedge_connections[s][i]);
+                pthread_mutex_unlock(&hedge_connections[s][i].lock);
+            }
+        }
+        if (hedge_percentile > 0) {
+            logMessage(LOG_INFO_LEVEL, "LionCloud client hedged %d of %d reads (%.2f%%), %d answered first by the hedge", hedge_sent, hedge_reads,
+                (hedge_reads > 0) ? 100.0 * hedge_sent / hedge_reads : 0.0, hedge_won);
+        }
+    }
+
+    if ((c0 == LC_BLOCK_XFER) || (c0 == LC_BLOCK_XFER_MULTI) || (c0 == LC_DEVINIT)) {  //one device, on one server
+
+        unsigned int local = (c1 < LCLOUD_MAX_DEVICES) ? device_local[c1] : c1;
+        LCloudRegisterFrame rframe = client_lcloud_connection_request(client_lcloud_route(reg), client_lcloud_set_device(reg, local), buf);
+        return((rframe != (LCloudRegisterFrame)-1) ? client_lcloud_set_device(rframe, c1) : rframe);
+    }
+
+    LCloudRegisterFrame rframe = -1, first = -1;
+    unsigned int masks[LCLOUD_SERVERS_MAX];
+    for (int s = 0; s < server_count; s++) {  //every server, the first failure (if any) being the answer
+
+        rframe = client_lcloud_connection_request(&connections[s][0], reg, buf);
+        masks[s] = (rframe >> 16) & 0xffff;
+        if ((s == 0) || ((first != (LCloudRegisterFrame)-1) && ((rframe == (LCloudRegisterFrame)-1) || ((rframe >> 56) != 0x11)))) {
+            first = rframe;
+        }
+    }
+    if ((c0 == LC_DEVPROBE) && (first != (LCloudRegisterFrame)-1) && ((first >> 56) == 0x11)) {  //the union of the servers' devices
+        first = (first & ~(0xffffULL << 16)) | ((LCloudRegisterFrame)client_lcloud_map_devices(masks) << 16);
+    }
+
+    return(first);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_connection_request
+// Description  : sends one request over a connection, making the connection
+//                if there isn't one yet, and closing it after a power off
+//
+// Inputs       : conn - the connection
+//                reg - the request registers, with the server's device id
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response registers, -1 if failure
+LCloudRegisterFrame client_lcloud_connection_request( Connection *conn, LCloudRegisterFrame reg, void *buf ) {
+
+    LCloudRegisterFrame rframe = -1;
+    pthread_mutex_lock(&conn->lock);
+    client_lcloud_drain(conn);
+    if ((conn->sock != -1) || (conn->channel != NULL) || (client_lcloud_connect(conn) == 0)) {  //if there is no valid connection, make one
+
+        rframe = client_lcloud_bus_exchange(conn, reg, buf);  //give the opcode and receive the return opcode, with the data for a write or read
+        if (((reg >> 48) & 0xff) == LC_POWER_OFF) {  //close the connection and reset the socket handle
+            client_lcloud_disconnect(conn);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return(rframe);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_pool_init
+// Description  : sets up the connection pool, none of them connected yet
+//
+// Inputs       : none
+// Outputs      : none
+void client_lcloud_pool_init( void ) {
+
+    for (int s = 0; s < LCLOUD_SERVERS_MAX; s++) {
+        for (int i = 0; i < LCLOUD_POOL_MAXSIZE; i++) {
+
+            Connection *pair[2] = {&connections[s][i], &hedge_connections[s][i]};
+            for (int k = 0; k < 2; k++) {
+
+                pair[k]->sock = -1;
+                pair[k]->channel = NULL;
+                pair[k]->uring = NULL;
+                pair[k]->stale = 0;
+                pair[k]->server = s;
+                pthread_mutex_init(&pair[k]->lock, NULL);
+            }
+        }
+    }
+    for (int did = 0; did < LCLOUD_MAX_DEVICES; did++) {  //until a probe says otherwise, every device is on the first server
+
+        device_server[did] = 0;
+        device_local[did] = did;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_route
+// Description  : picks the connection a request goes over, by its device for
+//                transfers and device inits (on the device's server), the
+//                first server's first connection otherwise
+//
+// Inputs       : reg - the request registers
+// Outputs      : the connection
+Connection * client_lcloud_route( LCloudRegisterFrame reg ) {
+
+    unsigned int c0 = (reg >> 48) & 0xff, c1 = (reg >> 40) & 0xff;
+    if (((c0 == LC_BLOCK_XFER) || (c0 == LC_BLOCK_XFER_MULTI) || (c0 == LC_DEVINIT)) && (c1 < LCLOUD_MAX_DEVICES)) {
+        return(&connections[device_server[c1]][device_local[c1] % pool_size]);
+    }
+    if ((c0 == LC_BLOCK_XFER) || (c0 == LC_BLOCK_XFER_MULTI) || (c0 == LC_DEVINIT)) {
+        return(&connections[0][c1 % pool_size]);
+    }
+    return(&connections[0][0]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_set_device
+// Description  : puts a device id in the C1 register of a frame, to turn a
+//                request's device id into its server's and back
+//
+// Inputs       : reg - the registers
+//                did - the device id
+// Outputs      : the registers with the new device id
+LCloudRegisterFrame client_lcloud_set_device( LCloudRegisterFrame reg, unsigned int did ) {
+
+    return((reg & ~(0xffULL << 40)) | ((LCloudRegisterFrame)(did & 0xff) << 40));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_map_devices
+// Description  : puts the devices of every server together into the ones the
+//                file system sees.  A device keeps its own id if no earlier
+//                server has a device by that id, otherwise it takes the lowest
+//                id free, so a single server's devices are seen as they are.
+//                Devices past LCLOUD_MAX_DEVICES are left out.
+//
+// Inputs       : masks - each server's probed device mask
+// Outputs      : the mask of the devices seen
+unsigned int client_lcloud_map_devices( unsigned int *masks ) {
+
+    unsigned int seen = 0;
+    for (int s = 0; s < server_count; s++) {
+        for (unsigned int local = 0; local < LCLOUD_MAX_DEVICES; local++) {
+
+            if ((masks[s] & (1 << local)) == 0) {
+                continue;
+            }
+            unsigned int did = local;
+            if (seen & (1 << did)) {  //taken by an earlier server's device
+                for (did = 0; (did < LCLOUD_MAX_DEVICES) && (seen & (1 << did)); did++) {
+                }
+            }
+            if (did == LCLOUD_MAX_DEVICES) {
+                logMessage(LOG_ERROR_LEVEL, "LionCloud client has no device id left for device %u of server %d", local, s);
+                continue;
+            }
+            device_server[did] = s;
+            device_local[did] = local;
+            seen |= (1 << did);
+        }
+    }
+    logMessage(LOG_INFO_LEVEL, "LionCloud client sees devices 0x%04x over %d server(s)", seen, server_count);
+
+    return(seen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_connect
+// Description  : opens a pool connection to its server, over TCP or, for a
+//                "unix:/path" server address, a unix domain socket, or for a
+//                "shm:/name" address a channel of the server's shared memory
+//                rings, called with the connection locked
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_connect( Connection *conn ) {
+
+    char *server_address = server_addresses[conn->server];
+    char ip[64] = LCLOUD_DEFAULT_IP;  //set the IP
+    unsigned short port = LCLOUD_DEFAULT_PORT;  //set the port
+    struct sockaddr_in address;  //declare 
+    struct sockaddr_un local;
+    int connected;
+
+    if ((server_address != NULL) && (strncmp(server_address, LCLOUD_RING_PREFIX, strlen(LCLOUD_RING_PREFIX)) == 0)) {  //a server on this machine, no kernel in the way
+
+        conn->channel = lcloud_ring_claim(server_address + strlen(LCLOUD_RING_PREFIX));
+        return((conn->channel != NULL) ? 0 : -1);
+    }
+    if ((server_address != NULL) && (strncmp(server_address, LCLOUD_UNIX_PREFIX, strlen(LCLOUD_UNIX_PREFIX)) == 0)) {  //a server on this machine, no TCP stack in the way
+
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strncpy(local.sun_path, server_address + strlen(LCLOUD_UNIX_PREFIX), sizeof(local.sun_path) - 1);
+
+        conn->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (conn->sock == -1) {
+            logMessage(LOG_ERROR_LEVEL, "LionCloud client failed creating a socket : %s", strerror(errno));
+            return(-1);
+        }
+        connected = connect(conn->sock, (struct sockaddr *)&local, sizeof(local));
+    }
+    else {
+
+        if (server_address != NULL) {  //"ip" or "ip:port"
+
+            char *colon = strchr(server_address, ':');
+            size_t length = (colon != NULL) ? (size_t)(colon - server_address) : strlen(server_address);
+            if (length >= sizeof(ip)) {
+                return(-1);
+            }
+            memcpy(ip, server_address, length);
+            ip[length] = '\0';
+            if (colon != NULL) {
 
+                char *end;
+                errno = 0;
+                long number = strtol(colon + 1, &end, 10);
+                if ((errno != 0) || (end == colon + 1) || (*end != '\0') || (number < 1) || (number > 65535)) {
+                    logMessage(LOG_ERROR_LEVEL, "LionCloud client bad server port [%s]", colon + 1);
+                    return(-1);
+                }
+                port = (unsigned short)number;
+            }
+        }
+
+        memset(&address, 0, sizeof(address));
         address.sin_family = AF_INET;  //establish the fact that the address is IPv4
         address.sin_port = htons(port);  //convert port to something readable for the server
+        if (inet_aton(ip, &address.sin_addr) == 0) {  //and the server's IP address
+            return(-1);
+        }
+
+        conn->sock = socket(AF_INET, SOCK_STREAM, 0);  //create a socket for an IPv4 address using TCP
+        if (conn->sock == -1) {
+            logMessage(LOG_ERROR_LEVEL, "LionCloud client failed creating a socket : %s", strerror(errno));
+            return(-1);
+        }
+        connected = connect(conn->sock, (struct sockaddr *)&address, sizeof(address));  //connect the client to the server
+
+        int nodelay = 1;  //send each request as soon as it is written instead of waiting on the last one's ack
+        setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    if (connected == -1) {
+        close(conn->sock);
+        conn->sock = -1;
+        return(-1);
+    }
+    if (io_engine == LCLOUD_ENGINE_URING) {  //without one, batches fall back to writev/readv
+        conn->uring = lcloud_uring_init();
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_disconnect
+// Description  : closes a pool connection, if it is open, called with the
+//                connection locked
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_disconnect( Connection *conn ) {
+
+    if (conn->sock != -1) {
+        close(conn->sock);
+        conn->sock = -1;
+    }
+    if (conn->channel != NULL) {
+        lcloud_ring_release(conn->channel);
+        conn->channel = NULL;
+    }
+    if (conn->uring != NULL) {
+        lcloud_uring_exit(conn->uring);
+        conn->uring = NULL;
+    }
+    conn->stale = 0;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_payload_size
+// Description  : gives the number of data bytes that go with a request, the
+//                block for a transfer and the run of blocks for a multi-block
+//                transfer
+//
+// Inputs       : reg - the request registers
+// Outputs      : the payload size, 0 if the request has none
+size_t client_lcloud_payload_size( LCloudRegisterFrame reg ) {
+
+    unsigned int c0 = (reg >> 48) & 0xff, c2 = (reg >> 32) & 0xff;
+    if (c0 == LC_BLOCK_XFER) {
+        return(256);
+    }
+    if (c0 == LC_BLOCK_XFER_MULTI) {
+        return(((c2 >> LC_XFER_COUNT_SHIFT) + 1) * 256);  //the block count rides above the direction bit
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_transfer_iov
+// Description  : moves every byte described by an I/O vector over the
+//                socket, with as few writev/readv calls as the kernel allows.
+//                Short transfers pick up where they stopped, and calls
+//                interrupted by a signal are retried.  Over a shared memory
+//                channel each entry is copied through the ring instead.
+//
+// Inputs       : conn - the connection
+//                iov - the vector, advanced in place as bytes move
+//                iovcnt - the number of entries
+//                sending - 1 to writev, 0 to readv
+// Outputs      : 0 if success, -1 if failure (including the server closing)
+int client_lcloud_transfer_iov( Connection *conn, struct iovec *iov, int iovcnt, int sending ) {
+
+    if (conn->channel != NULL) {
+
+        for (int i = 0; i < iovcnt; i++) {
+
+            int result = (sending == 1) ? lcloud_ring_write(&conn->channel->requests, iov[i].iov_base, iov[i].iov_len)
+                : lcloud_ring_read(&conn->channel->responses, iov[i].iov_base, iov[i].iov_len);
+            if (result == -1) {
+                return(-1);
+            }
+        }
+        return(0);
+    }
 
-        socket_handle = socket(AF_INET, SOCK_STREAM, 0);  //create a socket for an IPv4 address using TCP
+    while (iovcnt > 0) {
 
-        int connected = connect(socket_handle, (struct sockaddr *)&address, sizeof(address));  //connect the client to the server
-        if (connected == -1) {
+        ssize_t moved = (sending == 1) ? writev(conn->sock, iov, iovcnt) : readv(conn->sock, iov, iovcnt);
+        if ((moved == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (moved <= 0) {
             return(-1);
         }
+
+        while ((iovcnt > 0) && ((size_t)moved >= iov->iov_len)) {  //skip the entries done, then trim the one part done
+            moved -= iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + moved;
+            iov->iov_len -= moved;
+        }
     }
 
-    unsigned int b0, b1, c0, c1, c2, d0, d1;  //extract the inputted register opcode to determine what operation must be done
-    extract_lcloud_registers(reg, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_send
+// Description  : sends requests, each header followed by the data for a
+//                write, in one gathered write and without waiting for the
+//                responses
+//
+// Inputs       : conn - the connection
+//                regs - the request registers
+//                bufs - the block(s) to be written, or read into, per request
+//                count - the number of requests, 1 to LCLOUD_PIPELINE_MAXDEPTH
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_bus_send( Connection *conn, LCloudRegisterFrame *regs, void **bufs, int count ) {
+
+    uint64_t network_ops[LCLOUD_PIPELINE_MAXDEPTH];
+    struct iovec iov[LCLOUD_PIPELINE_MAXDEPTH * 2];
+    int iovcnt = 0;
+
+    for (int i = 0; i < count; i++) {
+
+        network_ops[i] = htonll64(regs[i]);  //convert the opcode to something readable for the server
+        iov[iovcnt].iov_base = &network_ops[i];
+        iov[iovcnt].iov_len = LCLOUD_NET_HEADER_SIZE;
+        iovcnt += 1;
+
+        size_t size = client_lcloud_payload_size(regs[i]);
+        if ((size > 0) && ((((regs[i] >> 32) & 0xff) & 1) == LC_XFER_WRITE)) {  //the data to be written goes straight from the caller's buffer
+
+            iov[iovcnt].iov_base = bufs[i];
+            iov[iovcnt].iov_len = size;
+            iovcnt += 1;
+        }
+    }
+
+    return(client_lcloud_transfer_iov(conn, iov, iovcnt, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_receive
+// Description  : receives the response to a request sent earlier, with the
+//                data for a read going straight into the caller's buffer.  A
+//                single block read is always followed by its block, so both
+//                come in one scattered read.  A multi-block read is only
+//                followed by its data if it worked, so its header comes
+//                first.
+//
+// Inputs       : conn - the connection
+//                reg - the request registers
+//                buf - the block(s) to be read into
+// Outputs      : the response registers, -1 if failure
+LCloudRegisterFrame client_lcloud_bus_receive( Connection *conn, LCloudRegisterFrame reg, void *buf ) {
 
-    char local_buffer[256] = {0};
+    unsigned int c0 = (reg >> 48) & 0xff, c2 = (reg >> 32) & 0xff;
+    size_t size = ((c2 & 1) == LC_XFER_READ) ? client_lcloud_payload_size(reg) : 0;
     LCloudRegisterFrame rframe;
-    if (c0 == LC_BLOCK_XFER) {  //if the operation is a block transfer
+    struct iovec iov[2] = {{&rframe, LCLOUD_NET_HEADER_SIZE}, {buf, size}};
 
-        if (c2 == LC_XFER_WRITE) {  //if the type of block transfer is a write
+    if (client_lcloud_transfer_iov(conn, iov, ((c0 == LC_BLOCK_XFER) && (size > 0)) ? 2 : 1, 0) == -1) {  //receive return opcode
+        return(-1);
+    }
+    rframe = ntohll64(rframe);
 
-            memcpy(local_buffer, buf, 256);
-            uint64_t network_op = htonll64(reg);  //convert the opcode to something readable for the server
+    unsigned int r_b0 = rframe >> 60, r_b1 = (rframe >> 56) & 0xf;
+    if ((c0 == LC_BLOCK_XFER_MULTI) && (size > 0) && (r_b0 == 1) && (r_b1 == 1) && (client_lcloud_transfer_iov(conn, &iov[1], 1, 0) == -1)) {
+        return(-1);
+    }
 
-            int op_success = write(socket_handle, &network_op, LCLOUD_NET_HEADER_SIZE);  //give the network the opcode
-            if (op_success == -1) {
-                return(-1);
+    return(rframe);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_batch
+// Description  : carries out a batch of block transfers (single or multi-block)
+//                on the open connections.  Each connection of each server's
+//                pool carries its devices' share of the batch, and every
+//                share's first window of requests is sent before any response
+//                is waited on, so the connections (and servers) work on the
+//                batch together.  The responses are then taken from whichever
+//                connection has them ready, and each window is topped up half
+//                a window at a time, so the requests share their sends.  A
+//                server answers in the order it was asked, so each share's
+//                responses are matched to its requests first in, first out.
+//                A shared memory channel has nothing to wait on, and a hedged
+//                read goes alone, so those shares run one after the other.  A
+//                batch should go one way, all reads or all writes, so that
+//                neither end is stuck sending a large payload while the
+//                other is too.
+//
+// Inputs       : regs - the request registers
+//                bufs - the block(s) to be written, or read into, per request
+//                rframes - filled in with the response registers
+//                count - the number of requests, up to LCLOUD_BATCH_MAXSIZE
+// Outputs      : 0 if success (the responses say which transfers worked), -1 if failure
+int client_lcloud_bus_batch( LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *rframes, int count ) {
+
+    BatchShare shares[LCLOUD_SERVERS_MAX * LCLOUD_POOL_MAXSIZE];
+    int requests[LCLOUD_BATCH_MAXSIZE];  //the batch's indexes, grouped by connection
+    LCloudRegisterFrame local_regs[LCLOUD_BATCH_MAXSIZE];  //with the device ids the servers know
+    int used = 0, grouped = 0;
+
+    if (count > LCLOUD_BATCH_MAXSIZE) {
+        return(-1);
+    }
+    pthread_once(&pool_once, client_lcloud_pool_init);
+    for (int k = 0; k < count; k++) {
+
+        unsigned int c1 = (regs[k] >> 40) & 0xff;
+        local_regs[k] = client_lcloud_set_device(regs[k], (c1 < LCLOUD_MAX_DEVICES) ? device_local[c1] : c1);
+    }
+    for (int i = 0; i < server_count * pool_size; i++) {  //each connection's share of the batch, in order
+
+        Connection *conn = &connections[i / pool_size][i % pool_size];
+        int first = grouped;
+        for (int k = 0; k < count; k++) {
+            if (client_lcloud_route(regs[k]) == conn) {
+                requests[grouped++] = k;
             }
+        }
+        if (grouped > first) {
 
-            int write_success = write(socket_handle, local_buffer, 256);  //give the network the data to be written
-                if (write_success == -1) {
-                return(-1);
+            memset(&shares[used], 0, sizeof(BatchShare));
+            shares[used].conn = conn;
+            shares[used].requests = &requests[first];
+            shares[used].share = grouped - first;
+            used += 1;
+        }
+    }
+
+    int result = 0;
+    for (int u = 0; u < used; u++) {  //locked in pool order, as every batch does, so they can't deadlock
+
+        Connection *conn = shares[u].conn;
+        pthread_mutex_lock(&conn->lock);
+        client_lcloud_drain(conn);
+        if ((result == 0) && (conn->sock == -1) && (conn->channel == NULL)) {  //the connections are made at power on, or by the first request for a device
+            result = client_lcloud_connect(conn);
+        }
+    }
+
+    int pending = 0;
+    for (int u = 0; (u < used) && (result == 0); u++) {  //start every share that can wait with the others, run the rest
+
+        BatchShare *batch = &shares[u];
+        Connection *conn = batch->conn;
+        if ((hedge_percentile > 0) && (pipeline_depth == 1) && (conn->channel == NULL)) {  //one request at a time, so each read can be hedged
+
+            for (; (batch->received < batch->share) && (result == 0); batch->received++) {
+
+                int k = batch->requests[batch->received];
+                rframes[k] = client_lcloud_bus_exchange(conn, local_regs[k], bufs[k]);
+                result = (rframes[k] == (LCloudRegisterFrame)-1) ? -1 : 0;
             }
+        }
+        else if (conn->channel != NULL) {
 
-            int read_success = read(socket_handle, &rframe, LCLOUD_NET_HEADER_SIZE);  //receive the network's return opcode
-            if (read_success == -1) {
-                return(-1);
+            result = client_lcloud_share_send(batch, local_regs, bufs);
+            while ((batch->received < batch->share) && (result == 0)) {
+                result = client_lcloud_share_step(batch, local_regs, bufs, rframes, 1);
             }
-            rframe = ntohll64(rframe);
+        }
+        else {
 
-            return(rframe);
+            result = (conn->uring != NULL) ? client_lcloud_uring_step(batch, local_regs, bufs, rframes, 0) : client_lcloud_share_send(batch, local_regs, bufs);
+            if ((batch->received < batch->share) || (batch->writing == 1)) {  //a ring may have finished the share already
+                batch->pipelined = 1;
+                pending += 1;
+            }
         }
-        else if (c2 == LC_XFER_READ) {  //if the type of block transfer is a read
+    }
 
-            uint64_t network_op = htonll64(reg);
+    while ((pending > 0) && (result == 0)) {  //take the responses as they come in, from any connection
 
-            int op_success = write(socket_handle, &network_op, LCLOUD_NET_HEADER_SIZE);  //give opcode
-            if (op_success == -1) {
-                return(-1);
-            }
+        struct pollfd fds[LCLOUD_SERVERS_MAX * LCLOUD_POOL_MAXSIZE];
+        BatchShare *waiting[LCLOUD_SERVERS_MAX * LCLOUD_POOL_MAXSIZE];
+        int polled = 0;
+        for (int u = 0; u < used; u++) {
 
-            int read_success = read(socket_handle, &rframe, LCLOUD_NET_HEADER_SIZE);  //receive return opcode
-            if (read_success == -1) {
-                return(-1);
+            if (shares[u].pipelined == 1) {
+
+                fds[polled].fd = (shares[u].conn->uring != NULL) ? shares[u].conn->uring->fd : shares[u].conn->sock;
+                fds[polled].events = POLLIN;  //a socket's response, or a ring's completion
+                fds[polled].revents = 0;
+                waiting[polled++] = &shares[u];
             }
-            rframe = ntohll64(rframe);
+        }
+        if ((polled > 1) && (poll(fds, polled, -1) == -1)) {
 
-            int buf_success = read(socket_handle, local_buffer, 256);  //read the data from the server with the local buffer
-            if (buf_success == -1) {
-                return(-1);
+            result = (errno == EINTR) ? 0 : -1;
+            continue;
+        }
+
+        for (int i = 0; (i < polled) && (result == 0); i++) {
+
+            BatchShare *batch = waiting[i];
+            if ((polled > 1) && (fds[i].revents == 0)) {
+                continue;
+            }
+            result = (batch->conn->uring != NULL) ? client_lcloud_uring_step(batch, local_regs, bufs, rframes, polled == 1)
+                : client_lcloud_share_step(batch, local_regs, bufs, rframes, polled == 1);
+            if ((batch->received == batch->share) && (batch->writing == 0)) {
+                batch->pipelined = 0;
+                pending -= 1;
             }
+        }
+    }
+
+    for (int u = 0; u < used; u++) {
 
-            memcpy(buf, local_buffer, 256);
-            return(rframe);
+        if ((result == -1) && (shares[u].received < shares[u].share) && (shares[u].conn->channel == NULL)) {  //responses may still be coming, the stream can't be trusted
+            client_lcloud_disconnect(shares[u].conn);
         }
+        pthread_mutex_unlock(&shares[u].conn->lock);
+    }
+    for (int k = 0; (k < count) && (result == 0); k++) {  //back to the device ids the file system knows
+        rframes[k] = client_lcloud_set_device(rframes[k], (regs[k] >> 40) & 0xff);
     }
-    else if (c0 == LC_POWER_OFF) {  //if the operation is a power off
 
-        uint64_t network_op = htonll64(reg);
+    return(result);
+}
 
-        int op_success = write(socket_handle, &network_op, LCLOUD_NET_HEADER_SIZE);  //give opcode
-        if (op_success == -1) {
-            return(-1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_share_send
+// Description  : tops up a connection's window of a batch, once half of it has
+//                been answered (or at the start), in one send
+//
+// Inputs       : batch - the connection's share of the batch
+//                regs, bufs - the batch's requests and their block(s)
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_share_send( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs ) {
+
+    LCloudRegisterFrame window_regs[LCLOUD_PIPELINE_MAXDEPTH];
+    void *window_bufs[LCLOUD_PIPELINE_MAXDEPTH];
+    int window = 0;
+
+    if (batch->sent - batch->received <= pipeline_depth / 2) {
+        window = (batch->received + pipeline_depth - batch->sent < batch->share - batch->sent) ? batch->received + pipeline_depth - batch->sent : batch->share - batch->sent;
+    }
+    for (int k = 0; k < window; k++) {  //gather the share's requests for the send
+        window_regs[k] = regs[batch->requests[batch->sent + k]];
+        window_bufs[k] = bufs[batch->requests[batch->sent + k]];
+    }
+    if ((window > 0) && (client_lcloud_bus_send(batch->conn, window_regs, window_bufs, window) == -1)) {
+        return(-1);
+    }
+    batch->sent += window;
+
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_share_step
+// Description  : receives the next response of a connection's share of a
+//                batch, then tops its window up
+//
+// Inputs       : batch - the connection's share of the batch
+//                regs, bufs - the batch's requests and their block(s)
+//                rframes - filled in with the response registers
+//                wait - unused, a socket's receive waits for the response
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_share_step( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *rframes, int wait ) {
+
+    int k = batch->requests[batch->received];
+    rframes[k] = client_lcloud_bus_receive(batch->conn, regs[k], bufs[k]);
+    if (rframes[k] == (LCloudRegisterFrame)-1) {
+        return(-1);
+    }
+    batch->received += 1;
+
+    return(client_lcloud_share_send(batch, regs, bufs));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_exchange
+// Description  : sends one request on a connection and receives its response.
+//                With hedging on, a read over a socket that is still
+//                unanswered after the hedge delay is sent again on the
+//                connection's hedge connection, and whichever answer comes
+//                first is taken.  The loser's response is left to be drained
+//                before its connection's next request.  When the hedge wins
+//                the two connections trade places, so the device's next
+//                requests skip the one that was slow.
+//
+// Inputs       : conn - the pool connection, locked and open
+//                reg - the request registers
+//                buf - the block(s) to be written, or read into
+// Outputs      : the response registers, -1 if failure
+LCloudRegisterFrame client_lcloud_bus_exchange( Connection *conn, LCloudRegisterFrame reg, void *buf ) {
+
+    unsigned int c0 = (reg >> 48) & 0xff, c2 = (reg >> 32) & 0xff;
+    int hedgeable = (hedge_percentile > 0) && (conn->channel == NULL) && ((c0 == LC_BLOCK_XFER) || (c0 == LC_BLOCK_XFER_MULTI)) && ((c2 & 1) == LC_XFER_READ);
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (client_lcloud_bus_send(conn, &reg, &buf, 1) == -1) {
+        return(-1);
+    }
+    if (hedgeable == 0) {
+        return(client_lcloud_bus_receive(conn, reg, buf));
+    }
+
+    pthread_mutex_lock(&hedge_lock);
+    int64_t delay = hedge_delay;  //-1 until there are enough samples
+    pthread_mutex_unlock(&hedge_lock);
+
+    Connection *hedge = &hedge_connections[0][0] + (conn - &connections[0][0]), *winner = conn;
+    struct timespec timeout = {delay / 1000000000, delay % 1000000000}, now_only = {0, 0};
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(conn->sock, &ready);
+    int hedged = 0;
+    if ((delay >= 0) && (pselect(conn->sock + 1, &ready, NULL, NULL, &timeout, NULL) == 0)) {  //slower than the percentile, ask again elsewhere
+
+        pthread_mutex_lock(&hedge->lock);
+        FD_ZERO(&ready);
+        if (hedge->stale != 0) {  //the hedge's own last loser, if it has come in
+
+            FD_SET(hedge->sock, &ready);
+            if (pselect(hedge->sock + 1, &ready, NULL, NULL, &now_only, NULL) == 1) {
+                client_lcloud_drain(hedge);
+            }
         }
+        if ((hedge->stale == 0) && ((hedge->sock != -1) || (client_lcloud_connect(hedge) == 0)) && (client_lcloud_bus_send(hedge, &reg, &buf, 1) == 0)) {
 
-        int read_success = read(socket_handle, &rframe, LCLOUD_NET_HEADER_SIZE);  //receive return opcode
-        if (read_success == -1) {
-            return(-1);
+            hedged = 1;
+            do {
+                FD_ZERO(&ready);
+                FD_SET(conn->sock, &ready);
+                FD_SET(hedge->sock, &ready);
+            } while ((pselect(((conn->sock > hedge->sock) ? conn->sock : hedge->sock) + 1, &ready, NULL, NULL, NULL, NULL) == -1) && (errno == EINTR));
+            winner = FD_ISSET(hedge->sock, &ready) && !FD_ISSET(conn->sock, &ready) ? hedge : conn;
+            ((winner == conn) ? hedge : conn)->stale = reg;
         }
-        rframe = ntohll64(rframe);
+        if (winner == conn) {
+            pthread_mutex_unlock(&hedge->lock);
+        }
+    }
+
+    LCloudRegisterFrame rframe = client_lcloud_bus_receive(winner, reg, buf);
+    if (winner == hedge) {  //the hedge becomes the device's connection, the slow one waits in its place
 
-        close(socket_handle);  //close the connection and reset the socket handle
-        socket_handle = -1;
+        Connection slow = *conn;
+        conn->sock = hedge->sock;
+        conn->uring = hedge->uring;
+        conn->stale = hedge->stale;
+        hedge->sock = slow.sock;
+        hedge->uring = slow.uring;
+        hedge->stale = slow.stale;
+        pthread_mutex_unlock(&hedge->lock);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    client_lcloud_hedge_record((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec), hedged, winner == hedge);
+    return(rframe);
+}
 
-        return(rframe);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_drain
+// Description  : receives, and throws away, the response to a hedged read the
+//                connection lost, so its next response is its own.  The
+//                connection is closed if that fails.
+//
+// Inputs       : conn - the connection, locked
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_drain( Connection *conn ) {
+
+    char scratch[LC_XFER_MAXBLOCKS * LC_DEVICE_BLOCK_SIZE];
+
+    if (conn->stale == 0) {
+        return(0);
+    }
+    LCloudRegisterFrame reg = conn->stale;
+    conn->stale = 0;
+    if (client_lcloud_bus_receive(conn, reg, scratch) == (LCloudRegisterFrame)-1) {
+        client_lcloud_disconnect(conn);
+        return(-1);
     }
-    else {  //if the operation is a device probe, device init, device shut down, etc.
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_hedge_record
+// Description  : adds a read's latency to the recent samples, and every so
+//                often works the hedge delay out again from them.  A hedged
+//                read counts with the time its answer took, which is past the
+//                delay, so hedging doesn't pull the percentile down.
+//
+// Inputs       : latency - the read's latency (ns)
+//                hedged - 1 if the read was hedged
+//                won - 1 if the hedge answered first
+// Outputs      : none
+void client_lcloud_hedge_record( int64_t latency, int hedged, int won ) {
 
-        uint64_t network_op = htonll64(reg);
+    pthread_mutex_lock(&hedge_lock);
+    hedge_samples[hedge_count % LCLOUD_HEDGE_SAMPLES] = latency;
+    hedge_count += 1;
+    hedge_reads += 1;
+    hedge_sent += hedged;
+    hedge_won += won;
 
-        int op_success = write(socket_handle, &network_op, LCLOUD_NET_HEADER_SIZE);  //give opcode
-        if (op_success == -1) {
-            return(-1);
+    if ((hedge_count >= LCLOUD_HEDGE_MINSAMPLES) && (hedge_count % LCLOUD_HEDGE_MINSAMPLES == 0)) {
+
+        static int64_t sorted[LCLOUD_HEDGE_SAMPLES];
+        int n = (hedge_count < LCLOUD_HEDGE_SAMPLES) ? hedge_count : LCLOUD_HEDGE_SAMPLES;
+        memcpy(sorted, hedge_samples, n * sizeof(int64_t));
+        qsort(sorted, n, sizeof(int64_t), client_lcloud_compare_latency);
+        hedge_delay = sorted[(n * hedge_percentile) / 100];
+    }
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_compare_latency
+// Description  : orders two latencies for qsort
+//
+// Inputs       : a, b - the latencies
+// Outputs      : <0, 0 or >0 as a is less than, equal to or more than b
+int client_lcloud_compare_latency( const void *a, const void *b ) {
+
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return((x > y) - (x < y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_uring_queue
+// Description  : tops up a connection's window of a batch in its io_uring, and
+//                queues the fixed write of the window and the fixed read of
+//                the responses, if they aren't in flight already.  Only one
+//                write and one read are in flight at a time, so the socket's
+//                bytes stay in order.
+//
+// Inputs       : batch - the connection's share of the batch
+//                regs, bufs - the batch's requests and their block(s)
+// Outputs      : 0 if success
+int client_lcloud_uring_queue( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs ) {
+
+    Connection *conn = batch->conn;
+    LcUring *ring = conn->uring;
+
+    if ((batch->writing == 0) && (batch->written == batch->packed) && (batch->sent < batch->share) && (batch->sent - batch->received <= pipeline_depth / 2)) {  //top the window up, once half of it has been answered
+
+        batch->packed = batch->written = 0;
+        while ((batch->sent < batch->share) && (batch->sent - batch->received < pipeline_depth)) {
+
+            int k = batch->requests[batch->sent];
+            size_t size = ((((regs[k] >> 32) & 0xff) & 1) == LC_XFER_WRITE) ? client_lcloud_payload_size(regs[k]) : 0;
+            if (batch->packed + LCLOUD_NET_HEADER_SIZE + size > LCLOUD_URING_AREA_SIZE) {
+                break;
+            }
+            LCloudRegisterFrame network_op = htonll64(regs[k]);
+            memcpy(ring->send_area + batch->packed, &network_op, LCLOUD_NET_HEADER_SIZE);
+            memcpy(ring->send_area + batch->packed + LCLOUD_NET_HEADER_SIZE, bufs[k], size);
+            batch->packed += LCLOUD_NET_HEADER_SIZE + size;
+            batch->sent += 1;
         }
+    }
+    if ((batch->writing == 0) && (batch->written < batch->packed)) {
+        batch->writing = (lcloud_uring_queue(ring, IORING_OP_WRITE_FIXED, conn->sock, 0, batch->written, batch->packed - batch->written, 0) == 0);
+    }
+    if ((batch->reading == 0) && (batch->received < batch->share)) {  //slide what is left of the responses down first, the area is only touched with no read in flight
 
-        int read_success = read(socket_handle, &rframe, LCLOUD_NET_HEADER_SIZE);  //receive return opcode
-        if (read_success == -1) {
-            return(-1);
+        memmove(ring->receive_area, ring->receive_area + batch->matched, batch->filled - batch->matched);
+        batch->filled -= batch->matched;
+        batch->matched = 0;
+        batch->reading = (lcloud_uring_queue(ring, IORING_OP_READ_FIXED, conn->sock, 1, batch->filled, LCLOUD_URING_AREA_SIZE - batch->filled, 1) == 0);
+    }
+
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_uring_step
+// Description  : moves a connection's share of a batch along through its
+//                io_uring.  The window's requests go out in one fixed write
+//                from the registered send area while a fixed read into the
+//                registered receive area waits on the responses, submitted
+//                (and, if asked, waited on) with a single system call.  The
+//                responses are cut out of the receive area as they complete.
+//                Without waiting, what comes next is submitted before
+//                returning, so the ring's descriptor polls ready when it
+//                completes.  A failure leaves the connection closed, since a
+//                read may still be in flight on it.
+//
+// Inputs       : batch - the connection's share, locked and with a ring
+//                regs, bufs - the batch's requests and their block(s)
+//                rframes - filled in with the response registers
+//                wait - 1 to wait for a completion, 0 to take what is there
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_uring_step( BatchShare *batch, LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *rframes, int wait ) {
+
+    Connection *conn = batch->conn;
+    LcUring *ring = conn->uring;
+    int result = 0;
+
+    client_lcloud_uring_queue(batch, regs, bufs);
+    wait = ((batch->writing == 1) || (batch->reading == 1)) ? wait : 0;  //nothing in flight, nothing to wait on
+    if (((wait == 1) || (ring->to_submit > 0)) && (lcloud_uring_enter(ring, wait) == -1)) {
+        result = -1;
+    }
+
+    uint64_t tag;
+    int moved;
+    while ((result == 0) && (lcloud_uring_reap(ring, &tag, &moved) == 0)) {
+
+        if (moved <= 0) {  //an error, or the server closing
+            result = -1;
+        }
+        else if (tag == 0) {
+            batch->written += moved;
+        }
+        else {
+            batch->filled += moved;
         }
+        batch->writing = (tag == 0) ? 0 : batch->writing;
+        batch->reading = (tag == 1) ? 0 : batch->reading;
+    }
+
+    while ((result == 0) && (batch->received < batch->share) && (batch->filled - batch->matched >= LCLOUD_NET_HEADER_SIZE)) {  //cut out the responses that are all there
+
+        int k = batch->requests[batch->received];
+        LCloudRegisterFrame rframe;
+        memcpy(&rframe, ring->receive_area + batch->matched, LCLOUD_NET_HEADER_SIZE);
         rframe = ntohll64(rframe);
 
-        return(rframe);
+        unsigned int c0 = (regs[k] >> 48) & 0xff, c2 = (regs[k] >> 32) & 0xff;
+        size_t size = ((c2 & 1) == LC_XFER_READ) ? client_lcloud_payload_size(regs[k]) : 0;
+        if ((c0 == LC_BLOCK_XFER_MULTI) && ((rframe >> 56) != 0x11)) {  //a multi-block read only carries its data if it worked
+            size = 0;
+        }
+        if (batch->filled - batch->matched < LCLOUD_NET_HEADER_SIZE + size) {
+            break;
+        }
+        memcpy(bufs[k], ring->receive_area + batch->matched + LCLOUD_NET_HEADER_SIZE, size);
+        rframes[k] = rframe;
+        batch->matched += LCLOUD_NET_HEADER_SIZE + size;
+        batch->received += 1;
+    }
+
+    if ((result == 0) && (wait == 0) && ((batch->received < batch->share) || (batch->writing == 1))) {  //keep something in flight to be woken by
+
+        client_lcloud_uring_queue(batch, regs, bufs);
+        if ((ring->to_submit > 0) && (lcloud_uring_enter(ring, 0) == -1)) {
+            result = -1;
+        }
+    }
+    if ((result == -1) || ((batch->received == batch->share) && (batch->writing == 0) && (batch->filled != batch->matched))) {  //the stream can't be trusted past here
+        client_lcloud_disconnect(conn);
+        return(-1);
     }
+    return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_setpipeline
+// Description  : sets the most block transfers a batch keeps outstanding on
+//                the connection, 1 waits for each response before sending on
+//
+// Inputs       : depth - 1 to LCLOUD_PIPELINE_MAXDEPTH
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_setpipeline( int depth ) {
+
+    if ((depth < 1) || (depth > LCLOUD_PIPELINE_MAXDEPTH)) {
+        return(-1);
+    }
+    pipeline_depth = depth;
+
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_setpool
+// Description  : sets the number of connections to the server, devices being
+//                spread over them by id (call before power on)
+//
+// Inputs       : size - 1 to LCLOUD_POOL_MAXSIZE
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_setpool( int size ) {
+
+    if ((size < 1) || (size > LCLOUD_POOL_MAXSIZE)) {
+        return(-1);
+    }
+    pool_size = size;
+
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_setserver
+// Description  : sets the server to connect to, "shm:/name" for shared memory
+//                rings, "unix:/path" for a unix domain socket, "ip" or
+//                "ip:port" for TCP.  A comma separated list of them spreads
+//                the devices over several servers, the file system seeing
+//                all of their devices (call before power on).
+//
+// Inputs       : address - the server address(es), NULL for the default
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_setserver( const char *address ) {
+
+    char *list[LCLOUD_SERVERS_MAX] = { NULL };
+    int count = 1;
+
+    if (address != NULL) {
+
+        char *copy = strdup(address), *next = copy, *entry;
+        count = 0;
+        while ((entry = strsep(&next, ",")) != NULL) {
+
+            if ((count == LCLOUD_SERVERS_MAX) || (*entry == '\0') ||
+                ((strncmp(entry, LCLOUD_UNIX_PREFIX, strlen(LCLOUD_UNIX_PREFIX)) == 0) &&
+                 (strlen(entry) - strlen(LCLOUD_UNIX_PREFIX) >= sizeof(((struct sockaddr_un *)0)->sun_path)))) {
+
+                for (int s = 0; s < count; s++) {
+                    free(list[s]);
+                }
+                free(copy);
+                return(-1);
+            }
+            list[count++] = strdup(entry);
+        }
+        free(copy);
+    }
+
+    for (int s = 0; s < LCLOUD_SERVERS_MAX; s++) {
+
+        free(server_addresses[s]);
+        server_addresses[s] = list[s];
+    }
+    server_count = count;
+
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_setengine
+// Description  : sets how batches move over socket connections, with
+//                writev/readv or through an io_uring per connection.  Where
+//                the kernel has no io_uring the connection falls back to
+//                writev/readv (call before power on).
+//
+// Inputs       : engine - LCLOUD_ENGINE_BLOCKING or LCLOUD_ENGINE_URING
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_setengine( int engine ) {
+
+    if ((engine != LCLOUD_ENGINE_BLOCKING) && (engine != LCLOUD_ENGINE_URING)) {
+        return(-1);
+    }
+    io_engine = engine;
+
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_sethedge
+// Description  : sets the percentile of recent read latencies past which a
+//                read is hedged on a second connection, 0 to never hedge.
+//                Batches are only hedged at a pipeline depth of 1, where
+//                their reads go one at a time (call before power on).
+//
+// Inputs       : percentile - 0, or 1 to 99
+// Outputs      : 0 if success, -1 if failure
+int client_lcloud_sethedge( int percentile ) {
+
+    if ((percentile < 0) || (percentile > 99)) {
+        return(-1);
+    }
+    hedge_percentile = percentile;
+
+    return(0);
+}
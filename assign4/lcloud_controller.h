@@ -18,6 +18,8 @@
 #define LC_MAX_OPERATION_SIZE 10240 // Maximum size for any read or write
 #define LC_XFER_READ 0
 #define LC_XFER_WRITE 1
+#define LC_XFER_COUNT_SHIFT 1 // LC_BLOCK_XFER_MULTI carries (blocks - 1) in C2, above the direction bit
+#define LC_XFER_MAXBLOCKS 128 // Most blocks one LC_BLOCK_XFER_MULTI request moves
 
 /* Lion Cloud Device Type Definitions */
 typedef uint8_t LcDeviceId; /* The hardware device identifier */
@@ -67,7 +69,8 @@ typedef enum {
     LC_DEVINIT        = 2,  // Initialize a device, get sec/blks
     LC_BLOCK_XFER     = 3,  // Transfer a block to the device
     LC_POWER_OFF      = 4,  // Power off the device
-    LC_MAX_OPERATION  = 5   // Maximum operation number
+    LC_BLOCK_XFER_MULTI = 5,  // Transfer a run of contiguous blocks (local server only)
+    LC_MAX_OPERATION  = 6   // Maximum operation number
 } LcOperationCode;
 
 
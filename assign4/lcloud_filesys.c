@@ -29,6 +29,7 @@ typedef struct {
     int position;
     int length;
     int blocks[2048][3];  //order of indices is sector, block, device array index
+    int partition;  //cache partition of the file's blocks, -1 to go by device
 } File;
 
 typedef struct {
@@ -47,6 +48,7 @@ int f_array_index = 0;
 int handle = 1;
 int powered_on = 0;
 int sector = 0, block = 0;
+int multi_xfer = 0;  //1 if the server does multi-block transfers
 //
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -186,6 +188,7 @@ int device_init(void) {
             active_devices_array[index].num_sectors = d0;
             active_devices_array[index].num_blocks = d1;
             active_devices_array[index].id = active_devices[id];
+            lcloud_setcachegeometry(active_devices[id], d0, d1);  //lets the prefetcher follow the allocation order
             index += 1;
 
         }
@@ -236,6 +239,190 @@ int put_block(char *buffer, int device_id, int sector, int block) {
     return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transfer_batch
+// Description  : sends a batch of block transfer requests, pipelined up to
+//                the client's depth, and checks every response
+//
+// Inputs       : frames - the requests
+//                buffers - the block(s) each request writes or reads into
+//                count - the number of requests
+// Outputs      : 0 if every transfer worked, -1 if not
+int transfer_batch(LCloudRegisterFrame *frames, void **buffers, int count) {
+    unsigned int b0, b1, c0, c1, c2, d0, d1;
+    LCloudRegisterFrame rframes[LC_XFER_MAXBLOCKS];
+
+    int result = client_lcloud_bus_batch(frames, buffers, rframes, count);
+    for (int i = 0; (i < count) && (result == 0); i++) {
+
+        unsigned int op = (frames[i] >> 48) & 0xff;
+        extract_lcloud_registers(rframes[i], &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        if ((b0 != 1) || (b1 != 1) || (c0 != op)) {
+            result = -1;
+        }
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transfer_blocks
+// Description  : moves a run of physically contiguous blocks in one request,
+//                the run continuing into the next sector after the last block
+//                of a sector.  Without multi-block transfers the blocks go as
+//                a batch of single block requests.
+//
+// Inputs       : buffer - the blocks, count * 256 bytes
+//                device_id - the id of the device
+//                sector - the sector of the first block
+//                block - the first block
+//                count - the number of blocks, 1 to LC_XFER_MAXBLOCKS
+//                direction - LC_XFER_READ or LC_XFER_WRITE
+// Outputs      : 0 if success, -1 if failure
+int transfer_blocks(char *buffer, int device_id, int sector, int block, int count, int direction) {
+    LCloudRegisterFrame frames[LC_XFER_MAXBLOCKS];
+    void *buffers[LC_XFER_MAXBLOCKS];
+
+    if ((multi_xfer == 1) && (count > 1)) {
+
+        frames[0] = create_lcloud_registers(0, 0, LC_BLOCK_XFER_MULTI, device_id, direction | ((count - 1) << LC_XFER_COUNT_SHIFT), sector, block);
+        buffers[0] = buffer;
+        return(transfer_batch(frames, buffers, 1));
+    }
+
+    int blocks_per_sector = 0;
+    for (int device = 0; device < 16; device++) {
+        if ((active_devices_array[device].used_locations != NULL) && (active_devices_array[device].id == device_id)) {
+            blocks_per_sector = active_devices_array[device].num_blocks;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+
+        frames[i] = create_lcloud_registers(0, 0, LC_BLOCK_XFER, device_id, direction, sector, block);
+        buffers[i] = &buffer[i * 256];
+        if (++block == blocks_per_sector) {
+            sector += 1;
+            block = 0;
+        }
+    }
+    return(transfer_batch(frames, buffers, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_blocks
+// Description  : writes a run of physically contiguous blocks (the cache's
+//                flusher writes its runs of dirty blocks with this)
+//
+// Inputs       : buffer - the blocks, count * 256 bytes
+//                device_id - the id of the device
+//                sector - the sector of the first block
+//                block - the first block
+//                count - the number of blocks
+// Outputs      : 0 if success, -1 if failure
+int put_blocks(char *buffer, int device_id, int sector, int block, int count) {
+    return(transfer_blocks(buffer, device_id, sector, block, count, LC_XFER_WRITE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : probe_multi_xfer
+// Description  : finds out whether the server does multi-block transfers by
+//                reading the first block of the first device with one.  A
+//                server that doesn't know the operation fails it and sends
+//                no data.
+//
+// Inputs       : nothing
+// Outputs      : 1 if it does, 0 if not
+int probe_multi_xfer(void) {
+    char buffer[256];
+
+    if (active_devices_array[0].used_locations == NULL) {
+        return(0);
+    }
+    multi_xfer = 1;
+    LCloudRegisterFrame frame = create_lcloud_registers(0, 0, LC_BLOCK_XFER_MULTI, active_devices_array[0].id, LC_XFER_READ, 0, 0);
+    LCloudRegisterFrame rframe = client_lcloud_bus_request(frame, buffer);
+    multi_xfer = ((rframe >> 60) == 1) && (((rframe >> 56) & 0xf) == 1);
+    logMessage(LcDriverLLevel, "Server %s multi-block transfers", (multi_xfer == 1) ? "supports" : "does not support");
+    return(multi_xfer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file_blocks
+// Description  : fills a buffer with consecutive blocks of an open file, from
+//                the cache where it has them.  Misses that follow each other
+//                on their device are read with one multi-block transfer, and
+//                the reads for all of the misses go out as one pipelined
+//                batch before they are cached.
+//
+// Inputs       : location - index of the file in the open file array
+//                first - the first block of the file to read
+//                count - the number of blocks
+//                out - room for the count blocks
+// Outputs      : 0 if success, -1 if failure
+int read_file_blocks(int location, int first, int count, char out[][256]) {
+    LCloudRegisterFrame frames[(LC_MAX_OPERATION_SIZE / 256) + 2];
+    void *buffers[(LC_MAX_OPERATION_SIZE / 256) + 2];
+    int fetched[(LC_MAX_OPERATION_SIZE / 256) + 2];  //1 for the blocks read from the devices
+    int requests = 0;
+
+    int i = 0;
+    while (i < count) {
+
+        fetched[i] = 0;
+        int *where = open_files_array[location].blocks[first + i];  //sector, block, device array index
+        if (where[2] == -1) {  //past the end of the file, nothing stored there yet
+            memset(out[i], 0, 256);
+            i += 1;
+            continue;
+        }
+        Device *device = &active_devices_array[where[2]];
+        if (lcloud_copycache(device->id, where[0], where[1], out[i]) == 0) {
+            i += 1;
+            continue;
+        }
+
+        int run = 1, cached = 0;  //extend the miss over the blocks stored right after it
+        while ((multi_xfer == 1) && (i + run < count) && (run < LC_XFER_MAXBLOCKS)) {
+
+            int *next = open_files_array[location].blocks[first + i + run];
+            if ((next[2] != where[2]) || (next[0] * device->num_blocks + next[1] != where[0] * device->num_blocks + where[1] + run)) {
+                break;
+            }
+            if (lcloud_copycache(device->id, next[0], next[1], out[i + run]) == 0) {
+                fetched[i + run] = 0;
+                cached = 1;
+                break;
+            }
+            fetched[i + run] = 1;
+            run += 1;
+        }
+
+        frames[requests] = (run == 1) ? create_lcloud_registers(0, 0, LC_BLOCK_XFER, device->id, LC_XFER_READ, where[0], where[1])
+            : create_lcloud_registers(0, 0, LC_BLOCK_XFER_MULTI, device->id, LC_XFER_READ | ((run - 1) << LC_XFER_COUNT_SHIFT), where[0], where[1]);
+        buffers[requests] = out[i];
+        requests += 1;
+        fetched[i] = 1;
+        i += run + cached;
+    }
+
+    if ((requests > 0) && (transfer_batch(frames, buffers, requests) == -1)) {
+        return(-1);
+    }
+    for (i = 0; i < count; i++) {
+
+        if (fetched[i] == 1) {
+            int *filled = open_files_array[location].blocks[first + i];
+            lcloud_putcache(active_devices_array[filled[2]].id, filled[0], filled[1], out[i]);
+        }
+    }
+
+    return(0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : choose_location
@@ -284,7 +471,13 @@ LcFHandle lcopen( const char *path ) {
         power_on();
         device_probe();
         device_init();
-        lcloud_initcache(LC_CACHE_MAXBLOCKS);
+        probe_multi_xfer();
+        lcloud_setcacheio(get_block, put_block);  //lets the cache write (and later read) device blocks itself
+        lcloud_setcacherunio(put_blocks);  //and write back runs of them together
+        if (lcloud_initcache(LC_CACHE_MAXBLOCKS) == -1) {  //writes go through the cache, so no file can be used without it
+            logMessage(LOG_ERROR_LEVEL, "LC failed starting the block cache.");
+            return(-1);
+        }
         powered_on = 1;
     }
 
@@ -302,6 +495,7 @@ LcFHandle lcopen( const char *path ) {
     open_files_array[f_array_index].handle = handle;
     open_files_array[f_array_index].position = 0;
     open_files_array[f_array_index].length = 0;
+    open_files_array[f_array_index].partition = -1;
     for (int i = 0; i < 2048; i++) {
         open_files_array[f_array_index].blocks[i][0] = -1;
         open_files_array[f_array_index].blocks[i][1] = -1;
@@ -359,11 +553,28 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
 
     int count = 0;
     int total_possible_reads = (LC_MAX_OPERATION_SIZE / 2) + 2;
+    int first = open_files_array[location].position / 256;  //the file's blocks this read covers, fetched up front so contiguous misses go together
+    int span = ((len > 0) ? ((open_files_array[location].position + len - 1) / 256) : first) - first + 1;
+    char staged[(LC_MAX_OPERATION_SIZE / 256) + 2][256];
+    if (span > (LC_MAX_OPERATION_SIZE / 256) + 2) {
+        return(-1);
+    }
+    LcCacheCaller caller = lcloud_getcachecaller();  //charge cache accesses to the read path, unless this is lcwrite's read-modify-write
+    if (caller == LC_CACHE_CALLER_OTHER) {
+        lcloud_setcachecaller(LC_CACHE_CALLER_READ);
+    }
+    int partition = lcloud_usecachepartition(open_files_array[location].partition);  //charge the file's blocks to its partition
+
+    if (read_file_blocks(location, first, span, staged) == -1) {
+
+        lcloud_setcachecaller(caller);
+        lcloud_usecachepartition(partition);
+        return(-1);
+    }
 
     for (int read = 0; read < total_possible_reads; read++) {
 
         char buffer[256] = {0};
-        char *cache_buffer;
 
         int section = open_files_array[location].position / 256;  //use the markers in the file struct to determine which sector and block the current position is in
         int temp_sector = open_files_array[location].blocks[section][0];
@@ -372,20 +583,7 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
         int index = open_files_array[location].position % 256;  //starting index to be used for the buffer that reads the data
         int block_space_remaining = 256 - index;
 
-        cache_buffer = lcloud_getcache(active_devices_array[device_index].id, temp_sector, temp_block);  //check if the desired block is in the cache
-
-        if (cache_buffer == NULL) {  //if there was a cache miss, make an io call
-            get_block(buffer, active_devices_array[device_index].id, temp_sector, temp_block);
-            lcloud_putcache(active_devices_array[device_index].id, temp_sector, temp_block, buffer);
-        }
-        else {  //if there was cache hit, fill up the local buffer with the block info from the cache
-
-            memcpy(buffer, cache_buffer, 256);
-            /*for (int i = 0; i < 256; i++) {
-
-                buffer[i] = cache_buffer[i];
-            }*/
-        }
+        memcpy(buffer, staged[section - first], 256);  //the block, from the cache or the device
         logMessage(LcDriverLLevel, "Success reading blkc [%d/%d/%d].", active_devices_array[device_index].id, temp_sector, temp_block);
 
         if ((len - count) <= block_space_remaining) {  //if the current read can be done without exceeding the block space
@@ -407,10 +605,14 @@ int lcread( LcFHandle fh, char *buf, size_t len ) {
 
         if (count == len) {
 
+            lcloud_setcachecaller(caller);
+            lcloud_usecachepartition(partition);
             return(count);
         }
     }
 
+    lcloud_setcachecaller(caller);
+    lcloud_usecachepartition(partition);
     return(-1);
 }
 
@@ -453,6 +655,8 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
     int write_size;
     int overwrite = 0;  //marker for whether an overwrite is desired
     int device_index;
+    LcCacheCaller caller = lcloud_setcachecaller(LC_CACHE_CALLER_WRITE);  //charge cache accesses to the write path
+    int partition = lcloud_usecachepartition(open_files_array[location].partition);  //and the file's blocks to its partition
 
     if (open_files_array[location].position != open_files_array[location].length) {
 
@@ -523,8 +727,13 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
         }
 
         memcpy(&buffer[bytes_in_block], &buf[count], write_size);
-        lcloud_putcache(active_devices_array[device_index].id, sector, block, buffer);  //update the cache with new information
-        put_block(buffer, active_devices_array[device_index].id, sector, block);
+        if (lcloud_writecache(active_devices_array[device_index].id, sector, block, buffer) == -1) {  //update the cache with new information, it writes the device block
+
+            logMessage(LOG_ERROR_LEVEL, "LC failed writing block [%d/%d/%d].", active_devices_array[device_index].id, sector, block);
+            lcloud_setcachecaller(caller);
+            lcloud_usecachepartition(partition);
+            return(-1);
+        }
 
         int section = open_files_array[location].length / 256;  //make note of which sector, block, and device was used for this part of the file
         if (open_files_array[location].blocks[section][0] == -1) {
@@ -551,10 +760,14 @@ int lcwrite( LcFHandle fh, char *buf, size_t len ) {
         if (count == len) {
 
             logMessage(LcDriverLLevel, "Driver wrote %d bytes to file %s (now %d bytes)", count, open_files_array[location].filename, open_files_array[location].length);
+            lcloud_setcachecaller(caller);
+            lcloud_usecachepartition(partition);
             return(count);
         }
     }
 
+    lcloud_setcachecaller(caller);
+    lcloud_usecachepartition(partition);
     return(-1);
 }
 
@@ -592,6 +805,30 @@ int lcseek( LcFHandle fh, size_t off ) {
     return(open_files_array[location].position);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcpartition
+// Description  : Assign the file's blocks to a cache partition
+//
+// Inputs       : fh - the file handle of the file
+//                partition - the cache partition, -1 to go by device
+// Outputs      : 0 if successful, -1 if failure
+
+int lcpartition( LcFHandle fh, int partition ) {
+
+    if ((partition < -1) || (partition >= LC_CACHE_MAXPARTITIONS)) {
+        return(-1);
+    }
+
+    for (int i = 0; i < 256; i++) {  //find the open file with this handle
+        if ((open_files_array[i].handle == fh) && (fh != -1)) {
+            open_files_array[i].partition = partition;
+            return(0);
+        }
+    }
+    return(-1);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcclose
@@ -645,6 +882,7 @@ int lcclose( LcFHandle fh ) {
 
 int lcshutdown( void ) {
     unsigned int b0, b1, c0, c1, c2, d0, d1;
+    lcloud_closecache();  //dirty blocks must reach the devices, and warming must stop, before they power off
     LCloudRegisterFrame frame = create_lcloud_registers(0, 0, LC_POWER_OFF, 0, 0, 0, 0);
     LCloudRegisterFrame rframe = client_lcloud_bus_request(frame, NULL);
     extract_lcloud_registers(rframe, &b0, &b1, &c0, &c1, &c2, &d0, &d1);
@@ -663,7 +901,6 @@ int lcshutdown( void ) {
 
 
 
-    lcloud_closecache();
     logMessage(LcDriverLLevel, "Powered off the LionCloud system.");
     return(0);
 }
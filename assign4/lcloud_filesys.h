@@ -41,6 +41,9 @@ int lcwrite( LcFHandle fh, char *buf, size_t len );
 int lcseek( LcFHandle fh, size_t off );
     // Seek to a specific place in the file
 
+int lcpartition( LcFHandle fh, int partition );
+    // Assign the file's blocks to a cache partition
+
 int lcclose( LcFHandle fh );
     // Close the file
 
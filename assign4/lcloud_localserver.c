@@ -0,0 +1,1627 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_localserver.c
+//  Description    : This is a local stand-in for the LionCloud server.  It
+//                   speaks the register frame protocol of lcloud_network.h
+//                   for the devices of a hardware manifest, keeping each
+//                   device's blocks in one array in memory, and also serves
+//                   the multi-block transfers the prebuilt lcloud_server
+//                   doesn't know.  Socket clients are served by a pool of
+//                   worker threads, each with its own epoll set, so any
+//                   number of clients can be connected at once.  Devices
+//                   can be given a service time model (latency, bandwidth
+//                   and queue depth) in extra manifest columns, to behave
+//                   like slow hardware, a transfer's response going out once
+//                   it is done while the worker gets on with the others,
+//                   and can be kept in sparse files that outlive the server,
+//                   writes acknowledged once synced if asked (group commit).
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Project Includes
+#include <lcloud_controller.h>
+#include <lcloud_network.h>
+#include <lcloud_ring.h>
+
+// Defines
+#define LCLOUD_SERVER_ARGUMENTS "hvl:p:u:s:b:j:w:f:y"
+#define LCLOUD_SERVER_MAXDEVICES 16
+#define LCLOUD_SERVER_WORKERS 4       // Default threads serving the socket clients
+#define LCLOUD_SERVER_MAXWORKERS 64
+#define LCLOUD_SERVER_STATS_EVERY 1000  // Transfers between a device's service time reports
+#define LCLOUD_SERVER_INPUT_MAX (64 * 1024)   // Request bytes read ahead from a client, at least one of the largest
+#define LCLOUD_SERVER_OUTPUT_MAX (256 * 1024) // Response bytes a client can have waiting to go out
+#define LCLOUD_SERVER_BURST 64                // Requests answered per wakeup, before the other clients get a turn
+#define LCLOUD_SERVER_PENDING_MAX 64          // Runs of a client's responses waiting on their service times
+#define LCLOUD_SERVER_EVENTS 64               // Ready sockets a worker takes from its epoll set at once
+#define USAGE                                                                          \
+    "USAGE: lcloud_localserver [-h] [-v] [-l <logfile>] [-p <port>] [-u <socketpath>] [-s <shmname>] [-b <spins>] [-j <percent>:<usec>] [-w <workers>] [-f <directory>] [-y] <hardware-manifest>\n" \
+    "\n"                                                                               \
+    "where:\n"                                                                         \
+    "    -h - help mode (display this message)\n"                                      \
+    "    -v - verbose output\n"                                                        \
+    "    -l - write log messages to the filename <logfile>\n"                          \
+    "    -p - port number to listen on (default 24567)\n"                              \
+    "    -u - listen on the unix domain socket <socketpath> instead of a port\n"        \
+    "    -s - also serve clients over shared memory rings named <shmname>\n"            \
+    "    -b - poll an empty ring <spins> times before sleeping on it\n"                 \
+    "    -j - hold back <percent> of block transfers by <usec> microseconds\n"          \
+    "    -w - serve the socket clients with <workers> threads (default 4)\n"           \
+    "    -f - keep each device in a sparse file in <directory>, kept across runs\n"     \
+    "    -y - acknowledge writes only once they are synced to the files (with -f)\n"   \
+    "\n"                                                                               \
+    "    <hardware-manifest> - file containing the simulated hardware definitions,\n"  \
+    "        lines of <id> <sectors> <blocks> [<latency> [<MB/s> [<queue-depth>]]]\n"   \
+    "        where <latency> is fixed:<usec>, uniform:<min-usec>:<max-usec> or\n"       \
+    "        lognormal:<median-usec>:<sigma>, and \"-\" or 0 leaves a column out\n"      \
+    "\n"
+
+// Type definitions
+typedef enum {
+    LATENCY_NONE = 0,       // Served as fast as memory allows
+    LATENCY_FIXED = 1,      // Always latency_a usec
+    LATENCY_UNIFORM = 2,    // latency_a to latency_b usec
+    LATENCY_LOGNORMAL = 3,  // Median latency_a usec, sigma latency_b
+} LatencyModel;
+
+typedef struct {
+    int num_sectors;        // Geometry from the manifest, 0 if the device doesn't exist
+    int num_blocks;
+    char *data;             // Every block of the device, sector major
+    int fd;                 // The file data is mapped from, -1 if it is only in memory
+    pthread_mutex_t lock;   // Held while blocks are copied in or out
+
+    LatencyModel latency;   // Service time model, from the extra manifest columns
+    double latency_a, latency_b;
+    double bandwidth;       // Bytes per usec the device moves, 0 for no cap
+    int queue_depth;        // Most transfers in service at once, 0 for no limit
+    pthread_mutex_t model_lock;  // Guards the rest
+    uint64_t *slots;        // When each place in the device queue comes free (ns)
+    uint64_t busy_until;    // When the transfers already given the bandwidth are done (ns)
+    uint64_t transfers;     // Service time breakdown, summed (ns)
+    uint64_t queue_ns, latency_ns, transfer_ns;
+} ServerDevice;
+
+typedef struct {
+    uint64_t due;            // When they can go out (ns)
+    size_t len;              // Their bytes
+} ServerResponses;           // A run of a client's responses, going out together
+
+typedef struct {
+    int sock;                // The client socket, or -1 ...
+    LcRingChannel *channel;  // ... for a shared memory ring channel
+    unsigned int seed;       // Jitter draws
+    char *input;             // A socket client's requests read ahead, the last maybe only partly there
+    size_t input_len, input_used;  // Bytes read, and how many of them have been answered
+    char *output;            // A socket client's responses still to go out, NULL for a ring channel
+    size_t output_len, output_due;  // Their bytes, and how many of them are due
+    uint64_t output_commit;  // The commit they wait on, with synced writes
+    ServerResponses pending[LCLOUD_SERVER_PENDING_MAX];  // The rest of them, in the order they go, from pending_first
+    int pending_first, pending_count;
+    int worker;              // The worker serving it
+    uint32_t events;         // What it is watched for in the worker's epoll set
+    int timer_slot;          // Its place in the worker's timer heap, -1 if no response is waiting to be due
+    int commit_slot;         // Its place in the worker's commit list, -1 if its due responses aren't waiting on a commit
+} ServerPeer;
+
+typedef struct {
+    int poller;              // The epoll set of its clients, its timer and the listener
+    int timer;               // A timerfd, set for when the first of its clients' waiting responses is due
+    uint64_t armed;          // When it is set for (ns), 0 if not set
+    ServerPeer **timers;     // The clients with responses waiting to be due, a heap on the first one's due time
+    int timer_count, timer_size;
+    int committed;           // An eventfd, bumped by the commit thread after every commit
+    ServerPeer **commits;    // The clients with due responses waiting on a commit
+    int commit_count, commit_size;
+} ServerWorker;
+
+//
+// Global data
+ServerDevice devices[LCLOUD_SERVER_MAXDEVICES];
+char *ring_name = NULL;  // Removed when the server is stopped
+char *socket_path = NULL;
+int jitter_percent = 0;  // Block transfers held back, to give the clients a latency tail
+int jitter_usec = 0;
+int worker_count = LCLOUD_SERVER_WORKERS;
+ServerWorker workers[LCLOUD_SERVER_MAXWORKERS];
+int next_worker = 0;   // The worker the next client goes to, round robin
+ServerPeer listening;  // Stands for the listener in the epoll sets
+ServerPeer committing; // Stands for a worker's commit eventfd in its epoll set
+char *storage_dir = NULL;  // Where the device files are, NULL to keep the devices in memory
+int sync_writes = 0;       // Acknowledge writes once they are synced
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;  // Group commit, one sync covering every write before it
+pthread_cond_t commit_wanted = PTHREAD_COND_INITIALIZER;  // Wakes the commit thread for new writes
+pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+uint64_t written_seq = 0, synced_seq = 0, failed_seq = 0, commits = 0;  // failed_seq, the last write whose sync failed
+uint32_t dirty_devices = 0;
+
+//
+// Functional Prototypes
+
+int loadManifest( char *manifest ); // Read the device geometry
+char * mapDevice( int id, size_t size ); // Device files
+uint64_t noteWrite( int id ); // Group commit
+void * commitWrites( void *arg ); // Commit thread
+int checkSynced( uint64_t seq );
+int waitSynced( uint64_t seq );
+int respond( ServerPeer *peer, void *buf, size_t len, uint64_t seq, uint64_t due );
+int flushResponses( ServerPeer *peer );
+int serveClients( unsigned short port, char *path ); // Accept connections until killed
+void * serveSockets( void *arg ); // Worker thread
+void acceptClient( void );
+int watchPeer( ServerPeer *peer, int op );
+void closePeer( ServerPeer *peer );
+int timePeer( ServerPeer *peer ); // Responses waiting on service times
+void siftTimer( ServerWorker *worker, int slot );
+void serveTimers( ServerWorker *worker );
+int commitPeer( ServerPeer *peer, int waiting ); // Responses waiting on a commit
+void serveCommits( ServerWorker *worker );
+int serveRings( char *name ); // Serve the channels of a ring segment
+void stopServer( int sig ); // Clean up on a signal
+int sendAll( ServerPeer *peer, void *buf, size_t len ); // Full-length ring I/O, or a socket's buffers
+int receiveAll( ServerPeer *peer, void *buf, size_t len );
+int readRequests( ServerPeer *peer );
+int nextRequest( ServerPeer *peer );
+LCloudRegisterFrame packRegisters( uint64_t b0, uint64_t b1, uint64_t c0, uint64_t c1, uint64_t c2, uint64_t d0, uint64_t d1 ); // Build a response frame
+int serveConnection( ServerPeer *peer, uint32_t events ); // Answer the requests of one client
+void * serveChannel( void *arg );
+int serveRequests( ServerPeer *peer );
+int serveRequest( ServerPeer *peer );
+int transferBlocks( ServerPeer *peer, unsigned int op, unsigned int did, unsigned int dir, unsigned int sec, unsigned int blk, int count, uint64_t arrived ); // Move blocks for a transfer
+int loadModel( ServerDevice *dev, char *columns ); // Device service time model
+uint64_t scheduleService( ServerDevice *dev, ServerPeer *peer, size_t size, uint64_t arrived );
+uint64_t nowNanoseconds( void );
+void sleepUntil( uint64_t when );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the local LionCloud server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+
+    // Local variables
+    int ch, verbose = 0, log_initialized = 0;
+    unsigned short port = LCLOUD_DEFAULT_PORT;
+    char *path = NULL;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_SERVER_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'p': // Port to listen on
+            if ((atoi(optarg) <= 0) || (atoi(optarg) > 65535)) {
+                fprintf(stderr, "Error, bad port number [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            port = atoi(optarg);
+            break;
+
+        case 'u': // Unix domain socket to listen on
+            if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+                fprintf(stderr, "Error, socket path too long [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            path = optarg;
+            break;
+
+        case 's': // Shared memory rings to serve
+            ring_name = optarg;
+            break;
+
+        case 'b': // Ring polling
+            if (lcloud_ring_setpoll(atoi(optarg)) == -1) {
+                fprintf(stderr, "Error, bad polling count [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'j': // Latency jitter
+            if ((sscanf(optarg, "%d:%d", &jitter_percent, &jitter_usec) != 2) || (jitter_percent < 0) || (jitter_percent > 100) || (jitter_usec < 0)) {
+                fprintf(stderr, "Error, bad jitter [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'f': // Device files
+            storage_dir = optarg;
+            break;
+
+        case 'y': // Synced writes
+            sync_writes = 1;
+            break;
+
+        case 'w': // Worker threads
+            if ((atoi(optarg) <= 0) || (atoi(optarg) > LCLOUD_SERVER_MAXWORKERS)) {
+                fprintf(stderr, "Error, bad number of workers [%s], aborting.\n", optarg);
+                return (-1);
+            }
+            worker_count = atoi(optarg);
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+
+    if (sync_writes && (storage_dir == NULL)) {
+        fprintf(stderr, "Error, synced writes (-y) need device files (-f), aborting.\n");
+        return (-1);
+    }
+
+    // The manifest should be the next option
+    if (argv[optind] == NULL) {
+        fprintf(stderr, "Missing manifest file, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+    if (loadManifest(argv[optind]) == -1) {
+        return (-1);
+    }
+
+    // Serve until killed
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    socket_path = path;
+    if ((ring_name != NULL) && (serveRings(ring_name) == -1)) {
+        return (-1);
+    }
+    return (serveClients(port, path));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadManifest
+// Description  : Read the "<id> <sectors> <blocks>" device lines of a hardware
+//                manifest, with any service time model columns after them,
+//                and allocate the (zeroed) devices, or map their files
+//
+// Inputs       : manifest - the manifest filename
+// Outputs      : 0 if successful, -1 if failure
+
+int loadManifest( char *manifest )
+{
+
+    char line[256];
+    int id, sectors, blocks, used, count = 0;
+    FILE *fh = fopen(manifest, "r");
+    if (fh == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the hardware manifest file [%s], error: %s.", manifest, strerror(errno));
+        return (-1);
+    }
+
+    while (fgets(line, sizeof(line), fh) != NULL) {
+
+        if ((line[0] == '#') || (sscanf(line, "%d %d %d%n", &id, &sectors, &blocks, &used) != 3)) {
+            continue;
+        }
+        if ((id < 0) || (id >= LCLOUD_SERVER_MAXDEVICES) || (sectors <= 0) || (sectors > 0xffff) || (blocks <= 0) || (blocks > 0xffff) ||
+            (devices[id].data != NULL) || (loadModel(&devices[id], &line[used]) == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "Bad device in hardware manifest [%s]", line);
+            fclose(fh);
+            return (-1);
+        }
+
+        devices[id].num_sectors = sectors;
+        devices[id].num_blocks = blocks;
+        devices[id].fd = -1;
+        devices[id].data = (storage_dir != NULL) ? mapDevice(id, (size_t)sectors * blocks * LC_DEVICE_BLOCK_SIZE)
+            : calloc((size_t)sectors * blocks, LC_DEVICE_BLOCK_SIZE);
+        if (devices[id].data == NULL) {
+            fclose(fh);
+            return (-1);
+        }
+        pthread_mutex_init(&devices[id].lock, NULL);
+        pthread_mutex_init(&devices[id].model_lock, NULL);
+        count++;
+    }
+
+    fclose(fh);
+    logMessage(LOG_INFO_LEVEL, "LionCloud local server opened manifest [%s], %d devices", manifest, count);
+    return ((count > 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mapDevice
+// Description  : Open (or make) a device's file in the storage directory,
+//                size it to the geometry and map it.  The file is sparse, so
+//                blocks never written take no disk, and what was written in
+//                an earlier run is still there.
+//
+// Inputs       : id - the device
+//                size - its bytes
+// Outputs      : the mapped blocks, NULL if failure
+
+char * mapDevice( int id, size_t size )
+{
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/lcloud-device-%d.dat", storage_dir, id);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if ((fd == -1) || (ftruncate(fd, size) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening device file [%s], error: %s.", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return (NULL);
+    }
+
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Failure mapping device file [%s], error: %s.", path, strerror(errno));
+        close(fd);
+        return (NULL);
+    }
+    devices[id].fd = fd;
+    return (data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadModel
+// Description  : Read the service time model columns of a manifest line,
+//                "[<latency> [<MB/s> [<queue-depth>]]]", where the latency is
+//                "fixed:<usec>", "uniform:<min-usec>:<max-usec>" or
+//                "lognormal:<median-usec>:<sigma>".  A "-" (or 0) leaves a
+//                column out.
+//
+// Inputs       : dev - the device
+//                columns - the rest of the line
+// Outputs      : 0 if successful, -1 if a column is bad
+
+int loadModel( ServerDevice *dev, char *columns )
+{
+
+    char latency[64] = "-", bandwidth[32] = "-", depth[32] = "-";
+    double megabytes = 0;
+
+    dev->latency = LATENCY_NONE;
+    dev->bandwidth = 0;
+    dev->queue_depth = 0;
+    sscanf(columns, "%63s %31s %31s", latency, bandwidth, depth);
+
+    if (sscanf(latency, "fixed:%lf", &dev->latency_a) == 1) {
+        dev->latency = LATENCY_FIXED;
+    }
+    else if (sscanf(latency, "uniform:%lf:%lf", &dev->latency_a, &dev->latency_b) == 2) {
+        dev->latency = LATENCY_UNIFORM;
+    }
+    else if (sscanf(latency, "lognormal:%lf:%lf", &dev->latency_a, &dev->latency_b) == 2) {
+        dev->latency = LATENCY_LOGNORMAL;
+    }
+    else if ((strcmp(latency, "-") != 0) && (strcmp(latency, "0") != 0)) {
+        return (-1);
+    }
+    if ((dev->latency_a < 0) || (dev->latency_b < 0) || ((dev->latency == LATENCY_UNIFORM) && (dev->latency_b < dev->latency_a))) {
+        return (-1);
+    }
+
+    if ((strcmp(bandwidth, "-") != 0) && ((sscanf(bandwidth, "%lf", &megabytes) != 1) || (megabytes < 0))) {
+        return (-1);
+    }
+    dev->bandwidth = megabytes;  // MB/s is bytes per usec
+    if ((strcmp(depth, "-") != 0) && ((sscanf(depth, "%d", &dev->queue_depth) != 1) || (dev->queue_depth < 0))) {
+        return (-1);
+    }
+    if (dev->queue_depth > 0) {
+
+        dev->slots = calloc(dev->queue_depth, sizeof(uint64_t));
+        if (dev->slots == NULL) {
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveClients
+// Description  : Listen on the port, or the unix domain socket, and serve
+//                the clients with the pool of workers.  Each worker has its
+//                own epoll set, with the listener, its timer and its commit
+//                eventfd in it, and the clients are handed out to them in
+//                turn.  With synced writes a commit thread does the syncs.
+//
+// Inputs       : port - the TCP port to listen on
+//                path - the unix domain socket to listen on instead, NULL for TCP
+// Outputs      : -1 if the server could not be started (otherwise never returns)
+
+int serveClients( unsigned short port, char *path )
+{
+
+    struct sockaddr_in address;
+    struct sockaddr_un local;
+    int on = 1;
+    int listener = socket((path != NULL) ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (listener == -1) {
+        logMessage(LOG_ERROR_LEVEL, "LCLOUD socket() create failed : [%s]", strerror(errno));
+        return (-1);
+    }
+
+    int bound;
+    if (path != NULL) {
+
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strncpy(local.sun_path, path, sizeof(local.sun_path) - 1);
+        unlink(path);  // A socket left behind by an earlier run
+        bound = bind(listener, (struct sockaddr *)&local, sizeof(local));
+    }
+    else {
+
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        bound = bind(listener, (struct sockaddr *)&address, sizeof(address));
+    }
+    if (bound == -1) {
+        logMessage(LOG_ERROR_LEVEL, "LCLOUD bind() create failed : [%s]", strerror(errno));
+        return (-1);
+    }
+    if (listen(listener, LCLOUD_MAX_BACKLOG) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "LCLOUD listen() create failed : [%s]", strerror(errno));
+        return (-1);
+    }
+
+    listening.sock = listener;
+    listening.channel = NULL;
+    if (fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK) == -1) {  // Any worker may be woken for a client another takes
+        logMessage(LOG_ERROR_LEVEL, "LCLOUD listener setup failed : [%s]", strerror(errno));
+        return (-1);
+    }
+    for (int i = 0; i < worker_count; i++) {
+
+        struct epoll_event listen_event = { EPOLLIN | EPOLLEXCLUSIVE, { .ptr = &listening } };
+        struct epoll_event timer_event = { EPOLLIN, { .ptr = NULL } };
+        struct epoll_event commit_event = { EPOLLIN, { .ptr = &committing } };
+        workers[i].poller = epoll_create1(0);
+        workers[i].timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        workers[i].committed = eventfd(0, EFD_NONBLOCK);
+        if ((workers[i].poller == -1) || (workers[i].timer == -1) || (workers[i].committed == -1) || (epoll_ctl(workers[i].poller, EPOLL_CTL_ADD, listener, &listen_event) == -1) ||
+            (epoll_ctl(workers[i].poller, EPOLL_CTL_ADD, workers[i].timer, &timer_event) == -1) ||
+            (epoll_ctl(workers[i].poller, EPOLL_CTL_ADD, workers[i].committed, &commit_event) == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "LCLOUD epoll create failed : [%s]", strerror(errno));
+            return (-1);
+        }
+    }
+
+    pthread_t threads[LCLOUD_SERVER_MAXWORKERS];
+    if (sync_writes && (pthread_create(&threads[0], NULL, commitWrites, NULL) != 0)) {  // Workers never wait on a sync
+        logMessage(LOG_ERROR_LEVEL, "LCLOUD commit thread create failed : [%s]", strerror(errno));
+        return (-1);
+    }
+    for (int i = 1; i < worker_count; i++) {
+        if (pthread_create(&threads[i], NULL, serveSockets, &workers[i]) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "LCLOUD worker thread create failed : [%s]", strerror(errno));
+            return (-1);
+        }
+    }
+    logMessage(LOG_INFO_LEVEL, "LionCloud local server serving clients with %d workers", worker_count);
+    serveSockets(&workers[0]);  // This thread is a worker too
+    return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveSockets
+// Description  : A worker, serving whichever of its clients are ready.  A
+//                client only ever has the one worker, so its requests are
+//                answered in order.  A ready listener takes a new client, a
+//                ready client has the requests it has sent in full answered
+//                (a burst at most), and the clients whose responses have
+//                come due, or whose commit is done, have them sent.  Client
+//                sockets don't block, and neither modelled service times nor
+//                syncs are waited out, so a client that is slow to send or to
+//                read, or a slow device, only holds a worker for what is ready.
+//
+// Inputs       : arg - the worker
+// Outputs      : NULL (never returns)
+
+void * serveSockets( void *arg )
+{
+
+    ServerWorker *worker = arg;
+    struct epoll_event events[LCLOUD_SERVER_EVENTS];
+
+    while (1) {
+
+        int ready = epoll_wait(worker->poller, events, LCLOUD_SERVER_EVENTS, -1);
+        for (int i = 0; i < ready; i++) {
+
+            ServerPeer *peer = events[i].data.ptr;
+            uint64_t expirations;
+            if (peer == NULL) {  // The timer, the clients it is for are seen to below
+                if (read(worker->timer, &expirations, sizeof(expirations)) == -1) {
+                    continue;
+                }
+            }
+            else if (peer == &listening) {
+                acceptClient();
+            }
+            else if (peer == &committing) {
+                if (read(worker->committed, &expirations, sizeof(expirations)) == 8) {
+                    serveCommits(worker);
+                }
+            }
+            else {
+                serveConnection(peer, events[i].events);
+            }
+        }
+        serveTimers(worker);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : acceptClient
+// Description  : Take a new client from the listener, and give it to the
+//                next worker in turn
+//
+// Inputs       : none
+// Outputs      : none
+
+void acceptClient( void )
+{
+
+    int client = accept(listening.sock, NULL, NULL);
+    if (client == -1) {  // Another worker took it
+        return;
+    }
+    if (fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) == -1) {  //a worker never waits on one client
+        close(client);
+        return;
+    }
+    int nodelay = 1;  //responses are small and answered at once, don't hold them back
+    if (socket_path == NULL) {
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    ServerPeer *peer = calloc(1, sizeof(ServerPeer));
+    if (peer == NULL) {
+        close(client);
+        return;
+    }
+    peer->sock = client;
+    peer->seed = (unsigned int)client ^ (unsigned int)time(NULL);
+    peer->worker = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % worker_count;
+    peer->timer_slot = -1;
+    peer->commit_slot = -1;
+    peer->input = malloc(LCLOUD_SERVER_INPUT_MAX);
+    peer->output = malloc(LCLOUD_SERVER_OUTPUT_MAX);
+    if ((peer->input == NULL) || (peer->output == NULL) || (watchPeer(peer, EPOLL_CTL_ADD) == -1)) {
+        close(client);
+        free(peer->input);
+        free(peer->output);
+        free(peer);
+        return;
+    }
+    logMessage(LOG_INFO_LEVEL, "LCloud server new client connection [%d]", client);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : watchPeer
+// Description  : Watch a client for what it is waiting on next, in its
+//                worker's epoll set and timer heap: more requests while
+//                there is room to read them, room to send while responses
+//                are due (and not waiting on a commit), and the next of its
+//                waiting responses coming due.
+//                One left with requests to answer (after a burst) is woken
+//                again straight away, behind the clients already ready.
+//
+// Inputs       : peer - the client
+//                op - EPOLL_CTL_ADD or EPOLL_CTL_MOD
+// Outputs      : 0 if successful, -1 if failure
+
+int watchPeer( ServerPeer *peer, int op )
+{
+
+    struct epoll_event event;
+    event.events = 0;
+    if (peer->input_len < LCLOUD_SERVER_INPUT_MAX) {
+        event.events |= EPOLLIN;
+    }
+    if (((peer->output_due > 0) && (peer->commit_slot == -1)) || (nextRequest(peer) == 1)) {  // A socket is writable while it has room
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = peer;
+
+    if ((op == EPOLL_CTL_ADD) || (event.events != peer->events)) {
+
+        if (epoll_ctl(workers[peer->worker].poller, op, peer->sock, &event) == -1) {
+            return (-1);
+        }
+        peer->events = event.events;
+    }
+    return (timePeer(peer));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : closePeer
+// Description  : Close a socket client, and free it
+//
+// Inputs       : peer - the client
+// Outputs      : none
+
+void closePeer( ServerPeer *peer )
+{
+
+    peer->pending_count = 0;  // Out of the timer heap and the commit list
+    timePeer(peer);
+    commitPeer(peer, 0);
+
+    logMessage(LOG_INFO_LEVEL, "LClouid server closing client connection [%d]", peer->sock);
+    close(peer->sock);  // Also takes it out of the epoll set
+    free(peer->input);
+    free(peer->output);
+    free(peer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : timePeer
+// Description  : Put a client in its worker's timer heap by when the first
+//                of its waiting responses is due, or take it out if none are
+//                waiting
+//
+// Inputs       : peer - the client
+// Outputs      : 0 if successful, -1 if failure
+
+int timePeer( ServerPeer *peer )
+{
+
+    ServerWorker *worker = &workers[peer->worker];
+    if ((peer->pending_count == 0) && (peer->timer_slot == -1)) {
+        return (0);
+    }
+    if (peer->pending_count == 0) {  // The last client in the heap takes its place
+
+        int slot = peer->timer_slot;
+        peer->timer_slot = -1;
+        worker->timer_count -= 1;
+        if (slot < worker->timer_count) {
+
+            worker->timers[slot] = worker->timers[worker->timer_count];
+            siftTimer(worker, slot);
+        }
+        return (0);
+    }
+
+    if (peer->timer_slot == -1) {
+
+        if (worker->timer_count == worker->timer_size) {
+
+            int size = (worker->timer_size > 0) ? worker->timer_size * 2 : LCLOUD_SERVER_EVENTS;
+            ServerPeer **timers = realloc(worker->timers, size * sizeof(ServerPeer *));
+            if (timers == NULL) {
+                return (-1);
+            }
+            worker->timers = timers;
+            worker->timer_size = size;
+        }
+        peer->timer_slot = worker->timer_count;
+        worker->timers[worker->timer_count++] = peer;
+    }
+    siftTimer(worker, peer->timer_slot);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : siftTimer
+// Description  : Move a client up or down the timer heap to its place, the
+//                earliest due at the top
+//
+// Inputs       : worker - the worker
+//                slot - where the client is now
+// Outputs      : none
+
+void siftTimer( ServerWorker *worker, int slot )
+{
+
+    ServerPeer **timers = worker->timers;
+    ServerPeer *peer = timers[slot];
+    uint64_t due = peer->pending[peer->pending_first].due;
+
+    while (slot > 0) {  // Up, past the later ones above it
+
+        ServerPeer *parent = timers[(slot - 1) / 2];
+        if (parent->pending[parent->pending_first].due <= due) {
+            break;
+        }
+        timers[slot] = parent;
+        parent->timer_slot = slot;
+        slot = (slot - 1) / 2;
+    }
+    while (2 * slot + 1 < worker->timer_count) {  // Down, past the earlier ones below it
+
+        int child = 2 * slot + 1;
+        if ((child + 1 < worker->timer_count) &&
+            (timers[child + 1]->pending[timers[child + 1]->pending_first].due < timers[child]->pending[timers[child]->pending_first].due)) {
+            child += 1;
+        }
+        if (timers[child]->pending[timers[child]->pending_first].due >= due) {
+            break;
+        }
+        timers[slot] = timers[child];
+        timers[slot]->timer_slot = slot;
+        slot = child;
+    }
+    timers[slot] = peer;
+    peer->timer_slot = slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveTimers
+// Description  : Serve the worker's clients whose waiting responses have come
+//                due, then set the timer for the next one
+//
+// Inputs       : worker - the worker
+// Outputs      : none
+
+void serveTimers( ServerWorker *worker )
+{
+
+    uint64_t now = nowNanoseconds();
+    while ((worker->timer_count > 0) && (worker->timers[0]->pending[worker->timers[0]->pending_first].due <= now)) {
+        serveConnection(worker->timers[0], 0);  // Its responses go, and it leaves the top
+    }
+
+    uint64_t next = (worker->timer_count > 0) ? worker->timers[0]->pending[worker->timers[0]->pending_first].due : 0;
+    if (next != worker->armed) {
+
+        struct itimerspec when = { { 0, 0 }, { next / 1000000000, next % 1000000000 } };  // 0 disarms it
+        timerfd_settime(worker->timer, TFD_TIMER_ABSTIME, &when, NULL);
+        worker->armed = next;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commitPeer
+// Description  : Put a client in its worker's list of clients whose due
+//                responses wait on a commit, or take it out
+//
+// Inputs       : peer - the client
+//                waiting - 1 if its responses wait on a commit, 0 if not
+// Outputs      : 0 if successful, -1 if failure
+
+int commitPeer( ServerPeer *peer, int waiting )
+{
+
+    ServerWorker *worker = &workers[peer->worker];
+    if ((waiting == 0) && (peer->commit_slot != -1)) {  // The last client in the list takes its place
+
+        worker->commit_count -= 1;
+        worker->commits[peer->commit_slot] = worker->commits[worker->commit_count];
+        worker->commits[peer->commit_slot]->commit_slot = peer->commit_slot;
+        peer->commit_slot = -1;
+    }
+    else if ((waiting == 1) && (peer->commit_slot == -1)) {
+
+        if (worker->commit_count == worker->commit_size) {
+
+            int size = (worker->commit_size > 0) ? worker->commit_size * 2 : LCLOUD_SERVER_EVENTS;
+            ServerPeer **commits = realloc(worker->commits, size * sizeof(ServerPeer *));
+            if (commits == NULL) {
+                return (-1);
+            }
+            worker->commits = commits;
+            worker->commit_size = size;
+        }
+        peer->commit_slot = worker->commit_count;
+        worker->commits[worker->commit_count++] = peer;
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveCommits
+// Description  : Serve the worker's clients whose responses were waiting on
+//                a commit that is now done (or failed), after the commit
+//                thread bumps the worker's eventfd
+//
+// Inputs       : worker - the worker
+// Outputs      : none
+
+void serveCommits( ServerWorker *worker )
+{
+
+    for (int slot = worker->commit_count - 1; slot >= 0; slot--) {  // Clients put back go on the end, behind this walk
+
+        ServerPeer *peer = worker->commits[slot];
+        if (checkSynced(peer->output_commit) != 0) {
+
+            commitPeer(peer, 0);
+            serveConnection(peer, 0);  // Its responses go, or it is closed
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveRings
+// Description  : Make the shared memory ring segment and serve each of its
+//                channels on its own thread
+//
+// Inputs       : name - the POSIX shared memory name
+// Outputs      : 0 if successful, -1 if failure
+
+int serveRings( char *name )
+{
+
+    LcRingSegment *segment = lcloud_ring_create(name);
+    if (segment == NULL) {
+        return (-1);
+    }
+
+    for (int i = 0; i < LCLOUD_RING_CHANNELS; i++) {
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveChannel, &segment->channel[i]) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "LCLOUD ring channel thread create failed : [%s]", strerror(errno));
+            lcloud_ring_destroy(segment, name);
+            return (-1);
+        }
+        pthread_detach(thread);
+    }
+    logMessage(LOG_INFO_LEVEL, "LionCloud local server serving %d ring channels [%s]", LCLOUD_RING_CHANNELS, name);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopServer
+// Description  : Remove the ring segment and the unix domain socket when the
+//                server is stopped
+//
+// Inputs       : sig - the signal
+// Outputs      : none (exits)
+
+void stopServer( int sig )
+{
+
+    if (ring_name != NULL) {
+        shm_unlink(ring_name);
+    }
+    if (socket_path != NULL) {
+        unlink(socket_path);
+    }
+    _exit(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sendAll
+// Description  : Write the whole buffer to the client, a socket client's
+//                going into its output, to be sent as the client takes it
+//
+// Inputs       : peer - the client socket or ring channel
+//                buf - the bytes to send
+//                len - how many
+// Outputs      : 0 if successful, -1 if failure
+
+int sendAll( ServerPeer *peer, void *buf, size_t len )
+{
+
+    if (peer->channel != NULL) {
+        return (lcloud_ring_write(&peer->channel->responses, buf, len));
+    }
+
+    if (peer->output_len + len > LCLOUD_SERVER_OUTPUT_MAX) {  // Only answered with room for the response
+        return (-1);
+    }
+    memcpy(peer->output + peer->output_len, buf, len);
+    peer->output_len += len;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : receiveAll
+// Description  : Read exactly len bytes from the client, a socket client's
+//                from the requests already read from it
+//
+// Inputs       : peer - the client socket or ring channel
+//                buf - place for the bytes
+//                len - how many
+// Outputs      : 0 if successful, -1 if failure or the client went away
+
+int receiveAll( ServerPeer *peer, void *buf, size_t len )
+{
+
+    if (peer->channel != NULL) {
+        return (lcloud_ring_read(&peer->channel->requests, buf, len));
+    }
+
+    if (peer->input_len - peer->input_used < len) {  // Only answered once it is all there
+        return (-1);
+    }
+    memcpy(buf, peer->input + peer->input_used, len);
+    peer->input_used += len;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readRequests
+// Description  : Read what a socket client has sent, as far as there is room
+//                for it, without waiting for more
+//
+// Inputs       : peer - the client
+// Outputs      : 0 if successful, -1 if failure or the client went away
+
+int readRequests( ServerPeer *peer )
+{
+
+    while (peer->input_len < LCLOUD_SERVER_INPUT_MAX) {
+
+        ssize_t n = read(peer->sock, peer->input + peer->input_len, LCLOUD_SERVER_INPUT_MAX - peer->input_len);
+        if ((n == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if ((n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        }
+        if (n <= 0) {
+            return (-1);
+        }
+        peer->input_len += n;
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : nextRequest
+// Description  : Check whether a socket client's next request has been read
+//                in full, its frame and any write payload, and its response
+//                has room to wait in
+//
+// Inputs       : peer - the client
+// Outputs      : 1 if it can be answered, 0 if not
+
+int nextRequest( ServerPeer *peer )
+{
+
+    LCloudRegisterFrame frame;
+    if (peer->input_len - peer->input_used < LCLOUD_NET_HEADER_SIZE) {
+        return (0);
+    }
+    memcpy(&frame, peer->input + peer->input_used, LCLOUD_NET_HEADER_SIZE);
+    frame = ntohll64(frame);
+
+    unsigned int c0 = (frame >> 48) & 0xff, c2 = (frame >> 32) & 0xff;
+    size_t size = 0;
+    if ((c0 == LC_BLOCK_XFER) || (c0 == LC_BLOCK_XFER_MULTI)) {
+        size = (size_t)((c0 == LC_BLOCK_XFER) ? 1 : (c2 >> LC_XFER_COUNT_SHIFT) + 1) * LC_DEVICE_BLOCK_SIZE;
+    }
+    size_t reply = LCLOUD_NET_HEADER_SIZE + (((c2 & 1) == LC_XFER_READ) ? size : 0);
+    return ((peer->input_len - peer->input_used >= LCLOUD_NET_HEADER_SIZE + (((c2 & 1) == LC_XFER_WRITE) ? size : 0)) &&
+        (peer->output_len + reply <= LCLOUD_SERVER_OUTPUT_MAX) && (peer->pending_count < LCLOUD_SERVER_PENDING_MAX));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packRegisters
+// Description  : Pack the registers of a response frame, in the layout given
+//                in lcloud_controller.h
+//
+// Inputs       : b0 thru d1 - the register values
+// Outputs      : the packed frame
+
+LCloudRegisterFrame packRegisters( uint64_t b0, uint64_t b1, uint64_t c0, uint64_t c1, uint64_t c2, uint64_t d0, uint64_t d1 )
+{
+
+    return ((b0 << 60) | (b1 << 56) | (c0 << 48) | (c1 << 40) | (c2 << 32) | (d0 << 16) | d1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveConnection
+// Description  : Answer the requests a socket client has sent in full, a
+//                burst at most, and while its responses have room to wait
+//                in, closing the client if it has disconnected.  A partly
+//                sent request waits for the rest.  The responses that are
+//                due go out together, as far as the client takes them, and
+//                with synced writes after one commit.
+//
+// Inputs       : peer - the client
+//                events - what its socket is ready for, 0 if woken for its responses
+// Outputs      : 0 if the client is still there, -1 if it was closed
+
+int serveConnection( ServerPeer *peer, uint32_t events )
+{
+
+    int result = (((events & (EPOLLERR | EPOLLHUP)) == 0) && (flushResponses(peer) == 0) && (readRequests(peer) == 0)) ? 0 : -1;
+    for (int served = 0; (result == 0) && (served < LCLOUD_SERVER_BURST) && (nextRequest(peer) == 1); served++) {
+        result = serveRequest(peer);
+    }
+    memmove(peer->input, peer->input + peer->input_used, peer->input_len - peer->input_used);  // Any partial request to the front
+    peer->input_len -= peer->input_used;
+    peer->input_used = 0;
+
+    if ((result == -1) || (flushResponses(peer) == -1) || (watchPeer(peer, EPOLL_CTL_MOD) == -1)) {  // Gone, or its responses couldn't be sent
+        closePeer(peer);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveChannel
+// Description  : Answer the requests on a ring channel, client after client.
+//                Once a client hangs up (or dies) the channel is reset for
+//                the next one.
+//
+// Inputs       : arg - the ring channel
+// Outputs      : NULL (never returns)
+
+void * serveChannel( void *arg )
+{
+
+    ServerPeer peer = { -1, (LcRingChannel *)arg, (unsigned int)(uintptr_t)arg ^ (unsigned int)time(NULL) };
+
+    prctl(PR_SET_TIMERSLACK, 1);  // Modelled device latencies are slept to the microsecond
+
+    while (1) {
+
+        serveRequests(&peer);
+        logMessage(LOG_INFO_LEVEL, "LClouid server resetting ring channel [%p]", arg);
+        lcloud_ring_reset(peer.channel);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveRequests
+// Description  : Answer the requests of one client until it disconnects
+//
+// Inputs       : peer - the client socket or ring channel
+// Outputs      : 0 once the client is gone
+
+int serveRequests( ServerPeer *peer )
+{
+
+    while (serveRequest(peer) == 0) {
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serveRequest
+// Description  : Answer the next request of a client.  Every response echoes
+//                the request with B0 set, and B1 set if the request
+//                succeeded.  With jitter on, some block transfers are held
+//                back, reaching their device later.
+//
+// Inputs       : peer - the client socket or ring channel
+// Outputs      : 0 if successful, -1 if the client is gone (or failed)
+
+int serveRequest( ServerPeer *peer )
+{
+
+    LCloudRegisterFrame frame;
+
+    if (receiveAll(peer, &frame, LCLOUD_NET_HEADER_SIZE) == -1) {
+        return (-1);
+    }
+
+    frame = ntohll64(frame);
+    unsigned int c0 = (frame >> 48) & 0xff, c1 = (frame >> 40) & 0xff, c2 = (frame >> 32) & 0xff;
+    unsigned int d0 = (frame >> 16) & 0xffff, d1 = frame & 0xffff;
+    int ok = 0;
+
+    switch (c0) {
+    case LC_POWER_ON:
+    case LC_POWER_OFF:
+        ok = 1;
+        break;
+
+    case LC_DEVPROBE: // Bit mask of the devices
+        d0 = 0;
+        for (int did = 0; did < LCLOUD_SERVER_MAXDEVICES; did++) {
+            d0 |= (devices[did].data != NULL) ? (1 << did) : 0;
+        }
+        ok = 1;
+        break;
+
+    case LC_DEVINIT: // Geometry of a device
+        if ((c1 < LCLOUD_SERVER_MAXDEVICES) && (devices[c1].data != NULL)) {
+            d0 = devices[c1].num_sectors;
+            d1 = devices[c1].num_blocks;
+            ok = 1;
+        }
+        break;
+
+    case LC_BLOCK_XFER: // One block, or a run of them, answered with the data
+    case LC_BLOCK_XFER_MULTI:
+        ok = transferBlocks(peer, c0, c1, c2 & 1, d0, d1, (c0 == LC_BLOCK_XFER) ? 1 : (c2 >> LC_XFER_COUNT_SHIFT) + 1,
+            ((jitter_percent > 0) && ((int)(rand_r(&peer->seed) % 100) < jitter_percent)) ? nowNanoseconds() + (uint64_t)jitter_usec * 1000 : 0);
+        break;
+    }
+
+    if ((c0 != LC_BLOCK_XFER) && (c0 != LC_BLOCK_XFER_MULTI)) {
+
+        LCloudRegisterFrame response = htonll64(packRegisters(1, ok, c0, c1, c2, d0, d1));
+        ok = (respond(peer, &response, LCLOUD_NET_HEADER_SIZE, 0, 0) == 0) ? ok : -1;
+    }
+    if (ok == -1) {
+        return (-1);
+    }
+    logMessage(LOG_INFO_LEVEL, "LC transfer [%u] completed %s (dev=%d, sec=%d, blk=%d ).", c0, (ok == 1) ? "successfully" : "unsuccessfully", c1, d0, d1);
+
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transferBlocks
+// Description  : Carry out a block transfer and send its response.  A run of
+//                blocks continues into the next sector after the last block
+//                of a sector.  Write payloads are always consumed, even for a
+//                bad request, so the connection stays in step.  A failed
+//                multi-block read sends no data, as a server that doesn't
+//                know the operation wouldn't either.  The response goes out
+//                together with its data, in one send.  The blocks move at
+//                once, but the response of a good transfer is due only once
+//                the device's modelled service time is over, and with synced
+//                writes a write isn't acknowledged until it is on disk.
+//
+// Inputs       : peer - the client socket or ring channel
+//                op - the operation, echoed in the response
+//                did - the device
+//                dir - LC_XFER_READ or LC_XFER_WRITE
+//                sec, blk - the first block
+//                count - the number of blocks
+//                arrived - when it reaches the device (ns), 0 for now
+// Outputs      : 1 if successful, 0 if the request was bad, -1 if the connection failed
+
+int transferBlocks( ServerPeer *peer, unsigned int op, unsigned int did, unsigned int dir, unsigned int sec, unsigned int blk, int count, uint64_t arrived )
+{
+
+    char reply[LCLOUD_NET_HEADER_SIZE + LC_XFER_MAXBLOCKS * LC_DEVICE_BLOCK_SIZE];  //response frame, then the data
+    char *payload = &reply[LCLOUD_NET_HEADER_SIZE];
+    size_t size = (size_t)count * LC_DEVICE_BLOCK_SIZE;
+    ServerDevice *dev = (did < LCLOUD_SERVER_MAXDEVICES) ? &devices[did] : NULL;
+    int ok = (dev != NULL) && (dev->data != NULL) && (sec < (unsigned int)dev->num_sectors) && (blk < (unsigned int)dev->num_blocks) &&
+        ((size_t)sec * dev->num_blocks + blk + count <= (size_t)dev->num_sectors * dev->num_blocks);
+    char *first = (ok == 1) ? &dev->data[((size_t)sec * dev->num_blocks + blk) * LC_DEVICE_BLOCK_SIZE] : NULL;
+
+    if ((dir == LC_XFER_WRITE) && (receiveAll(peer, payload, size) == -1)) {
+        return (-1);
+    }
+    uint64_t due = arrived;
+    if (ok == 1) {
+
+        due = scheduleService(dev, peer, size, arrived);
+        pthread_mutex_lock(&dev->lock);
+        if (dir == LC_XFER_WRITE) {
+            memcpy(first, payload, size);
+        }
+        else {
+            memcpy(payload, first, size);
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+    else if (dir == LC_XFER_READ) {
+        memset(payload, 0, size);
+    }
+
+    uint64_t seq = ((ok == 1) && (dir == LC_XFER_WRITE)) ? noteWrite(did) : 0;
+    LCloudRegisterFrame response = htonll64(packRegisters(1, ok, op, did, dir | ((count - 1) << LC_XFER_COUNT_SHIFT), sec, blk));
+    memcpy(reply, &response, LCLOUD_NET_HEADER_SIZE);
+    if (respond(peer, reply, LCLOUD_NET_HEADER_SIZE + (((dir == LC_XFER_READ) && ((ok == 1) || (op == LC_BLOCK_XFER))) ? size : 0), seq, due) == -1) {  //the client reads a single block regardless
+        return (-1);
+    }
+    return (ok);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scheduleService
+// Description  : Put a transfer through the device's service time model,
+//                working out when it is done rather than waiting for it: it
+//                takes the first place in the device queue to come free,
+//                then the device latency, then moves its bytes at the
+//                device bandwidth (after the transfers ahead of it).  The
+//                time spent in each is added to the device's breakdown.
+//
+// Inputs       : dev - the device
+//                peer - the client, for its random draws
+//                size - the bytes transferred
+//                arrived - when it reaches the device (ns), 0 for now
+// Outputs      : when it is done (ns), arrived if the device has no model
+
+uint64_t scheduleService( ServerDevice *dev, ServerPeer *peer, size_t size, uint64_t arrived )
+{
+
+    if ((dev->latency == LATENCY_NONE) && (dev->bandwidth == 0) && (dev->queue_depth == 0)) {
+        return (arrived);
+    }
+    arrived = (arrived == 0) ? nowNanoseconds() : arrived;
+
+    double usec = 0;
+    double u1 = (rand_r(&peer->seed) + 1.0) / (RAND_MAX + 2.0), u2 = (rand_r(&peer->seed) + 1.0) / (RAND_MAX + 2.0);
+    switch (dev->latency) {
+    case LATENCY_NONE:
+        break;
+    case LATENCY_FIXED:
+        usec = dev->latency_a;
+        break;
+    case LATENCY_UNIFORM:
+        usec = dev->latency_a + (dev->latency_b - dev->latency_a) * u1;
+        break;
+    case LATENCY_LOGNORMAL:  // Box-Muller for the normal draw
+        usec = dev->latency_a * exp(dev->latency_b * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+        break;
+    }
+
+    pthread_mutex_lock(&dev->model_lock);
+    int slot = 0;
+    for (int i = 1; i < dev->queue_depth; i++) {  // The place that comes free first
+        slot = (dev->slots[i] < dev->slots[slot]) ? i : slot;
+    }
+    uint64_t started = ((dev->queue_depth > 0) && (dev->slots[slot] > arrived)) ? dev->slots[slot] : arrived;
+    uint64_t reached = started + (uint64_t)(usec * 1000);
+
+    uint64_t done = reached;
+    if (dev->bandwidth > 0) {  // The bytes go after those already being moved
+
+        done = ((dev->busy_until > reached) ? dev->busy_until : reached) + (uint64_t)(size * 1000 / dev->bandwidth);
+        dev->busy_until = done;
+    }
+    if (dev->queue_depth > 0) {
+        dev->slots[slot] = done;
+    }
+
+    dev->transfers += 1;
+    dev->queue_ns += started - arrived;
+    dev->latency_ns += reached - started;
+    dev->transfer_ns += done - reached;
+    if (dev->transfers % LCLOUD_SERVER_STATS_EVERY == 0) {
+        logMessage(LOG_INFO_LEVEL, "LionCloud device %d service time over %lu transfers: queue %.1f us, latency %.1f us, transfer %.1f us (mean)",
+            (int)(dev - devices), (unsigned long)dev->transfers, dev->queue_ns / 1000.0 / dev->transfers,
+            dev->latency_ns / 1000.0 / dev->transfers, dev->transfer_ns / 1000.0 / dev->transfers);
+    }
+    pthread_mutex_unlock(&dev->model_lock);
+
+    return (done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : nowNanoseconds
+// Description  : Read the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time (ns)
+
+uint64_t nowNanoseconds( void )
+{
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sleepUntil
+// Description  : Sleep until a time on the monotonic clock, if it is still
+//                to come
+//
+// Inputs       : when - the time (ns)
+// Outputs      : none
+
+void sleepUntil( uint64_t when )
+{
+
+    struct timespec until = { when / 1000000000, when % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : noteWrite
+// Description  : Count a write to a device file towards the next commit
+//
+// Inputs       : id - the device written
+// Outputs      : the write's sequence number, to wait on, 0 if writes aren't synced
+
+uint64_t noteWrite( int id )
+{
+
+    if (!sync_writes) {
+        return (0);
+    }
+
+    pthread_mutex_lock(&commit_lock);
+    dirty_devices |= (1 << id);
+    uint64_t seq = ++written_seq;
+    pthread_cond_signal(&commit_wanted);
+    pthread_mutex_unlock(&commit_lock);
+    return (seq);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commitWrites
+// Description  : The commit thread.  It syncs every device written since the
+//                last commit, so one fdatasync per file covers all the writes
+//                that came in while the one before it ran, then wakes the
+//                ring channels and the workers waiting on it.  A failed sync
+//                fails the writes it covered, and its devices are tried
+//                again with the next writes.
+//
+// Inputs       : arg - unused
+// Outputs      : NULL (never returns)
+
+void * commitWrites( void *arg )
+{
+
+    uint64_t tried_seq = 0;  // The last write a sync was tried for
+    pthread_mutex_lock(&commit_lock);
+    while (1) {
+
+        while (written_seq == tried_seq) {
+            pthread_cond_wait(&commit_wanted, &commit_lock);
+        }
+        uint64_t target = written_seq;  // Everything written so far rides on this sync
+        uint32_t dirty = dirty_devices;
+        dirty_devices = 0;
+        pthread_mutex_unlock(&commit_lock);
+
+        int result = 0;
+        for (int id = 0; id < LCLOUD_SERVER_MAXDEVICES; id++) {
+            if ((dirty & (1 << id)) && (fdatasync(devices[id].fd) == -1)) {
+                logMessage(LOG_ERROR_LEVEL, "Failure syncing device %d, error: %s.", id, strerror(errno));
+                result = -1;
+            }
+        }
+
+        pthread_mutex_lock(&commit_lock);
+        tried_seq = target;
+        if (result == 0) {
+
+            synced_seq = target;
+            commits += 1;
+            if (commits % LCLOUD_SERVER_STATS_EVERY == 0) {
+                logMessage(LOG_INFO_LEVEL, "LionCloud group commit: %lu writes in %lu commits", (unsigned long)synced_seq, (unsigned long)commits);
+            }
+        }
+        else {
+            failed_seq = target;
+            dirty_devices |= dirty;  // Tried again with the next writes
+        }
+        pthread_cond_broadcast(&commit_done);
+        pthread_mutex_unlock(&commit_lock);
+
+        uint64_t bump = 1;
+        for (int i = 0; i < worker_count; i++) {
+            if (write(workers[i].committed, &bump, sizeof(bump)) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "LCLOUD commit wakeup failed : [%s]", strerror(errno));
+            }
+        }
+        pthread_mutex_lock(&commit_lock);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkSynced
+// Description  : Check, without waiting, whether a write is on disk
+//
+// Inputs       : seq - the write's sequence number
+// Outputs      : 1 if it is, 0 if its commit isn't done yet, -1 if its sync failed
+
+int checkSynced( uint64_t seq )
+{
+
+    pthread_mutex_lock(&commit_lock);
+    int result = (synced_seq >= seq) ? 1 : ((failed_seq >= seq) ? -1 : 0);
+    pthread_mutex_unlock(&commit_lock);
+    return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : waitSynced
+// Description  : Wait until a write is on disk, for a ring channel's thread
+//
+// Inputs       : seq - the write's sequence number
+// Outputs      : 0 if successful, -1 if the sync failed
+
+int waitSynced( uint64_t seq )
+{
+
+    pthread_mutex_lock(&commit_lock);
+    while ((synced_seq < seq) && (failed_seq < seq)) {
+        pthread_cond_wait(&commit_done, &commit_lock);
+    }
+    int result = (synced_seq >= seq) ? 0 : -1;
+    pthread_mutex_unlock(&commit_lock);
+
+    return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : respond
+// Description  : Send a response, once it is due.  A socket client's waits
+//                in its output, behind the responses before it and held
+//                back until the commit it acknowledges, while its worker
+//                gets on with other work.  A ring channel's thread waits for
+//                the write to be synced and the response to be due.
+//
+// Inputs       : peer - the client
+//                buf, len - the response, with any data
+//                seq - the write it acknowledges, 0 if none
+//                due - when it can go (ns), 0 for at once
+// Outputs      : 0 if successful, -1 if failure
+
+int respond( ServerPeer *peer, void *buf, size_t len, uint64_t seq, uint64_t due )
+{
+
+    if (peer->output != NULL) {
+
+        if (sendAll(peer, buf, len) == -1) {
+            return (-1);
+        }
+        peer->output_commit = (seq > peer->output_commit) ? seq : peer->output_commit;
+
+        int last = (peer->pending_first + peer->pending_count - 1) % LCLOUD_SERVER_PENDING_MAX;
+        if ((peer->pending_count == 0) && ((due == 0) || (due <= nowNanoseconds()))) {
+            peer->output_due += len;
+        }
+        else if ((peer->pending_count > 0) && (due <= peer->pending[last].due)) {  // Goes with the run ahead of it
+            peer->pending[last].len += len;
+        }
+        else {  // Only answered with room for a run of its own
+
+            last = (peer->pending_first + peer->pending_count++) % LCLOUD_SERVER_PENDING_MAX;
+            peer->pending[last].due = due;
+            peer->pending[last].len = len;
+        }
+        return (0);
+    }
+
+    if ((seq > 0) && (waitSynced(seq) == -1)) {
+        return (-1);
+    }
+    if (due > 0) {
+        sleepUntil(due);
+    }
+    return (sendAll(peer, buf, len));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushResponses
+// Description  : Send a socket client's responses that are due, once the
+//                writes they acknowledge are synced, as far as the client
+//                takes them without waiting.  The rest go once it has read
+//                some, or once they are due, and if the commit isn't done
+//                the client waits for it in its worker's commit list.
+//
+// Inputs       : peer - the client
+// Outputs      : 0 if successful, -1 if failure
+
+int flushResponses( ServerPeer *peer )
+{
+
+    if ((peer->output == NULL) || (peer->output_len == 0)) {
+        return (0);
+    }
+    uint64_t now = (peer->pending_count > 0) ? nowNanoseconds() : 0;
+    while ((peer->pending_count > 0) && (peer->pending[peer->pending_first].due <= now)) {
+
+        peer->output_due += peer->pending[peer->pending_first].len;
+        peer->pending_first = (peer->pending_first + 1) % LCLOUD_SERVER_PENDING_MAX;
+        peer->pending_count -= 1;
+    }
+    if (peer->output_due == 0) {
+        return (0);
+    }
+    if (peer->output_commit > 0) {
+
+        int synced = checkSynced(peer->output_commit);
+        if (synced != 1) {
+            return ((synced == 0) ? commitPeer(peer, 1) : -1);
+        }
+    }
+    peer->output_commit = 0;  // Every write it has acknowledged is synced, the waiting ones' too
+    commitPeer(peer, 0);
+
+    size_t sent = 0;
+    while (sent < peer->output_due) {
+
+        ssize_t n = write(peer->sock, peer->output + sent, peer->output_due - sent);
+        if ((n == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if ((n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        }
+        if (n <= 0) {
+            return (-1);
+        }
+        sent += n;
+    }
+    memmove(peer->output, peer->output + sent, peer->output_len - sent);
+    peer->output_len -= sent;
+    peer->output_due -= sent;
+    return (0);
+}
@@ -0,0 +1,532 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_mrc.c
+//  Description    : This is an offline miss ratio curve tool for the LionCloud
+//                   block cache.  It replays a cmpsc311 workload through the
+//                   same block layout as the filesystem, computes LRU stack
+//                   distances in one pass (optionally SHARDS-sampled), and
+//                   replays the trace through the real cache for the other
+//                   policies.
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_assocarr.h>
+#include <cmpsc311_workload.h>
+
+// Project Includes
+#include <lcloud_controller.h>
+#include <lcloud_cache.h>
+
+// Defines
+#define LCLOUD_MRC_ARGUMENTS "hr:i:n:"
+#define LCLOUD_MRC_MAXFILES 256
+#define LCLOUD_MRC_MAXFILEBLOCKS 2048
+#define LCLOUD_MRC_SAMPLE_MODULUS (1 << 24)
+#define USAGE                                                                          \
+    "USAGE: lcloud_mrc [-h] [-r <rate>] [-i <interval>] [-n <maxblocks>] <hardware-manifest> <workload-file>\n" \
+    "\n"                                                                               \
+    "where:\n"                                                                         \
+    "    -h - help mode (display this message)\n"                                      \
+    "    -r - SHARDS sampling rate for the LRU curve, 0 < rate <= 1 (default 1)\n"     \
+    "    -i - cache size step between reported rows (default 16)\n"                    \
+    "    -n - largest cache size to report (default: number of distinct blocks)\n"     \
+    "\n"                                                                               \
+    "    <hardware-manifest> - the device definitions given to lcloud_server\n"        \
+    "    <workload-file> - file contain the workload to analyze\n"                     \
+    "\n"
+
+// Type definitions
+typedef struct {
+    LcDeviceId device_id;   // Device (and its geometry) from the manifest
+    int num_sectors;
+    int num_blocks;
+    char *used;             // Allocation map, sector major
+} MrcDevice;
+
+typedef struct {
+    char name[128];         // Open file and the device blocks holding it
+    int length;
+    int blocks[LCLOUD_MRC_MAXFILEBLOCKS][3];  // sector, block, device index
+} MrcFile;
+
+typedef struct {
+    uint64_t key;           // Block accessed (device/sector/block)
+    int lookup;             // 1 if lcloud_getcache was asked for it, 0 if only inserted
+} MrcReference;
+
+//
+// Global Data
+
+MrcDevice devices[LC_CACHE_MAXDEVICES];
+int num_devices = 0;
+MrcReference *trace = NULL;
+int trace_length = 0;
+int trace_size = 0;
+
+//
+// Functional Prototypes
+
+int loadManifest( char *manifest ); // Read the device geometry
+int buildTrace( char *wload ); // Map the workload onto block references
+int traceBlock( MrcFile *file, int section, int lookup ); // Append one block reference
+int allocateBlock( MrcFile *file, int section ); // Allocate a block like the filesystem
+int lruStackDistances( double rate, uint64_t *hist, int maxsize, uint64_t *lookups, int *distinct ); // LRU curve
+double replayTrace( int size, int admission ); // Hit ratio from the real cache
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the miss ratio curve tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+
+    // Local variables
+    int ch, interval = 16, maxsize = 0, distinct;
+    double rate = 1.0;
+    uint64_t lookups, *hist;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_MRC_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'r': // SHARDS sampling rate
+            rate = atof(optarg);
+            break;
+
+        case 'i': // Reporting interval
+            interval = atoi(optarg);
+            break;
+
+        case 'n': // Largest size reported
+            maxsize = atoi(optarg);
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    if ((argc - optind != 2) || (rate <= 0.0) || (rate > 1.0) || (interval <= 0) || (maxsize < 0)) {
+        fprintf(stderr, "Bad command line parameters, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+    initializeLogWithFilehandle(CMPSC311_LOG_STDOUT);
+
+    // Build the block reference trace
+    if ((loadManifest(argv[optind]) == -1) || (buildTrace(argv[optind + 1]) == -1)) {
+        return (-1);
+    }
+
+    // One pass over the trace gives the LRU hit ratio at every size
+    if (lruStackDistances(rate, NULL, 0, &lookups, &distinct) == -1) {
+        return (-1);
+    }
+    if (maxsize == 0) {
+        maxsize = distinct;
+    }
+    hist = calloc(maxsize + 2, sizeof(uint64_t));
+    if ((hist == NULL) || (lruStackDistances(rate, hist, maxsize, &lookups, &distinct) == -1)) {
+        return (-1);
+    }
+
+    logMessage(LOG_OUTPUT_LEVEL, "Workload [%s]: %d block references, %lu lookups, %d distinct blocks, sampling rate %.4f",
+        argv[optind + 1], trace_length, (unsigned long)lookups, distinct, rate);
+    logMessage(LOG_OUTPUT_LEVEL, "%8s %10s %14s", "blocks", "LRU hit%", "TinyLFU hit%");
+    uint64_t hits = 0;
+    for (int size = 1; size <= maxsize; size++) {
+
+        hits += hist[size];
+        if ((size % interval == 0) || (size == maxsize) || (size == LC_CACHE_MAXBLOCKS)) {
+
+            double lru = (lookups > 0) ? ((double)hits / (double)lookups) * 100 : 0.0;
+            double tinylfu = replayTrace(size, 1);
+            logMessage(LOG_OUTPUT_LEVEL, "%8d %9.2f%% %13.2f%%%s", size, lru, tinylfu,
+                (size == LC_CACHE_MAXBLOCKS) ? "  <- LC_CACHE_MAXBLOCKS" : "");
+        }
+    }
+
+    // Clean up and return successfully
+    for (int dev = 0; dev < num_devices; dev++) {
+        free(devices[dev].used);
+    }
+    free(hist);
+    free(trace);
+    freeLogRegistrations();
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadManifest
+// Description  : Read the "<id> <sectors> <blocks>" device lines of a hardware
+//                manifest, in ascending id order as DEVPROBE reports them
+//
+// Inputs       : manifest - the manifest filename
+// Outputs      : 0 if successful, -1 if failure
+
+int loadManifest( char *manifest )
+{
+
+    char line[256];
+    int id, sectors, blocks;
+    FILE *fh = fopen(manifest, "r");
+    if (fh == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failed opening hardware manifest [%s]", manifest);
+        return (-1);
+    }
+
+    while (fgets(line, sizeof(line), fh) != NULL) {
+
+        if ((line[0] == '#') || (sscanf(line, "%d %d %d", &id, &sectors, &blocks) != 3)) {
+            continue;
+        }
+        if ((id < 0) || (id >= LC_CACHE_MAXDEVICES) || (sectors <= 0) || (blocks <= 0) || (num_devices == LC_CACHE_MAXDEVICES)) {
+            logMessage(LOG_ERROR_LEVEL, "Bad device in hardware manifest [%s]", line);
+            fclose(fh);
+            return (-1);
+        }
+
+        int slot = num_devices++;  // Insertion sort by device id
+        while ((slot > 0) && (devices[slot - 1].device_id > id)) {
+            devices[slot] = devices[slot - 1];
+            slot--;
+        }
+        devices[slot].device_id = id;
+        devices[slot].num_sectors = sectors;
+        devices[slot].num_blocks = blocks;
+        devices[slot].used = calloc(sectors * blocks, sizeof(char));
+    }
+
+    fclose(fh);
+    return ((num_devices > 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buildTrace
+// Description  : Walk the workload, issuing the cache lookups and inserts that
+//                lcread and lcwrite would make for each operation
+//
+// Inputs       : wload - the workload filename
+// Outputs      : 0 if successful, -1 if failure
+
+int buildTrace( char *wload )
+{
+
+    workload_state state;
+    workload_operation operation;
+    AssocArray files;
+    MrcFile *file;
+
+    init_assoc(&files, stringCompareCallback, pointerCompareCallback);
+    if (openCmpsc311Workload(&state, wload)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed opening workload [%s]", wload);
+        return (-1);
+    }
+
+    do {
+
+        if (readCmpsc311Workload(&state, &operation)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed reading workload at line %d", state.lineno);
+            return (-1);
+        }
+
+        switch (operation.op) {
+
+        case WL_OPEN: // New, empty file
+            file = calloc(1, sizeof(MrcFile));
+            strncpy(file->name, operation.objname, sizeof(file->name) - 1);
+            memset(file->blocks, -1, sizeof(file->blocks));
+            insert_assoc(&files, file->name, file);
+            break;
+
+        case WL_READ: // Look up every block the read spans, inserting the misses
+            if ((file = find_assoc(&files, operation.objname)) == NULL) {
+                return (-1);
+            }
+            for (size_t pos = operation.pos; pos < operation.pos + operation.size; pos = (pos / 256 + 1) * 256) {
+                if (traceBlock(file, pos / 256, 1) == -1) {
+                    return (-1);
+                }
+            }
+            break;
+
+        case WL_WRITE: // Read-modify-write partial blocks, allocate blocks past the end
+            if ((file = find_assoc(&files, operation.objname)) == NULL) {
+                return (-1);
+            }
+            int overwrite = ((int)operation.pos != file->length);
+            for (size_t pos = operation.pos; pos < operation.pos + operation.size; pos = (pos / 256 + 1) * 256) {
+
+                int section = pos / 256;
+                if ((pos % 256 == 0) && (overwrite == 0)) {
+                    if (allocateBlock(file, section) == -1) {
+                        return (-1);
+                    }
+                }
+                if ((pos % 256 != 0) && (traceBlock(file, section, 1) == -1)) {
+                    return (-1);
+                }
+                if ((overwrite == 1) && (traceBlock(file, section, 1) == -1)) {
+                    return (-1);
+                }
+                if (traceBlock(file, section, 0) == -1) {
+                    return (-1);
+                }
+            }
+            if (operation.pos + operation.size > (size_t)file->length) {
+                file->length = operation.pos + operation.size;
+            }
+            break;
+
+        case WL_CLOSE: // Release the file's blocks
+            if ((file = find_assoc(&files, operation.objname)) == NULL) {
+                return (-1);
+            }
+            for (int section = 0; section < LCLOUD_MRC_MAXFILEBLOCKS; section++) {
+                if (file->blocks[section][0] != -1) {
+                    MrcDevice *dev = &devices[file->blocks[section][2]];
+                    dev->used[file->blocks[section][0] * dev->num_blocks + file->blocks[section][1]] = 0;
+                }
+            }
+            delete_assoc(&files, file->name);
+            free(file);
+            break;
+
+        default:
+            break;
+        }
+
+    } while (operation.op < WL_EOF);
+
+    closeCmpsc311Workload(&state);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateBlock
+// Description  : Give a file section the first free block, scanning devices in
+//                probe order and sectors/blocks in order, as choose_location
+//                does (which never allocates from device 0)
+//
+// Inputs       : file - the file being extended
+//                section - the 256-byte section of the file
+// Outputs      : 0 if successful, -1 if the devices are full
+
+int allocateBlock( MrcFile *file, int section )
+{
+
+    if (section >= LCLOUD_MRC_MAXFILEBLOCKS) {
+        return (-1);
+    }
+
+    for (int dev = 0; dev < num_devices; dev++) {
+
+        if (devices[dev].device_id == 0) {
+            continue;
+        }
+        for (int loc = 0; loc < devices[dev].num_sectors * devices[dev].num_blocks; loc++) {
+
+            if (devices[dev].used[loc] == 0) {
+                devices[dev].used[loc] = 1;
+                file->blocks[section][0] = loc / devices[dev].num_blocks;
+                file->blocks[section][1] = loc % devices[dev].num_blocks;
+                file->blocks[section][2] = dev;
+                return (0);
+            }
+        }
+    }
+
+    logMessage(LOG_ERROR_LEVEL, "Devices are full allocating block for [%s]", file->name);
+    return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : traceBlock
+// Description  : Append a reference to one of a file's blocks to the trace
+//
+// Inputs       : file - the file being accessed
+//                section - the 256-byte section of the file
+//                lookup - 1 for a cache lookup, 0 for an insert/update
+// Outputs      : 0 if successful, -1 if failure
+
+int traceBlock( MrcFile *file, int section, int lookup )
+{
+
+    if ((section >= LCLOUD_MRC_MAXFILEBLOCKS) || (file->blocks[section][0] == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Reference to unallocated block %d of [%s]", section, file->name);
+        return (-1);
+    }
+
+    uint64_t key = ((uint64_t)devices[file->blocks[section][2]].device_id << 32) |
+        ((uint64_t)file->blocks[section][0] << 16) | (uint64_t)file->blocks[section][1];
+
+    // An insert right after a missed lookup of the same block is the same reference
+    if ((lookup == 0) && (trace_length > 0) && (trace[trace_length - 1].key == key)) {
+        return (0);
+    }
+
+    if (trace_length == trace_size) {
+        trace_size = (trace_size == 0) ? 4096 : trace_size * 2;
+        trace = realloc(trace, trace_size * sizeof(MrcReference));
+        if (trace == NULL) {
+            return (-1);
+        }
+    }
+    trace[trace_length].key = key;
+    trace[trace_length].lookup = lookup;
+    trace_length++;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lruStackDistances
+// Description  : Compute the LRU stack distance of every reference in one pass.
+//                A Fenwick tree over reference times marks the latest access of
+//                each block, so the distance is the number of marks after the
+//                block's previous access.  With sampling, only blocks whose hash
+//                falls under the rate are processed and distances are scaled up
+//                by 1/rate (SHARDS).
+//
+// Inputs       : rate - fraction of blocks sampled
+//                hist - lookups per stack distance, [maxsize+1] is "further",
+//                       NULL to only count
+//                maxsize - largest distance kept in the histogram
+//                lookups - set to the number of (sampled) lookups
+//                distinct - set to the (estimated) number of distinct blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int lruStackDistances( double rate, uint64_t *hist, int maxsize, uint64_t *lookups, int *distinct )
+{
+
+    int *tree = calloc(trace_length + 1, sizeof(int));
+    int slots = 1;
+    while (slots < trace_length * 2) {
+        slots *= 2;
+    }
+    uint64_t *keys = malloc(slots * sizeof(uint64_t));  // Open addressed key -> last reference time
+    int *last = malloc(slots * sizeof(int));
+    if ((tree == NULL) || (keys == NULL) || (last == NULL)) {
+        return (-1);
+    }
+    memset(keys, 0xff, slots * sizeof(uint64_t));
+
+    uint64_t threshold = (uint64_t)(rate * LCLOUD_MRC_SAMPLE_MODULUS);
+    int seen = 0;
+    *lookups = 0;
+    for (int t = 0; t < trace_length; t++) {
+
+        uint64_t key = trace[t].key;
+        uint64_t hash = key + 0x9e3779b97f4a7c15ULL;
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+        hash = hash ^ (hash >> 31);
+        if ((hash % LCLOUD_MRC_SAMPLE_MODULUS) >= threshold) {
+            continue;
+        }
+
+        int slot = hash & (slots - 1);
+        while ((keys[slot] != UINT64_MAX) && (keys[slot] != key)) {
+            slot = (slot + 1) & (slots - 1);
+        }
+
+        uint64_t distance = UINT64_MAX;
+        if (keys[slot] == key) {  // Count the blocks touched since the last access
+
+            int count = 0;
+            for (int i = t; i > 0; i -= i & -i) {
+                count += tree[i];
+            }
+            for (int i = last[slot] + 1; i > 0; i -= i & -i) {
+                count -= tree[i];
+            }
+            distance = (uint64_t)((count + 1) / rate);
+            for (int i = last[slot] + 1; i <= trace_length; i += i & -i) {
+                tree[i] -= 1;
+            }
+        }
+        else {
+            keys[slot] = key;
+            seen++;
+        }
+        for (int i = t + 1; i <= trace_length; i += i & -i) {
+            tree[i] += 1;
+        }
+        last[slot] = t;
+
+        if (trace[t].lookup == 1) {
+            *lookups += 1;
+            if (hist != NULL) {
+                hist[(distance <= (uint64_t)maxsize) ? distance : (uint64_t)maxsize + 1] += 1;
+            }
+        }
+    }
+
+    *distinct = (int)(seen / rate);
+    free(tree);
+    free(keys);
+    free(last);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replayTrace
+// Description  : Run the trace through the real block cache the way the
+//                filesystem drives it and report the hit ratio
+//
+// Inputs       : size - cache size in blocks
+//                admission - 1 to enable the TinyLFU admission filter
+// Outputs      : hit percentage, -1 if failure
+
+double replayTrace( int size, int admission )
+{
+
+    LcCacheStats stats;
+    char block[LC_DEVICE_BLOCK_SIZE] = {0};
+
+    lcloud_setcacheadmission(admission);
+    if (lcloud_initcache(size) == -1) {
+        return (-1);
+    }
+
+    for (int t = 0; t < trace_length; t++) {
+
+        LcDeviceId did = trace[t].key >> 32;
+        uint16_t sec = (trace[t].key >> 16) & 0xffff;
+        uint16_t blk = trace[t].key & 0xffff;
+        if ((trace[t].lookup == 0) || (lcloud_copycache(did, sec, blk, block) == -1)) {
+            lcloud_putcache(did, sec, blk, block);
+        }
+    }
+
+    lcloud_getcachestats(&stats);
+    lcloud_closecache();
+    uint64_t lookups = stats.total[LC_CACHE_HIT] + stats.total[LC_CACHE_MISS];
+    return ((lookups > 0) ? ((double)stats.total[LC_CACHE_HIT] / (double)lookups) * 100 : 0.0);
+}
@@ -21,10 +21,18 @@
 #define LCLOUD_NET_HEADER_SIZE sizeof(LCloudRegisterFrame)
 #define LCLOUD_DEFAULT_IP "127.0.0.1"
 #define LCLOUD_DEFAULT_PORT 24567
-
-// Global data
-
-int socket_handle;
+#define LCLOUD_UNIX_PREFIX "unix:"    // Server addresses naming a unix domain socket
+#define LCLOUD_PIPELINE_DEPTH 1       // Default requests outstanding on the connection (1 waits for each response)
+#define LCLOUD_PIPELINE_MAXDEPTH 64   // Most requests outstanding on the connection
+#define LCLOUD_BATCH_MAXSIZE 128      // Most requests in a batch
+#define LCLOUD_POOL_SIZE 1            // Default connections to the server
+#define LCLOUD_POOL_MAXSIZE 16        // Most connections to the server
+#define LCLOUD_SERVERS_MAX 8          // Most servers the devices are spread over
+#define LCLOUD_MAX_DEVICES 16         // Devices a probe can report, over all the servers
+#define LCLOUD_ENGINE_BLOCKING 0      // Batches move with writev/readv
+#define LCLOUD_ENGINE_URING 1         // Batches move through an io_uring, where the kernel has it
+#define LCLOUD_HEDGE_SAMPLES 1024     // Recent read latencies the hedge delay is taken from
+#define LCLOUD_HEDGE_MINSAMPLES 64    // Reads before the first hedge, and between working the delay out again
 
 //
 // Functional Prototypes
@@ -33,5 +41,26 @@ LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void *buf
 	// This is the implementation of the client operation, as implemented 
 	//  by the 311 student code.
 
+int client_lcloud_bus_batch(LCloudRegisterFrame *regs, void **bufs, LCloudRegisterFrame *rframes, int count);
+	// Send a batch of block transfers, keeping up to the pipeline depth
+	//  of them outstanding on every connection to every server at once,
+	//  and collect their responses in order
+
+int client_lcloud_setpipeline(int depth);
+	// Set the most block transfers a batch keeps outstanding
+
+int client_lcloud_setserver(const char *address);
+	// Set the server address(es), "shm:/name", "unix:/path" or "ip[:port]",
+	//  comma separated to spread the devices over several servers
+
+int client_lcloud_setpool(int size);
+	// Set the number of connections requests are spread over by device
+
+int client_lcloud_setengine(int engine);
+	// Set how batches move over socket connections, blocking or io_uring
+
+int client_lcloud_sethedge(int percentile);
+	// Set the read latency percentile past which a read is sent again on a second connection
+
 
 #endif
@@ -0,0 +1,463 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_ring.c
+//  Description    : This is the implementation of the shared memory ring
+//                   transport for the LionCloud client and the local server
+//                   stand-in.  Each ring has one producer and one consumer,
+//                   so moving data needs no locks, only ordered updates of
+//                   the head and tail.  A side with nothing to do polls for a
+//                   while, then sleeps on a futex the other side wakes.
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <cmpsc311_log.h>
+#include <lcloud_ring.h>
+
+//
+// Type definitions
+
+typedef struct {
+    LcRingSegment *segment;  //the client's mapping of a server's segment, NULL if the slot is free
+    char name[256];
+    int claims;  //channels in it this process holds, it stays mapped until they are released
+} RingAttachment;
+
+//
+// Global data
+
+int poll_spins = 0;  //polls of an empty (or full) ring before sleeping
+RingAttachment attachments[LCLOUD_RING_SEGMENTS];  //one per server, connections to several run at once
+pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;  //guards attachments, connections claim channels concurrently
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peer_alive
+// Description  : checks whether the process at the other end of a ring still
+//                exists
+//
+// Inputs       : pid - the process, 0 if not known yet
+// Outputs      : 1 if it is (or isn't known), 0 if it is gone
+int peer_alive(pid_t pid) {
+
+    return((pid == 0) || (kill(pid, 0) == 0) || (errno != ESRCH));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_wake
+// Description  : bumps a futex after moving the head or tail, waking the
+//                other side if it went to sleep on it
+//
+// Inputs       : seq - the futex
+//                waiting - set by a sleeper
+// Outputs      : none
+void ring_wake(uint32_t *seq, uint32_t *waiting) {
+
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) == 1) {
+        syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_wait
+// Description  : waits for the other side to move a ring's head or tail away
+//                from the value seen.  It polls first, then sleeps on the
+//                futex.  The waiting flag is raised before the last check,
+//                and the futex only sleeps if nothing was bumped since it was
+//                read, so a wakeup can't slip in between.  Sleeps time out
+//                to check that the other side is still alive.
+//
+// Inputs       : watched - the head or tail to watch
+//                seen - its value when the ring was found empty (or full)
+//                seq, waiting - the futex the other side bumps
+//                closed - the ring's hang up flag, NULL if a hang up doesn't matter
+//                peer - the process at the other end
+// Outputs      : 0 once it moved (or the ring was hung up), -1 if the other side is gone
+int ring_wait(uint64_t *watched, uint64_t seen, uint32_t *seq, uint32_t *waiting, uint32_t *closed, pid_t peer) {
+
+    for (int spin = 0; spin < poll_spins; spin++) {
+
+        if ((__atomic_load_n(watched, __ATOMIC_ACQUIRE) != seen) || ((closed != NULL) && (__atomic_load_n(closed, __ATOMIC_ACQUIRE) == 1))) {
+            return(0);
+        }
+        sched_yield();  //let the other side run if it shares the processor
+    }
+
+    struct timespec timeout = { 0, LCLOUD_RING_WAIT_MS * 1000000L };
+    while (1) {
+
+        uint32_t value = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(watched, __ATOMIC_SEQ_CST) != seen) || ((closed != NULL) && (__atomic_load_n(closed, __ATOMIC_SEQ_CST) == 1))) {
+            break;
+        }
+        if ((syscall(SYS_futex, seq, FUTEX_WAIT, value, &timeout, NULL, 0) == -1) && (errno == ETIMEDOUT) && (peer_alive(peer) == 0)) {
+            __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+            return(-1);
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_write
+// Description  : writes all of a buffer to a ring, as much at a time as there
+//                is space for, publishing each piece with the head
+//
+// Inputs       : ring - the ring, this process its producer
+//                buf - the bytes
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if the consumer is gone
+
+int lcloud_ring_write( LcRing *ring, const void *buf, size_t len ) {
+
+    size_t done = 0;
+    while (done < len) {
+
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        size_t space = LCLOUD_RING_SIZE - (size_t)(head - tail);
+        if (space == 0) {
+
+            if (ring_wait(&ring->tail, tail, &ring->space_seq, &ring->space_waiting, NULL, ring->consumer) == -1) {
+                return( -1 );
+            }
+            continue;
+        }
+
+        size_t count = (len - done < space) ? len - done : space;
+        size_t offset = head & (LCLOUD_RING_SIZE - 1);
+        size_t first = (count < LCLOUD_RING_SIZE - offset) ? count : LCLOUD_RING_SIZE - offset;  //up to the end of the ring, then wrap
+        memcpy(&ring->data[offset], (const char *)buf + done, first);
+        memcpy(ring->data, (const char *)buf + done + first, count - first);
+        __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+        ring_wake(&ring->data_seq, &ring->data_waiting);
+        done += count;
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_read
+// Description  : reads a full buffer from a ring, as much at a time as has
+//                been written, handing the space back with the tail
+//
+// Inputs       : ring - the ring, this process its consumer
+//                buf - room for the bytes
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if the producer hung up (or is gone) first
+
+int lcloud_ring_read( LcRing *ring, void *buf, size_t len ) {
+
+    size_t done = 0;
+    while (done < len) {
+
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t available = (size_t)(head - tail);
+        if (available == 0) {
+
+            if ((__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) == 1) ||
+                (ring_wait(&ring->head, head, &ring->data_seq, &ring->data_waiting, &ring->closed, ring->producer) == -1)) {
+                if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == head) {
+                    return( -1 );
+                }
+            }
+            continue;
+        }
+
+        size_t count = (len - done < available) ? len - done : available;
+        size_t offset = tail & (LCLOUD_RING_SIZE - 1);
+        size_t first = (count < LCLOUD_RING_SIZE - offset) ? count : LCLOUD_RING_SIZE - offset;
+        memcpy((char *)buf + done, &ring->data[offset], first);
+        memcpy((char *)buf + done + first, ring->data, count - first);
+        __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+        ring_wake(&ring->space_seq, &ring->space_waiting);
+        done += count;
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_create
+// Description  : Make the server's ring segment, replacing one left behind by
+//                an earlier run.  Every channel starts free, with the server
+//                at the far end of its rings.
+//
+// Inputs       : name - the POSIX shared memory name
+// Outputs      : the segment, NULL if failure
+
+LcRingSegment * lcloud_ring_create( const char *name ) {
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment create failed [%s] : %s", name, strerror(errno));
+        return( NULL );
+    }
+    if (ftruncate(fd, sizeof(LcRingSegment)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment size failed [%s] : %s", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return( NULL );
+    }
+    LcRingSegment *segment = mmap(NULL, sizeof(LcRingSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment map failed [%s] : %s", name, strerror(errno));
+        shm_unlink(name);
+        return( NULL );
+    }
+
+    segment->channels = LCLOUD_RING_CHANNELS;
+    segment->server = getpid();
+    for (int i = 0; i < LCLOUD_RING_CHANNELS; i++) {
+
+        segment->channel[i].requests.consumer = segment->server;
+        segment->channel[i].responses.producer = segment->server;
+    }
+    segment->version = LCLOUD_RING_VERSION;
+    __atomic_store_n(&segment->magic, LCLOUD_RING_MAGIC, __ATOMIC_RELEASE);  //ready for clients
+
+    /* Return successfully */
+    return( segment );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_destroy
+// Description  : Unmap and remove the server's ring segment
+//
+// Inputs       : segment - the segment
+//                name - its POSIX shared memory name
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_ring_destroy( LcRingSegment *segment, const char *name ) {
+
+    munmap(segment, sizeof(LcRingSegment));
+    if (shm_unlink(name) == -1) {
+        return( -1 );
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_attach
+// Description  : finds this process's mapping of a server's segment, mapping
+//                it if there is none (attach_lock held)
+//
+// Inputs       : name - the POSIX shared memory name
+// Outputs      : the slot in attachments, -1 if failure
+int ring_attach(const char *name) {
+
+    int slot = -1;
+    for (int i = 0; i < LCLOUD_RING_SEGMENTS; i++) {
+
+        if ((attachments[i].segment != NULL) && (strcmp(attachments[i].name, name) == 0)) {
+            return(i);
+        }
+        if ((attachments[i].segment == NULL) && (slot == -1)) {
+            slot = i;
+        }
+    }
+    if ((slot == -1) || (strlen(name) >= sizeof(attachments[slot].name))) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment [%s] can't be attached, too many segments (or too long a name)", name);
+        return(-1);
+    }
+
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment open failed [%s] : %s", name, strerror(errno));
+        return(-1);
+    }
+    struct stat info;
+    if ((fstat(fd, &info) == -1) || (info.st_size != sizeof(LcRingSegment))) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment [%s] has the wrong size", name);
+        close(fd);
+        return(-1);
+    }
+    LcRingSegment *segment = mmap(NULL, sizeof(LcRingSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment map failed [%s] : %s", name, strerror(errno));
+        return(-1);
+    }
+    if ((__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != LCLOUD_RING_MAGIC) || (segment->version != LCLOUD_RING_VERSION)) {
+        logMessage(LOG_ERROR_LEVEL, "Ring segment [%s] is not a version %d ring segment", name, LCLOUD_RING_VERSION);
+        munmap(segment, sizeof(LcRingSegment));
+        return(-1);
+    }
+
+    attachments[slot].segment = segment;
+    strcpy(attachments[slot].name, name);
+    attachments[slot].claims = 0;
+    return(slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_detach
+// Description  : unmaps a segment once none of its channels is claimed, so a
+//                restarted server's new segment is mapped by the next claim
+//                (attach_lock held)
+//
+// Inputs       : slot - the slot in attachments
+// Outputs      : none
+void ring_detach(int slot) {
+
+    if (attachments[slot].claims == 0) {
+
+        munmap(attachments[slot].segment, sizeof(LcRingSegment));
+        attachments[slot].segment = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_claim
+// Description  : Attach to a server's ring segment (mapped once per process
+//                for as long as any of its channels is claimed) and claim a
+//                free channel for a connection
+//
+// Inputs       : name - the POSIX shared memory name
+// Outputs      : the channel, NULL if failure (no segment, or every channel taken)
+
+LcRingChannel * lcloud_ring_claim( const char *name ) {
+
+    pthread_mutex_lock(&attach_lock);
+    int slot = ring_attach(name);
+    if (slot == -1) {
+        pthread_mutex_unlock(&attach_lock);
+        return( NULL );
+    }
+
+    for (int i = 0; i < LCLOUD_RING_CHANNELS; i++) {
+
+        LcRingChannel *channel = &attachments[slot].segment->channel[i];
+        uint32_t free_channel = 0;
+        if (__atomic_compare_exchange_n(&channel->claimed, &free_channel, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+
+            channel->requests.producer = getpid();
+            channel->responses.consumer = getpid();
+            attachments[slot].claims += 1;
+            pthread_mutex_unlock(&attach_lock);
+            return( channel );
+        }
+    }
+
+    logMessage(LOG_ERROR_LEVEL, "Ring segment [%s] has no free channel", name);
+    ring_detach(slot);
+    pthread_mutex_unlock(&attach_lock);
+    return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_release
+// Description  : Hang up a claimed channel.  The server reads what is left,
+//                then resets the channel and frees it.  The segment is
+//                unmapped with its last claimed channel.
+//
+// Inputs       : channel - the channel
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_ring_release( LcRingChannel *channel ) {
+
+    __atomic_store_n(&channel->requests.closed, 1, __ATOMIC_RELEASE);
+    ring_wake(&channel->requests.data_seq, &channel->requests.data_waiting);
+
+    pthread_mutex_lock(&attach_lock);
+    for (int i = 0; i < LCLOUD_RING_SEGMENTS; i++) {
+
+        LcRingSegment *segment = attachments[i].segment;
+        if ((segment != NULL) && (channel >= &segment->channel[0]) && (channel < &segment->channel[LCLOUD_RING_CHANNELS])) {
+
+            attachments[i].claims -= 1;
+            ring_detach(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&attach_lock);
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_reset
+// Description  : Empty a channel its client has hung up (or whose client
+//                died) and free it for the next client
+//
+// Inputs       : channel - the channel
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_ring_reset( LcRingChannel *channel ) {
+
+    LcRing *rings[2] = { &channel->requests, &channel->responses };
+    for (int i = 0; i < 2; i++) {
+
+        rings[i]->head = 0;
+        rings[i]->tail = 0;
+        rings[i]->closed = 0;
+    }
+    channel->requests.producer = 0;
+    channel->responses.consumer = 0;
+    __atomic_store_n(&channel->claimed, 0, __ATOMIC_RELEASE);
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_ring_setpoll
+// Description  : Set how many times an empty (or full) ring is polled before
+//                this process sleeps on it.  Polling trades processor time
+//                for latency, 0 sleeps at once.
+//
+// Inputs       : spins - the number of polls
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_ring_setpoll( int spins ) {
+
+    if (spins < 0) {
+        return( -1 );
+    }
+    poll_spins = spins;
+
+    /* Return successfully */
+    return( 0 );
+}
@@ -0,0 +1,94 @@
+#ifndef LCLOUD_RING_INCLUDED
+#define LCLOUD_RING_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_ring.h
+//  Description    : This is the shared memory ring transport for the
+//                   LionCloud client and the local server stand-in.  A
+//                   segment holds channels, each a pair of single-producer/
+//                   single-consumer byte rings (requests one way, responses
+//                   the other) that carry the same frames as the sockets.
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Includes
+#include <stdint.h>
+#include <sys/types.h>
+
+// Defines
+#define LCLOUD_RING_PREFIX "shm:"          // Server addresses naming a ring segment
+#define LCLOUD_RING_MAGIC 0x474e524c       // "LRNG", marks a ring segment
+#define LCLOUD_RING_VERSION 1              // Segment layout, client and server must agree on it
+#define LCLOUD_RING_SIZE (64 * 1024)       // Bytes in each ring (power of two)
+#define LCLOUD_RING_CHANNELS 16            // Channels in a segment, one per client connection
+#define LCLOUD_RING_SEGMENTS 8             // Segments a client can have channels in at once, one per server
+#define LCLOUD_RING_WAIT_MS 100            // Sleep between checks that the other side is still alive
+
+// Type definitions
+
+/* One direction of a channel, the producer only moves head and the consumer only tail */
+typedef struct {
+    uint64_t head;           // Bytes written, ever
+    char pad_head[56];
+    uint64_t tail;           // Bytes read, ever
+    char pad_tail[56];
+    uint32_t data_seq;       // Futex bumped after every write ...
+    uint32_t data_waiting;   // ... woken if the consumer sleeps on it
+    uint32_t space_seq;      // Futex bumped after every read ...
+    uint32_t space_waiting;  // ... woken if the producer sleeps on it
+    uint32_t closed;         // The producer hung up, what is left can still be read
+    pid_t producer;          // The processes at each end, a waiting side checks the other is alive
+    pid_t consumer;
+    char pad[36];
+    char data[LCLOUD_RING_SIZE];
+} LcRing;
+
+/* A client connection, held by one client at a time */
+typedef struct {
+    uint32_t claimed;        // 1 from the client's claim until the server has reset the channel
+    uint32_t pad[15];
+    LcRing requests;         // Client to server
+    LcRing responses;        // Server to client
+} LcRingChannel;
+
+/* The shared memory segment, made by the server */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t channels;
+    pid_t server;
+    uint32_t pad[12];
+    LcRingChannel channel[LCLOUD_RING_CHANNELS];
+} LcRingSegment;
+
+//
+// Functional Prototypes
+
+LcRingSegment * lcloud_ring_create( const char *name );
+    // Make (or remake) a ring segment, for the server
+
+int lcloud_ring_destroy( LcRingSegment *segment, const char *name );
+    // Unmap and remove a ring segment
+
+LcRingChannel * lcloud_ring_claim( const char *name );
+    // Attach to a server's segment and claim a free channel, for a client
+
+int lcloud_ring_release( LcRingChannel *channel );
+    // Hang up a claimed channel, the server resets it for the next client
+
+int lcloud_ring_reset( LcRingChannel *channel );
+    // Empty a channel the client has hung up and free it, for the server
+
+int lcloud_ring_write( LcRing *ring, const void *buf, size_t len );
+    // Write all of a buffer to a ring, waiting for space as needed
+
+int lcloud_ring_read( LcRing *ring, void *buf, size_t len );
+    // Read a full buffer from a ring, waiting for data as needed
+
+int lcloud_ring_setpoll( int spins );
+    // Set how many times a ring is polled before sleeping on it
+
+#endif
@@ -23,19 +23,38 @@
 #include <unistd.h>
 
 // Project Includes
+#include <lcloud_cache.h>
 #include <lcloud_controller.h>
 #include <lcloud_filesys.h>
+#include <lcloud_network.h>
+#include <lcloud_ring.h>
 #include <lcloud_support.h>
 
 // Defines
-#define LCLOUD_ARGUMENTS "hvl:x:"
+#define LCLOUD_ARGUMENTS "hvawpfgil:s:2:c:m:d:n:t:b:e:x:"
 #define USAGE                                                       \
-    "USAGE: lcloud_sim [-h] [-v] [-l <logfile>] <workload-file>\n"  \
+    "USAGE: lcloud_sim [-h] [-v] [-a] [-w] [-p] [-f] [-g] [-i] [-l <logfile>] [-s <statsfile>] [-2 <l2file>] [-c <snapshot>] [-m <shmname>] [-d <depth>] [-n <connections>] [-t <server>[,<server>...]] [-b <spins>] [-e <percentile>] <workload-file>\n" \
     "\n"                                                            \
     "where:\n"                                                      \
     "    -h - help mode (display this message)\n"                   \
     "    -v - verbose output\n"                                     \
+    "    -a - filter cache admissions by block popularity\n"        \
+    "    -w - write-back cache (writes reach devices on eviction)\n" \
+    "    -p - prefetch blocks predicted from the cache misses\n"     \
+    "    -f - write dirty blocks back in the background (with -w)\n"  \
+    "    -g - estimate the hits a larger cache would add\n"        \
+    "    -i - move block transfer batches through io_uring\n"      \
     "    -l - write log messages to the filename <logfile>\n"       \
+    "    -s - dump cache statistics as JSON to <statsfile>\n"       \
+    "    -2 - add a second tier cache in the local file <l2file>\n"  \
+    "    -c - save the cache to <snapshot> at exit, warm it from there at start\n" \
+    "    -m - share the cache with other processes in shared memory <shmname>\n" \
+    "    -d - keep up to <depth> block transfers outstanding on the connection\n" \
+    "    -n - spread the devices over <connections> connections to the server\n" \
+    "    -t - connect to <server>, shm:<name>, unix:<path> or <ip>[:<port>],\n" \
+    "         a comma separated list spreads the devices over several servers\n" \
+    "    -b - poll an empty shared memory ring <spins> times before sleeping on it\n" \
+    "    -e - repeat reads slower than <percentile> of recent reads on a second connection\n" \
     "\n"                                                            \
     "    <workload-file> - file contain the workload to simulate\n" \
     "\n"
@@ -65,7 +84,7 @@ int main(int argc, char* argv[])
 {
 
     // Local variables
-    int ch, verbose = 0, log_initialized = 0;
+    int ch, verbose = 0, log_initialized = 0, write_back = 0, flusher = 0;
 
     // Process the command line parameters
     while ((ch = getopt(argc, argv, LCLOUD_ARGUMENTS)) != -1) {
@@ -79,17 +98,115 @@ int main(int argc, char* argv[])
             verbose = 1;
             break;
 
+        case 'a': // Cache admission filter
+            lcloud_setcacheadmission(1);
+            break;
+
+        case 'w': // Write-back cache
+            lcloud_setcachewriteback(1);
+            write_back = 1;
+            break;
+
+        case 'p': // Cache prefetching
+            lcloud_setcacheprefetch(1);
+            break;
+
+        case 'f': // Write-behind flusher
+            if (lcloud_setcacheflusher(LC_CACHE_DIRTY_BACKGROUND, LC_CACHE_DIRTY_HARD, LC_CACHE_DIRTY_AGE) == -1) {
+                fprintf(stderr, "Bad write-behind thresholds, aborting.\n");
+                return (-1);
+            }
+            flusher = 1;
+            break;
+
+        case 'g': // Cache size advisor
+            lcloud_setcacheadvisor(1);
+            break;
+
+        case '2': // Second tier cache file
+            if (lcloud_setcachel2(optarg, LC_CACHE_L2_MAXBLOCKS) == -1) {
+                fprintf(stderr, "Bad second tier cache file (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'c': // Warm-cache snapshot
+            if (lcloud_setcachesnapshot(optarg) == -1) {
+                fprintf(stderr, "Bad cache snapshot file (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Cross-process shared cache
+            if (lcloud_setcacheshared(optarg) == -1) {
+                fprintf(stderr, "Bad shared memory name (%s), it must start with '/', aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'd': // Pipeline depth
+            if (client_lcloud_setpipeline(atoi(optarg)) == -1) {
+                fprintf(stderr, "Bad pipeline depth (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'n': // Connection pool size
+            if (client_lcloud_setpool(atoi(optarg)) == -1) {
+                fprintf(stderr, "Bad number of connections (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 't': // Server address
+            if (client_lcloud_setserver(optarg) == -1) {
+                fprintf(stderr, "Bad server address (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'i': // io_uring engine
+            client_lcloud_setengine(LCLOUD_ENGINE_URING);
+            break;
+
+        case 'b': // Ring polling
+            if (lcloud_ring_setpoll(atoi(optarg)) == -1) {
+                fprintf(stderr, "Bad polling count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'e': // Hedged reads
+            if ((atoi(optarg) <= 0) || (client_lcloud_sethedge(atoi(optarg)) == -1)) {
+                fprintf(stderr, "Bad hedge percentile (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
         case 'l': // Set the log filename
             initializeLogWithFilename(optarg);
             log_initialized = 1;
             break;
 
+        case 's': // Dump the cache statistics at shutdown
+            if (lcloud_setcachestatsfile(optarg) == -1) {
+                fprintf(stderr, "Bad statistics file (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
         default: // Default (unknown)
             fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
             return (-1);
         }
     }
 
+    // Write-behind only has dirty blocks to write with the write-back cache
+    if ((flusher == 1) && (write_back == 0)) {
+        fprintf(stderr, "Write-behind (-f) needs the write-back cache (-w), aborting.\n");
+        return (-1);
+    }
+
     // Setup the log as needed
     if (!log_initialized) {
         initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
@@ -0,0 +1,213 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_uring.c
+//  Description    : This is the implementation of the small io_uring wrapper
+//                   for the LionCloud client.  There is no liburing here, so
+//                   the rings are set up, mapped and driven with the raw
+//                   system calls.
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <cmpsc311_log.h>
+#include <lcloud_uring.h>
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_uring_init
+// Description  : Set up a ring, map its queues and register its send and
+//                receive areas as fixed buffers 0 and 1
+//
+// Inputs       : none
+// Outputs      : the ring, NULL if io_uring is unavailable (or failed)
+
+LcUring * lcloud_uring_init( void ) {
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, LCLOUD_URING_ENTRIES, &params);
+    if (fd == -1) {
+        logMessage(LOG_INFO_LEVEL, "io_uring unavailable : %s", strerror(errno));
+        return( NULL );
+    }
+
+    LcUring *ring = calloc(1, sizeof(LcUring));
+    if (ring == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "io_uring setup failed : %s", strerror(errno));
+        close(fd);
+        return( NULL );
+    }
+    ring->fd = fd;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && (ring->cq_map_size > ring->sq_map_size)) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_map
+        : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->send_area = aligned_alloc(4096, LCLOUD_URING_AREA_SIZE);
+    ring->receive_area = aligned_alloc(4096, LCLOUD_URING_AREA_SIZE);
+    if ((ring->sq_map == MAP_FAILED) || (ring->cq_map == MAP_FAILED) || (ring->sqes == MAP_FAILED) || (ring->send_area == NULL) || (ring->receive_area == NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "io_uring setup failed : %s", strerror(errno));
+        lcloud_uring_exit(ring);
+        return( NULL );
+    }
+
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    struct iovec areas[2] = { { ring->send_area, LCLOUD_URING_AREA_SIZE }, { ring->receive_area, LCLOUD_URING_AREA_SIZE } };
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, areas, 2) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "io_uring buffer registration failed : %s", strerror(errno));
+        lcloud_uring_exit(ring);
+        return( NULL );
+    }
+
+    /* Return successfully */
+    return( ring );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_uring_exit
+// Description  : Tear a ring down, with its mappings and areas
+//
+// Inputs       : ring - the ring
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_uring_exit( LcUring *ring ) {
+
+    if ((ring->sqes != NULL) && (ring->sqes != MAP_FAILED)) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if ((ring->cq_map != NULL) && (ring->cq_map != MAP_FAILED) && (ring->cq_map != ring->sq_map)) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if ((ring->sq_map != NULL) && (ring->sq_map != MAP_FAILED)) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);  //drops the buffer registration too
+    free(ring->send_area);
+    free(ring->receive_area);
+    free(ring);
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_uring_queue
+// Description  : Queue a fixed-buffer read or write between a file
+//                descriptor and part of one of the registered areas
+//
+// Inputs       : ring - the ring
+//                opcode - IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED
+//                fd - the file descriptor (a socket)
+//                area - 0 for the send area, 1 for the receive area
+//                offset, len - the part of the area
+//                tag - handed back with the completion
+// Outputs      : 0 if successful, -1 if the submission queue is full
+
+int lcloud_uring_queue( LcUring *ring, int opcode, int fd, int area, size_t offset, size_t len, uint64_t tag ) {
+
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= LCLOUD_URING_ENTRIES) {
+        return( -1 );
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(((area == 0) ? ring->send_area : ring->receive_area) + offset);
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;  //the socket's own position, it has no offsets
+    sqe->buf_index = area;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit += 1;
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_uring_enter
+// Description  : Submit what is queued and wait for completions, in one
+//                system call
+//
+// Inputs       : ring - the ring
+//                wait - the completions to wait for, 0 to only submit
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_uring_enter( LcUring *ring, unsigned wait ) {
+
+    while (1) {
+
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, (wait > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if ((submitted == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (submitted == -1) {
+            return( -1 );
+        }
+        ring->to_submit -= submitted;
+        break;
+    }
+
+    /* Return successfully */
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_uring_reap
+// Description  : Take the next completion off the completion queue
+//
+// Inputs       : ring - the ring
+//                tag - set to the tag of the request
+//                result - set to its result (bytes moved, or -errno)
+// Outputs      : 0 if there was a completion, -1 if there was none
+
+int lcloud_uring_reap( LcUring *ring, uint64_t *tag, int *result ) {
+
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return( -1 );
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *tag = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    /* Return successfully */
+    return( 0 );
+}
@@ -0,0 +1,60 @@
+#ifndef LCLOUD_URING_INCLUDED
+#define LCLOUD_URING_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_uring.h
+//  Description    : This is a small io_uring wrapper for the LionCloud
+//                   client, set up with the raw system calls.  Each ring
+//                   comes with a registered send area and receive area, so
+//                   fixed-buffer reads and writes skip pinning the pages on
+//                   every request.
+//
+//   Author        : Jonathan Mychack
+//   Last Modified : 4/30/20
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Defines
+#define LCLOUD_URING_ENTRIES 8                // Submission queue entries, a batch has a send and a receive in flight
+#define LCLOUD_URING_AREA_SIZE (256 * 1024)   // Bytes in each registered area
+
+// Type definitions
+
+/* A ring, its mappings and its registered areas */
+typedef struct {
+    int fd;                          // The io_uring file descriptor
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;           // Mappings to undo at exit
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned to_submit;              // Entries queued since the last enter
+    char *send_area;                 // Registered buffer 0
+    char *receive_area;              // Registered buffer 1
+} LcUring;
+
+//
+// Functional Prototypes
+
+LcUring * lcloud_uring_init( void );
+    // Set up a ring and register its areas, NULL if io_uring is unavailable
+
+int lcloud_uring_exit( LcUring *ring );
+    // Tear a ring down
+
+int lcloud_uring_queue( LcUring *ring, int opcode, int fd, int area, size_t offset, size_t len, uint64_t tag );
+    // Queue a fixed-buffer read or write of part of an area
+
+int lcloud_uring_enter( LcUring *ring, unsigned wait );
+    // Submit what is queued and wait for at least this many completions
+
+int lcloud_uring_reap( LcUring *ring, uint64_t *tag, int *result );
+    // Take the next completion, 0 if one was there, -1 if none
+
+#endif